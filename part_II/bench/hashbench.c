@@ -0,0 +1,100 @@
+// Throughput of hash_bytes() across string lengths, next to the FNV-1a that hash_string() used
+// before, and how evenly it spreads similar keys over power of two tables. Build with
+// -DCMAKE_BUILD_TYPE=Release, the numbers mean little without optimization.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "hash.h"
+
+// every length hashes about this many bytes in total
+#define BENCH_BYTES (256u * 1024 * 1024)
+#define BUCKET_BITS 16
+
+static const size_t lengths[] = { 4, 8, 16, 32, 64, 256, 1024, 4096, 65536 };
+#define LENGTH_COUNT (sizeof(lengths) / sizeof(lengths[0]))
+
+static uint64_t fnv1a(const char* bytes, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// static like fnv1a(), so that both are inlined the same way
+static uint64_t xxhash(const char* bytes, size_t length) { return hash_bytes(bytes, length); }
+
+static double now()
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// the hashes are summed and printed, so that the loop can't be dropped, and the start moves by a
+// byte each time to cover every alignment
+static double bench(uint64_t (*hash)(const char*, size_t), const char* buffer, size_t length,
+    uint64_t* sum)
+{
+    size_t count = BENCH_BYTES / length;
+    double start = now();
+    for (size_t i = 0; i < count; i++) {
+        *sum += hash(buffer + (i & 7), length);
+    }
+    return now() - start;
+}
+
+// the share of 2^BUCKET_BITS buckets that as many keys "key0", "key1" and so on land in, random
+// hashes fill 1 - 1/e of them, about 63.2%
+static double occupancy(uint64_t (*hash)(const char*, size_t))
+{
+    size_t buckets = (size_t)1 << BUCKET_BITS;
+    bool* used = calloc(buckets, sizeof(bool));
+    if (used == NULL)
+        exit(1);
+    size_t filled = 0;
+    char key[32];
+    for (size_t i = 0; i < buckets; i++) {
+        int length = sprintf(key, "key%zu", i);
+        size_t bucket = (uint32_t)hash(key, (size_t)length) & (buckets - 1);
+        if (!used[bucket]) {
+            used[bucket] = true;
+            filled++;
+        }
+    }
+    free(used);
+    return 100.0 * filled / buckets;
+}
+
+int main()
+{
+    size_t size = lengths[LENGTH_COUNT - 1] + 8;
+    char* buffer = malloc(size);
+    if (buffer == NULL)
+        return 1;
+    srand(42);
+    for (size_t i = 0; i < size; i++) {
+        buffer[i] = (char)(' ' + rand() % 95);
+    }
+
+    uint64_t sum = 0;
+    printf("%8s %14s %14s %14s %14s\n", "length", "fnv1a GB/s", "fnv1a ns", "xxhash GB/s",
+        "xxhash ns");
+    for (size_t i = 0; i < LENGTH_COUNT; i++) {
+        size_t length = lengths[i];
+        double count = (double)(BENCH_BYTES / length);
+        double old_time = bench(fnv1a, buffer, length, &sum);
+        double new_time = bench(xxhash, buffer, length, &sum);
+        printf("%8zu %14.2f %14.2f %14.2f %14.2f\n", length, count * length / old_time * 1e-9,
+            old_time / count * 1e9, count * length / new_time * 1e-9, new_time / count * 1e9);
+    }
+    printf("bucket occupancy of %d keys: fnv1a %.1f%%, xxhash %.1f%%\n", 1 << BUCKET_BITS,
+        occupancy(fnv1a), occupancy(xxhash));
+    printf("checksum %llx\n", (unsigned long long)sum);
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,207 @@
+// mremap() is a Linux extension
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "allocator.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef SLAB_ALLOC
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef SLAB_ALLOC
+
+// every class is a multiple of 8, closer together for the sizes objects and short strings have
+static const uint32_t class_sizes[] = { 8, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024 };
+#define CLASS_COUNT (sizeof(class_sizes) / sizeof(class_sizes[0]))
+
+// the blocks start past the header, 16 byte aligned
+#define SEGMENT_HEADER_SIZE ((sizeof(Segment) + 15) & ~(size_t)15)
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+} FreeBlock;
+
+typedef struct {
+    FreeBlock* free; // blocks freed before, they are reused first
+    uint8_t* top; // the rest of the newest segment is bump allocated
+    uint8_t* end;
+} SizeClass;
+
+static SizeClass classes[CLASS_COUNT];
+// the class of a size up to SLAB_MAX_SIZE, indexed by the size in words rounded up
+static uint8_t size_classes[SLAB_MAX_SIZE / 8 + 1];
+static Segment* segments;
+static size_t page_size;
+
+void init_allocator()
+{
+    int size_class = 0;
+    for (size_t words = 0; words <= SLAB_MAX_SIZE / 8; words++) {
+        if (words * 8 > class_sizes[size_class])
+            size_class++;
+        size_classes[words] = (uint8_t)size_class;
+    }
+    memset(classes, 0, sizeof(classes));
+    segments = NULL;
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void free_allocator()
+{
+    while (segments != NULL) {
+        Segment* next = segments->next;
+        munmap(segments, SLAB_SEGMENT_SIZE);
+        segments = next;
+    }
+    memset(classes, 0, sizeof(classes));
+}
+
+void clear_block_marks()
+{
+    for (Segment* segment = segments; segment != NULL; segment = segment->next) {
+        memset(segment->marks, 0, sizeof(segment->marks));
+    }
+}
+
+static void* map_pages(size_t size)
+{
+    void* pages = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return pages == MAP_FAILED ? NULL : pages;
+}
+
+// maps twice the size and trims the ends, so that the segment of a block is found by masking its
+// address
+static bool new_segment(SizeClass* size_class)
+{
+    uint8_t* pages = map_pages(2 * SLAB_SEGMENT_SIZE);
+    if (pages == NULL)
+        return false;
+    uintptr_t mask = SLAB_SEGMENT_SIZE - 1;
+    uint8_t* aligned = (uint8_t*)(((uintptr_t)pages + mask) & ~mask);
+    if (aligned > pages)
+        munmap(pages, aligned - pages);
+    munmap(aligned + SLAB_SEGMENT_SIZE, pages + SLAB_SEGMENT_SIZE - aligned);
+
+    Segment* segment = (Segment*)aligned;
+    segment->next = segments;
+    segments = segment;
+    size_class->top = aligned + SEGMENT_HEADER_SIZE;
+    size_class->end = aligned + SLAB_SEGMENT_SIZE;
+    return true;
+}
+
+static size_t round_to_pages(size_t size) { return (size + page_size - 1) & ~(page_size - 1); }
+
+size_t block_size(size_t size)
+{
+    if (size == 0)
+        return 0;
+    if (size <= SLAB_MAX_SIZE)
+        return class_sizes[size_classes[(size + 7) / 8]];
+    if (size >= LARGE_BLOCK_SIZE)
+        return round_to_pages(size);
+    return size;
+}
+
+void* allocate_block(size_t size)
+{
+    if (size <= SLAB_MAX_SIZE) {
+        int index = size_classes[(size + 7) / 8];
+        SizeClass* size_class = &classes[index];
+        FreeBlock* block = size_class->free;
+        if (block != NULL) {
+            size_class->free = block->next;
+            return block;
+        }
+        uint32_t class_size = class_sizes[index];
+        if ((size_t)(size_class->end - size_class->top) < class_size && !new_segment(size_class))
+            return NULL;
+        void* result = size_class->top;
+        size_class->top += class_size;
+        return result;
+    }
+    if (size >= LARGE_BLOCK_SIZE)
+        return map_pages(round_to_pages(size));
+    return malloc(size);
+}
+
+void free_block(void* pointer, size_t size)
+{
+    if (pointer == NULL)
+        return;
+    if (size <= SLAB_MAX_SIZE) {
+        SizeClass* size_class = &classes[size_classes[(size + 7) / 8]];
+        FreeBlock* block = pointer;
+        block->next = size_class->free;
+        size_class->free = block;
+    } else if (size >= LARGE_BLOCK_SIZE) {
+        munmap(pointer, round_to_pages(size));
+    } else {
+        free(pointer);
+    }
+}
+
+void* reallocate_block(void* pointer, size_t old_size, size_t new_size)
+{
+    if (new_size == 0) {
+        free_block(pointer, old_size);
+        return NULL;
+    }
+    if (pointer == NULL)
+        return allocate_block(new_size);
+    // still fits the same slab block or the same pages
+    if ((old_size <= SLAB_MAX_SIZE || old_size >= LARGE_BLOCK_SIZE)
+        && block_size(old_size) == block_size(new_size))
+        return pointer;
+
+    bool old_medium = old_size > SLAB_MAX_SIZE && old_size < LARGE_BLOCK_SIZE;
+    bool new_medium = new_size > SLAB_MAX_SIZE && new_size < LARGE_BLOCK_SIZE;
+    if (old_medium && new_medium)
+        return realloc(pointer, new_size);
+#ifdef __linux__
+    // the kernel moves the pages instead of copying them
+    if (old_size >= LARGE_BLOCK_SIZE && new_size >= LARGE_BLOCK_SIZE) {
+        void* result
+            = mremap(pointer, round_to_pages(old_size), round_to_pages(new_size), MREMAP_MAYMOVE);
+        return result == MAP_FAILED ? NULL : result;
+    }
+#endif
+
+    void* result = allocate_block(new_size);
+    if (result == NULL)
+        return NULL;
+    memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    free_block(pointer, old_size);
+    return result;
+}
+
+#else
+
+void init_allocator() { }
+
+void free_allocator() { }
+
+size_t block_size(size_t size) { return size; }
+
+void* allocate_block(size_t size) { return malloc(size); }
+
+void free_block(void* pointer, size_t size)
+{
+    (void)size;
+    free(pointer);
+}
+
+void* reallocate_block(void* pointer, size_t old_size, size_t new_size)
+{
+    (void)old_size;
+    if (new_size == 0) {
+        free(pointer);
+        return NULL;
+    }
+    return realloc(pointer, new_size);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef clox_allocator_h
+#define clox_allocator_h
+
+#include "common.h"
+
+// The memory behind reallocate(). Small blocks come from slabs of one size class each, large ones
+// are mapped on their own and everything in between goes to malloc. Callers pass the size back
+// when freeing or resizing, the blocks carry no header.
+
+// slab classes go up to this size
+#define SLAB_MAX_SIZE 1024
+// segments are carved into the blocks of one class, they are aligned to their size
+#define SLAB_SEGMENT_SIZE (64 * 1024)
+// blocks of at least this size are mapped straight from the kernel
+#define LARGE_BLOCK_SIZE (64 * 1024)
+
+#ifdef SLAB_ALLOC
+// The header of a segment keeps the mark bits of its blocks, one bit for every 8 bytes, so that
+// marking doesn't write to the objects themselves and the marks are cleared all at once.
+typedef struct Segment {
+    struct Segment* next;
+    uint64_t marks[SLAB_SEGMENT_SIZE / 8 / 64];
+} Segment;
+
+static inline uint64_t* block_mark_word(const void* block, uint64_t* bit)
+{
+    uintptr_t address = (uintptr_t)block;
+    Segment* segment = (Segment*)(address & ~(uintptr_t)(SLAB_SEGMENT_SIZE - 1));
+    size_t index = (address & (SLAB_SEGMENT_SIZE - 1)) / 8;
+    *bit = (uint64_t)1 << (index % 64);
+    return &segment->marks[index / 64];
+}
+
+// only for blocks of at most SLAB_MAX_SIZE
+static inline bool block_marked(const void* block)
+{
+    uint64_t bit;
+    return (*block_mark_word(block, &bit) & bit) != 0;
+}
+
+// clears the mark bits of every segment
+void clear_block_marks();
+#endif
+
+void init_allocator();
+// unmaps every segment, any block still in use is gone
+void free_allocator();
+// what a block of size really takes, which is what vm.bytes_allocated counts
+size_t block_size(size_t size);
+// These return NULL when the system has no memory left, reallocate_block() then leaves the old
+// block as it was.
+void* allocate_block(size_t size);
+void free_block(void* pointer, size_t size);
+void* reallocate_block(void* pointer, size_t old_size, size_t new_size);
+
+#endif
@@ -8,7 +8,11 @@ void init_chunk(Chunk* chunk)
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->borrowed = false;
     init_value_array(&chunk->constants);
+    chunk->cache_count = 0;
+    chunk->cache_capacity = 0;
+    chunk->caches = NULL;
 }
 
 void write_chunk(Chunk* chunk, uint8_t byte, int line)
@@ -26,9 +30,12 @@ void write_chunk(Chunk* chunk, uint8_t byte, int line)
 
 void free_chunk(Chunk* chunk)
 {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (!chunk->borrowed) {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    }
     free_value_array(&chunk->constants);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cache_capacity);
     init_chunk(chunk);
 }
 
@@ -38,4 +45,82 @@ int add_constant(Chunk* chunk, Value value)
     write_value_array(&chunk->constants, value);
     pop();
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int add_inline_cache(Chunk* chunk)
+{
+    if (chunk->cache_capacity < chunk->cache_count + 1) {
+        int old_capacity = chunk->cache_capacity;
+        chunk->cache_capacity = GROW_CAPACITY(old_capacity);
+        chunk->caches
+            = GROW_ARRAY(InlineCache, chunk->caches, old_capacity, chunk->cache_capacity);
+    }
+    InlineCache* cache = &chunk->caches[chunk->cache_count];
+    cache->receiver = NULL;
+    cache->transition = NULL;
+    cache->field = -1;
+    cache->method = NIL_VAL;
+    cache->misses = 0;
+    return chunk->cache_count++;
+}
+
+int instruction_length(Chunk* chunk, int offset)
+{
+    uint8_t instruction = chunk->code[offset];
+    int operand_size = 1;
+    if (instruction == OP_WIDE) {
+        offset++;
+        instruction = chunk->code[offset];
+        operand_size = 2;
+    }
+    int prefix = operand_size - 1;
+
+    switch (instruction) {
+    case OP_CLOSURE: {
+        int constant = operand_size == 2 ? (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]
+                                         : chunk->code[offset + 1];
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        int length = 1 + operand_size;
+        for (int i = 0; i < function->upvalue_count; i++) {
+            length += chunk->code[offset + length] == 2 ? 3 : 2;
+        }
+        return prefix + length;
+    }
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+        return prefix + 1 + operand_size;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return prefix + 3 + operand_size;
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+        return prefix + 4 + operand_size;
+    case OP_CONSTANT:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM:
+        return 2;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCALS_NUM:
+    case OP_POP_JUMP_IF_FALSE:
+        return 3;
+    case OP_CONSTANT_LONG:
+    case OP_JUMP_LONG:
+    case OP_LOOP_LONG:
+        return 4;
+    default:
+        return 1;
+    }
+}
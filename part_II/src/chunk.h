@@ -21,35 +21,122 @@ typedef enum {
     OP_LESS,
     OP_PRINT,
     OP_POP,
-    OP_DEFINE_GLOBAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
+    OP_DEFINE_GLOBAL, // global slot (2 bytes)
+    OP_GET_GLOBAL, // global slot (2 bytes)
+    OP_SET_GLOBAL, // global slot (2 bytes)
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_JUMP_IF_FALSE,
     OP_JUMP,
     OP_LOOP,
     OP_CALL,
-    OP_CLOSURE,
+    OP_TAIL_CALL, // OP_CALL whose result the function returns, the callee takes over its frame
+    OP_CLOSURE, // function, then a (kind, index) pair per upvalue, see the compiler's function()
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_CLOSE_UPVALUE,
     OP_CLASS,
-    OP_SET_PROPERTY,
-    OP_GET_PROPERTY,
+    OP_SET_PROPERTY, // name, inline cache (2 bytes)
+    OP_GET_PROPERTY, // name, inline cache (2 bytes)
     OP_METHOD,
-    OP_INVOKE,
+    OP_INVOKE, // name, argument count, inline cache (2 bytes)
     OP_INHERIT,
     OP_GET_SUPER,
-    OP_SUPER_INVOKE
+    OP_SUPER_INVOKE, // name, argument count, inline cache (2 bytes)
+    // long forms, only emitted when an operand doesn't fit in the short one
+    OP_CONSTANT_LONG, // constant (3 bytes)
+    OP_JUMP_LONG, // offset (3 bytes)
+    OP_LOOP_LONG, // offset (3 bytes)
+    OP_WIDE, // prefix, the first operand of the next instruction (a slot or a constant) has 2 bytes
+    // superinstructions, each one stands for a sequence the compiler would otherwise emit
+    OP_ADD_LOCALS, // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+    OP_ADD_CONSTANT, // OP_CONSTANT k, OP_ADD
+    OP_NOT_EQUAL, // OP_EQUAL, OP_NOT
+    OP_GREATER_EQUAL, // OP_LESS, OP_NOT
+    OP_LESS_EQUAL, // OP_GREATER, OP_NOT
+    OP_POP_JUMP_IF_FALSE, // OP_JUMP_IF_FALSE, OP_POP on both paths
+    // quickened forms, never emitted by the compiler: the VM rewrites a generic instruction into
+    // one of these once it has seen its operand types, and back when they change
+    OP_ADD_NUM, // OP_ADD of two numbers
+    OP_ADD_STR, // OP_ADD of two strings
+    OP_ADD_LOCALS_NUM,
+    OP_ADD_CONSTANT_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM
 } OpCode;
 
+// Instruction set of the register backend. Operands are single bytes unless marked otherwise: A, B
+// and C name registers of the current frame (slot 0 holds the callee, like in the stack VM), K
+// indexes the constant table, U the closure's upvalues and N counts arguments. G is the two byte
+// slot of a global and IC the two byte index of an inline cache.
+typedef enum {
+    ROP_MOVE, // A B: R(A) = R(B)
+    ROP_LOAD_CONSTANT, // A K: R(A) = K
+    ROP_NIL, // A
+    ROP_TRUE, // A
+    ROP_FALSE, // A
+    ROP_ADD, // A B C: R(A) = R(B) + R(C)
+    ROP_ADD_CONSTANT, // A B K: R(A) = R(B) + K
+    ROP_SUBTRACT, // A B C
+    ROP_SUBTRACT_CONSTANT, // A B K: R(A) = R(B) - K
+    ROP_MULTIPLY, // A B C
+    ROP_DIVIDE, // A B C
+    ROP_NEGATE, // A B
+    ROP_NOT, // A B
+    ROP_EQUAL, // A B C
+    ROP_NOT_EQUAL, // A B C
+    ROP_GREATER, // A B C
+    ROP_GREATER_EQUAL, // A B C
+    ROP_LESS, // A B C
+    ROP_LESS_EQUAL, // A B C
+    ROP_JUMP, // offset (2 bytes)
+    ROP_JUMP_IF_FALSE, // A offset (2 bytes)
+    ROP_JUMP_IF_TRUE, // A offset (2 bytes)
+    ROP_LOOP, // offset (2 bytes)
+    ROP_DEFINE_GLOBAL, // A G: globals[G] = R(A)
+    ROP_GET_GLOBAL, // A G: R(A) = globals[G]
+    ROP_SET_GLOBAL, // A G: globals[G] = R(A)
+    ROP_GET_UPVALUE, // A U: R(A) = U
+    ROP_SET_UPVALUE, // A U: U = R(A)
+    ROP_CLOSE_UPVALUES, // A: close every upvalue pointing at R(A) or above
+    ROP_CLOSURE, // A K (2 bytes), then one (is_local, index) pair per upvalue
+    ROP_CALL, // A N: R(A) = R(A)(R(A + 1), ..., R(A + N))
+    ROP_TAIL_CALL, // A N: ROP_CALL whose result the function returns, the callee takes over its frame
+    ROP_RETURN, // A
+    ROP_PRINT, // A
+    ROP_CLASS, // A K (2 bytes)
+    ROP_INHERIT, // A B: R(A) inherits from R(B)
+    ROP_METHOD, // A B K (2 bytes): method K of class R(A) is R(B)
+    ROP_GET_PROPERTY, // A B K (2 bytes) IC: R(A) = R(B).K
+    ROP_SET_PROPERTY, // A K (2 bytes) B IC: R(A).K = R(B)
+    ROP_INVOKE, // A K (2 bytes) N IC: R(A) = R(A).K(R(A + 1), ..., R(A + N))
+    ROP_GET_SUPER, // A B C K (2 bytes): R(A) = method K of superclass R(C) bound to R(B)
+    ROP_SUPER_INVOKE, // A K (2 bytes) N B IC: like ROP_INVOKE, looking K up in superclass R(B)
+    ROP_LOAD_CONSTANT_LONG, // A K (3 bytes): R(A) = K
+    ROP_JUMP_LONG, // offset (3 bytes)
+    ROP_LOOP_LONG // offset (3 bytes)
+} RegisterOpCode;
+
+// Per-instruction cache of the last lookup done by a property access or an invocation.
+typedef struct {
+    Obj* receiver; // shape of the receiver the lookup was done for (the superclass for a super
+                   // call), NULL when the cache is empty
+    int field; // slot of the field in the receiver's field array, -1 when a method was found
+    Obj* transition; // shape the receiver gets when a set adds the field, NULL otherwise
+    Value method; // the method found
+    int misses; // times the cache was refilled, see INLINE_CACHE_MAX_MISSES
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
+    bool borrowed; // code and lines point into a loaded .loxc file and aren't freed with the chunk
     ValueArray constants;
+    int cache_count;
+    int cache_capacity;
+    InlineCache* caches;
 } Chunk;
 
 void init_chunk(Chunk* chunk);
@@ -58,5 +145,9 @@ void free_chunk(Chunk* chunk);
 
 // adds a value to the constants array and returns its index
 int add_constant(Chunk* chunk, Value value);
+// adds an empty inline cache and returns its index
+int add_inline_cache(Chunk* chunk);
+// length of the stack backend instruction at offset, its OP_WIDE prefix included
+int instruction_length(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
@@ -10,7 +10,32 @@
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 #define NAN_BOXING
+#define JIT
+
+// the JIT emits x86-64 code that works on NaN-boxed values, and maps it with mmap()
+#if defined(JIT) && !(defined(NAN_BOXING) && defined(__x86_64__) && defined(__unix__))
+#undef JIT
+#endif
+
+// threaded dispatch in run() relies on the "labels as values" extension of GCC and Clang,
+// every other compiler gets the portable switch
+#if defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
+
+// full collections mark on a pool of threads, see trace_in_parallel()
+#if defined(__GNUC__) && defined(__unix__)
+#define PARALLEL_MARK
+#endif
+
+// objects and small arrays come from size-class slabs in mapped segments, see allocator.c. Leak
+// checkers don't look inside the segments, so AddressSanitizer builds (GCC's macro) use malloc.
+#if defined(__unix__) && !defined(__SANITIZE_ADDRESS__)
+#define SLAB_ALLOC
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX 0xFFFFFF
 
 #endif
\ No newline at end of file
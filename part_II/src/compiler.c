@@ -7,6 +7,7 @@
 #include "memory.h"
 #include "scanner.h"
 #include "chunk.h"
+#include "vm.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
@@ -47,20 +48,43 @@ typedef struct {
 } Local;
 
 typedef struct {
-    uint8_t index;
+    uint16_t index;
     bool is_local;
 } Upvalue;
 
+// Forward jumps have a two byte offset. When a jump would have to go further, it jumps to an
+// island instead: a long jump placed before the offset runs out, which the code around it jumps
+// over. Islands are emitted between statements, for jumps that got further than this.
+#define JUMP_ISLAND_DISTANCE (UINT16_MAX / 2)
+
+typedef struct {
+    int offset; // of the jump's operand
+    int island; // operand of the long jump the jump goes through, -1 when it doesn't
+} PendingJump;
+
 typedef enum { TYPE_FUNCTION, TYPE_SCRIPT, TYPE_METHOD, TYPE_INITIALIZER } FunctionType;
 
 typedef struct Compiler {
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int local_count;
+    int local_capacity;
     Upvalue upvalues[UINT8_COUNT];
     int scope_depth;
+    // forward jumps that haven't been patched yet
+    PendingJump* jumps;
+    int jump_count;
+    int jump_capacity;
+    // offset of the first instruction of the left operand of the infix operator being compiled
+    int operand_start;
+    // offset of the last call emitted, a return of its result turns it into a tail call
+    int last_call;
+    Backend backend;
+    // register backend: registers below free_register are in use, locals first, then temporaries
+    int free_register;
+    int register_count;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -111,15 +135,15 @@ static Token synthetic_token(const char* name)
     return token;
 }
 
-static uint8_t make_constant(Value value)
+static int make_constant(Value value)
 {
     int constant_index = add_constant(current_chunk(), value);
-    if (constant_index > UINT8_MAX) {
+    if (constant_index > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant_index;
+    return constant_index;
 }
 
 static void advance()
@@ -154,13 +178,33 @@ static bool match(TokenType type)
     return true;
 }
 
+static Local* push_local()
+{
+    if (current->local_capacity < current->local_count + 1) {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(Local, current->locals, old_capacity, current->local_capacity);
+    }
+    return &current->locals[current->local_count++];
+}
+
 static void init_compiler(Compiler* compiler, FunctionType type)
 {
     compiler->enclosing = current;
+    compiler->backend = current != NULL ? current->backend : BACKEND_STACK;
+    compiler->free_register = 1;
+    compiler->register_count = 1;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->local_count = 0;
+    compiler->local_capacity = 0;
     compiler->scope_depth = 0;
+    compiler->jumps = NULL;
+    compiler->jump_count = 0;
+    compiler->jump_capacity = 0;
+    compiler->operand_start = 0;
+    compiler->last_call = -1;
     compiler->function = new_function();
     current = compiler;
 
@@ -168,7 +212,7 @@ static void init_compiler(Compiler* compiler, FunctionType type)
         current->function->name = copy_string(parser.previous.start, parser.previous.length);
     }
 
-    Local* local = &current->locals[current->local_count++];
+    Local* local = push_local();
     local->depth = 0;
     local->is_captured = false;
     if (type != TYPE_FUNCTION) {
@@ -188,16 +232,62 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2)
     emit_byte(byte2);
 }
 
-static void emit_loop(int loop_start)
+static void emit_short(int value)
+{
+    emit_byte((value >> 8) & 0xFF);
+    emit_byte(value & 0xFF);
+}
+
+static void emit_long(int value)
+{
+    emit_byte((value >> 16) & 0xFF);
+    emit_short(value);
+}
+
+// emits instruction and its first operand, which takes two bytes behind an OP_WIDE prefix when it
+// doesn't fit in one
+static void emit_with_operand(uint8_t instruction, int operand)
+{
+    if (operand > UINT8_MAX) {
+        emit_bytes(OP_WIDE, instruction);
+        emit_short(operand);
+    } else {
+        emit_bytes(instruction, (uint8_t)operand);
+    }
+}
+
+static void emit_loop_instruction(uint8_t loop, uint8_t long_loop, int loop_start)
 {
-    emit_byte(OP_LOOP);
+    // +3 to also jump back over the instruction itself
+    int offset = current_chunk()->count - loop_start + 3;
+    if (offset <= UINT16_MAX) {
+        emit_byte(loop);
+        emit_short(offset);
+        return;
+    }
 
-    int offset = current_chunk()->count - loop_start + 2;
-    if (offset > UINT16_MAX)
+    offset++; // for the third byte of the long offset
+    if (offset > UINT24_MAX)
         error("Loop body too large.");
+    emit_byte(long_loop);
+    emit_long(offset);
+}
+
+static void emit_loop(int loop_start) { emit_loop_instruction(OP_LOOP, OP_LOOP_LONG, loop_start); }
 
-    emit_byte((offset >> 8) & 0xFF);
-    emit_byte(offset & 0xFF);
+// records the jump whose operand was just emitted, returns the offset to patch it with
+static int pending_jump()
+{
+    if (current->jump_capacity < current->jump_count + 1) {
+        int old_capacity = current->jump_capacity;
+        current->jump_capacity = GROW_CAPACITY(old_capacity);
+        current->jumps
+            = GROW_ARRAY(PendingJump, current->jumps, old_capacity, current->jump_capacity);
+    }
+    PendingJump* jump = &current->jumps[current->jump_count++];
+    jump->offset = current_chunk()->count - 2;
+    jump->island = -1;
+    return jump->offset;
 }
 
 static int emit_jump(uint8_t instruction)
@@ -205,11 +295,17 @@ static int emit_jump(uint8_t instruction)
     emit_byte(instruction);
     emit_byte(0xFF);
     emit_byte(0xFF);
-    return current_chunk()->count - 2;
+    return pending_jump();
 }
 
+static void emit_register_return();
+
 static void emit_return()
 {
+    if (current->backend == BACKEND_REGISTER) {
+        emit_register_return();
+        return;
+    }
     if (current->type == TYPE_INITIALIZER) {
         emit_bytes(OP_GET_LOCAL, 0);
     } else {
@@ -218,9 +314,35 @@ static void emit_return()
     emit_byte(OP_RETURN);
 }
 
-static void emit_constant(Value value) { emit_bytes(OP_CONSTANT, make_constant(value)); }
+static void emit_constant(Value value)
+{
+    int constant = make_constant(value);
+    if (constant > UINT8_MAX) {
+        emit_byte(OP_CONSTANT_LONG);
+        emit_long(constant);
+    } else {
+        emit_bytes(OP_CONSTANT, (uint8_t)constant);
+    }
+}
 
-static void patch_jump(int offset)
+// emits the operand giving the instruction being emitted its own inline cache
+static void emit_inline_cache()
+{
+    int cache = add_inline_cache(current_chunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+    emit_short(cache);
+}
+
+static void emit_global(uint8_t instruction, uint16_t slot)
+{
+    emit_byte(instruction);
+    emit_short(slot);
+}
+
+// points the two byte jump operand at offset to the end of the chunk
+static void patch_short_jump(int offset)
 {
     // -2 to adjust for the bytecode for the jump offset itself
     int jump = current_chunk()->count - offset - 2;
@@ -231,14 +353,264 @@ static void patch_jump(int offset)
     current_chunk()->code[offset + 1] = jump & 0xFF;
 }
 
+static void patch_jump(int offset)
+{
+    int i = current->jump_count - 1;
+    while (current->jumps[i].offset != offset) {
+        i--;
+    }
+    int island = current->jumps[i].island;
+    current->jumps[i] = current->jumps[--current->jump_count];
+    if (island == -1) {
+        patch_short_jump(offset);
+        return;
+    }
+
+    int jump = current_chunk()->count - island - 3;
+    if (jump > UINT24_MAX) {
+        error("Too much code to jump over.");
+    }
+    current_chunk()->code[island] = (jump >> 16) & 0xFF;
+    current_chunk()->code[island + 1] = (jump >> 8) & 0xFF;
+    current_chunk()->code[island + 2] = jump & 0xFF;
+}
+
+// Emits an island for the pending jumps when one of them gets too far, see JUMP_ISLAND_DISTANCE.
+static void emit_jump_island()
+{
+    bool needed = false;
+    for (int i = 0; i < current->jump_count; i++) {
+        PendingJump* jump = &current->jumps[i];
+        if (jump->island == -1 && current_chunk()->count - jump->offset > JUMP_ISLAND_DISTANCE) {
+            needed = true;
+        }
+    }
+    if (!needed)
+        return;
+
+    bool registers = current->backend == BACKEND_REGISTER;
+    emit_byte(registers ? ROP_JUMP : OP_JUMP);
+    emit_short(0xFFFF);
+    int skip = current_chunk()->count - 2;
+    for (int i = 0; i < current->jump_count; i++) {
+        PendingJump* jump = &current->jumps[i];
+        if (jump->island != -1)
+            continue;
+        patch_short_jump(jump->offset);
+        emit_byte(registers ? ROP_JUMP_LONG : OP_JUMP_LONG);
+        emit_long(0xFFFFFF);
+        jump->island = current_chunk()->count - 3;
+    }
+    patch_short_jump(skip);
+}
+
+// What the chunk held before compiling code that may turn out to be dead.
+typedef struct {
+    int code;
+    int constants;
+    int caches;
+} ChunkMark;
+
+static ChunkMark mark_chunk()
+{
+    ChunkMark mark;
+    mark.code = current_chunk()->count;
+    mark.constants = current_chunk()->constants.count;
+    mark.caches = current_chunk()->cache_count;
+    return mark;
+}
+
+// Throws away everything compiled since mark.
+static void rewind_chunk(ChunkMark mark)
+{
+    Chunk* chunk = current_chunk();
+    chunk->count = mark.code;
+    chunk->constants.count = mark.constants;
+    chunk->cache_count = mark.caches;
+    if (current->last_call >= mark.code) {
+        current->last_call = -1;
+    }
+    // jumps that went through an island in the discarded code need a new one
+    for (int i = 0; i < current->jump_count; i++) {
+        if (current->jumps[i].island >= mark.code) {
+            current->jumps[i].island = -1;
+        }
+    }
+}
+
+// A branch that can never run because its condition is a constant is still compiled, so that its
+// errors are reported, but none of its code is kept.
+static void compile_branch(void (*compile)(), bool live)
+{
+    ChunkMark mark = mark_chunk();
+    compile();
+    if (!live) {
+        rewind_chunk(mark);
+    }
+}
+
+// Follows every path through the function's code from its start, with the depth of the stack at a
+// jump's target being the depth at the jump, and returns the deepest it gets. The compiler doesn't
+// bound how many temporaries an expression leaves pending, so a frame's size can't be known before.
+static int max_stack_slots(ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    int* depths = ALLOCATE(int, chunk->count);
+    int pending_capacity = 8;
+    int* pending = ALLOCATE(int, pending_capacity);
+    for (int i = 0; i < chunk->count; i++) {
+        depths[i] = -1;
+    }
+    int pending_count = 0;
+    // the callee and the arguments are there already
+    int max = function->arity + 1;
+    depths[0] = max;
+    pending[pending_count++] = 0;
+
+    while (pending_count > 0) {
+        int offset = pending[--pending_count];
+        int depth = depths[offset];
+        for (;;) {
+            uint8_t* code = chunk->code + offset;
+            int length = instruction_length(chunk, offset);
+            int operand_size = 1;
+            if (code[0] == OP_WIDE) {
+                code++;
+                operand_size = 2;
+            }
+            int target = -1;
+            bool falls_through = true;
+            int peak = 0; // how far the instruction goes above the depth it leaves
+            switch (code[0]) {
+            case OP_RETURN:
+                falls_through = false;
+                break;
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_GET_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_GET_UPVALUE:
+            case OP_CLOSURE:
+            case OP_CLASS:
+                depth++;
+                break;
+            case OP_ADD_LOCALS:
+            case OP_ADD_LOCALS_NUM:
+                // strings are concatenated from both operands pushed
+                peak = 1;
+                depth++;
+                break;
+            case OP_ADD_CONSTANT:
+            case OP_ADD_CONSTANT_NUM:
+                peak = 1;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_PRINT:
+            case OP_POP:
+            case OP_DEFINE_GLOBAL:
+            case OP_CLOSE_UPVALUE:
+            case OP_SET_PROPERTY:
+            case OP_METHOD:
+            case OP_INHERIT:
+            case OP_GET_SUPER:
+            case OP_NOT_EQUAL:
+            case OP_GREATER_EQUAL:
+            case OP_LESS_EQUAL:
+            case OP_ADD_NUM:
+            case OP_ADD_STR:
+            case OP_GREATER_NUM:
+            case OP_LESS_NUM:
+                depth--;
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                depth -= code[1];
+                break;
+            case OP_INVOKE:
+                depth -= code[1 + operand_size];
+                break;
+            case OP_SUPER_INVOKE:
+                depth -= code[1 + operand_size] + 1;
+                break;
+            case OP_JUMP_IF_FALSE:
+                target = offset + length + ((code[1] << 8) | code[2]);
+                break;
+            case OP_POP_JUMP_IF_FALSE:
+                depth--;
+                target = offset + length + ((code[1] << 8) | code[2]);
+                break;
+            case OP_JUMP:
+                target = offset + length + ((code[1] << 8) | code[2]);
+                falls_through = false;
+                break;
+            case OP_JUMP_LONG:
+                target = offset + length + ((code[1] << 16) | (code[2] << 8) | code[3]);
+                falls_through = false;
+                break;
+            case OP_LOOP:
+                target = offset + length - ((code[1] << 8) | code[2]);
+                falls_through = false;
+                break;
+            case OP_LOOP_LONG:
+                target = offset + length - ((code[1] << 16) | (code[2] << 8) | code[3]);
+                falls_through = false;
+                break;
+            default:
+                // the rest leave as many values as they take
+                break;
+            }
+            if (depth + peak > max)
+                max = depth + peak;
+            if (target != -1 && depths[target] < depth) {
+                depths[target] = depth;
+                if (pending_count == pending_capacity) {
+                    pending = GROW_ARRAY(int, pending, pending_capacity, pending_capacity * 2);
+                    pending_capacity *= 2;
+                }
+                pending[pending_count++] = target;
+            }
+            offset += length;
+            if (!falls_through || offset >= chunk->count || depths[offset] >= depth)
+                break;
+            depths[offset] = depth;
+        }
+    }
+
+    FREE_ARRAY(int, depths, chunk->count);
+    FREE_ARRAY(int, pending, pending_capacity);
+    return max;
+}
+
 static ObjFunction* end_compiler()
 {
     emit_return();
     ObjFunction* function = current->function;
+    FREE_ARRAY(Local, current->locals, current->local_capacity);
+    FREE_ARRAY(PendingJump, current->jumps, current->jump_capacity);
+    if (current->backend == BACKEND_REGISTER) {
+        function->register_count = current->register_count;
+        function->max_slots = current->register_count;
+    } else {
+        // the jumps of code with errors may not be patched, it never runs anyway
+        function->max_slots = parser.had_error ? 0 : max_stack_slots(function);
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.had_error) {
-        disassemble_chunk(
-            current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+        const char* name = function->name != NULL ? function->name->chars : "<script>";
+        if (current->backend == BACKEND_REGISTER) {
+            disassemble_register_chunk(current_chunk(), name);
+        } else {
+            disassemble_chunk(current_chunk(), name);
+        }
     }
 #endif
     current = current->enclosing;
@@ -262,15 +634,195 @@ static void end_scope()
     }
 }
 
+// Operators whose operands are all constants are evaluated at compile time, except when that
+// would be a runtime error, which is left for the VM to report if the code is ever run.
+
+static bool is_falsey_constant(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool fold_unary(TokenType operator_type, Value operand, Value* result)
+{
+    if (operator_type == TOKEN_BANG) {
+        *result = BOOL_VAL(is_falsey_constant(operand));
+        return true;
+    }
+    if (!IS_NUMBER(operand))
+        return false;
+    *result = NUMBER_VAL(-AS_NUMBER(operand));
+    return true;
+}
+
+// A string result isn't rooted yet, nothing may be allocated before it is added to the chunk.
+static bool fold_binary(TokenType operator_type, Value a, Value b, Value* result)
+{
+    if (operator_type == TOKEN_EQUAL_EQUAL || operator_type == TOKEN_BANG_EQUAL) {
+        bool equal = values_equal(a, b);
+        *result = BOOL_VAL(operator_type == TOKEN_EQUAL_EQUAL ? equal : !equal);
+        return true;
+    }
+
+    if (operator_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        ObjString* string = new_string(left->length + right->length);
+        memcpy(string->chars, left->chars, left->length);
+        memcpy(string->chars + left->length, right->chars, right->length);
+        *result = OBJ_VAL(intern_string(string));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operator_type) {
+    case TOKEN_PLUS:
+        *result = NUMBER_VAL(x + y);
+        break;
+    case TOKEN_MINUS:
+        *result = NUMBER_VAL(x - y);
+        break;
+    case TOKEN_STAR:
+        *result = NUMBER_VAL(x * y);
+        break;
+    case TOKEN_SLASH:
+        *result = NUMBER_VAL(x / y);
+        break;
+    case TOKEN_GREATER:
+        *result = BOOL_VAL(x > y);
+        break;
+    case TOKEN_LESS:
+        *result = BOOL_VAL(x < y);
+        break;
+    // negated like in the VM, so that comparisons with NaN agree
+    case TOKEN_GREATER_EQUAL:
+        *result = BOOL_VAL(!(x < y));
+        break;
+    case TOKEN_LESS_EQUAL:
+        *result = BOOL_VAL(!(x > y));
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Whether the code from start to end is a single instruction pushing a constant, stored in value.
+static bool emitted_constant(int start, int end, Value* value)
+{
+    Chunk* chunk = current_chunk();
+    uint8_t* code = chunk->code + start;
+    switch (end - start) {
+    case 1:
+        if (code[0] == OP_NIL) {
+            *value = NIL_VAL;
+        } else if (code[0] == OP_TRUE || code[0] == OP_FALSE) {
+            *value = BOOL_VAL(code[0] == OP_TRUE);
+        } else {
+            return false;
+        }
+        return true;
+    case 2:
+        if (code[0] != OP_CONSTANT)
+            return false;
+        *value = chunk->constants.values[code[1]];
+        return true;
+    case 4:
+        if (code[0] != OP_CONSTANT_LONG)
+            return false;
+        *value = chunk->constants.values[(code[1] << 16) | (code[2] << 8) | code[3]];
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Removes the constant instruction at start, which ends the chunk, and its constant when no other
+// one has been added since.
+static void drop_emitted_constant(int start)
+{
+    Chunk* chunk = current_chunk();
+    int constant = -1;
+    if (chunk->code[start] == OP_CONSTANT) {
+        constant = chunk->code[start + 1];
+    } else if (chunk->code[start] == OP_CONSTANT_LONG) {
+        constant = (chunk->code[start + 1] << 16) | (chunk->code[start + 2] << 8)
+            | chunk->code[start + 3];
+    }
+    if (constant != -1 && constant == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+    chunk->count = start;
+}
+
+// For a condition compiled from start on: whether it is a constant, which is then removed.
+static bool constant_condition(int start, Value* value)
+{
+    if (!emitted_constant(start, current_chunk()->count, value))
+        return false;
+    drop_emitted_constant(start);
+    return true;
+}
+
+static void emit_value(Value value)
+{
+    if (IS_NIL(value)) {
+        emit_byte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emit_constant(value);
+    }
+}
+
+// Both operands of an addition are already in the chunk when OP_ADD is about to be emitted, so
+// the two common shapes of operands can be folded into a superinstruction instead.
+static void emit_add(int lhs_start, int rhs_start)
+{
+    Chunk* chunk = current_chunk();
+    bool rhs_is_single = chunk->count - rhs_start == 2;
+
+    // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD -> OP_ADD_LOCALS a b
+    if (rhs_is_single && rhs_start - lhs_start == 2 && chunk->code[lhs_start] == OP_GET_LOCAL
+        && chunk->code[rhs_start] == OP_GET_LOCAL) {
+        chunk->code[lhs_start] = OP_ADD_LOCALS;
+        chunk->code[lhs_start + 2] = chunk->code[rhs_start + 1];
+        chunk->count = lhs_start + 3;
+        return;
+    }
+
+    // OP_CONSTANT k, OP_ADD -> OP_ADD_CONSTANT k
+    if (rhs_is_single && chunk->code[rhs_start] == OP_CONSTANT) {
+        chunk->code[rhs_start] = OP_ADD_CONSTANT;
+        return;
+    }
+
+    emit_byte(OP_ADD);
+}
+
 static void binary(bool can_assign)
 {
     TokenType operator_type = parser.previous.type;
+    int lhs_start = current->operand_start;
+    int rhs_start = current_chunk()->count;
     ParseRule* rule = get_rule(operator_type);
     parse_precedence((Precedence)(rule->precedence + 1));
 
+    Value lhs, rhs, folded;
+    if (emitted_constant(lhs_start, rhs_start, &lhs)
+        && emitted_constant(rhs_start, current_chunk()->count, &rhs)
+        && fold_binary(operator_type, lhs, rhs, &folded)) {
+        drop_emitted_constant(rhs_start);
+        drop_emitted_constant(lhs_start);
+        emit_value(folded);
+        return;
+    }
+
     switch (operator_type) {
     case TOKEN_PLUS:
-        emit_byte(OP_ADD);
+        emit_add(lhs_start, rhs_start);
         break;
     case TOKEN_MINUS:
         emit_byte(OP_SUBTRACT);
@@ -282,7 +834,7 @@ static void binary(bool can_assign)
         emit_byte(OP_DIVIDE);
         break;
     case TOKEN_BANG_EQUAL:
-        emit_bytes(OP_EQUAL, OP_NOT);
+        emit_byte(OP_NOT_EQUAL);
         break;
     case TOKEN_EQUAL_EQUAL:
         emit_byte(OP_EQUAL);
@@ -291,13 +843,13 @@ static void binary(bool can_assign)
         emit_byte(OP_GREATER);
         break;
     case TOKEN_GREATER_EQUAL:
-        emit_bytes(OP_LESS, OP_NOT);
+        emit_byte(OP_GREATER_EQUAL);
         break;
     case TOKEN_LESS:
         emit_byte(OP_LESS);
         break;
     case TOKEN_LESS_EQUAL:
-        emit_bytes(OP_GREATER, OP_NOT);
+        emit_byte(OP_LESS_EQUAL);
         break;
 
     default:
@@ -324,30 +876,61 @@ static uint8_t argument_list()
 static void call(bool can_assign)
 {
     uint8_t arg_count = argument_list();
+    current->last_call = current_chunk()->count;
     emit_bytes(OP_CALL, arg_count);
 }
 
+// Adds a constant that is the operand of an instruction other than OP_CONSTANT, which can only be
+// widened to two bytes.
+static int operand_constant(Value value)
+{
+    int constant = make_constant(value);
+    if (constant > UINT16_MAX) {
+        error("Too many constants in one chunk.");
+        return 0;
+    }
+    return constant;
+}
+
 // It takes the given token and adds its lexeme to the chunk's constant table as a string.
 // It returns the index of that constant in the constant table.
-static uint8_t identifier_constant(Token* name)
+static int identifier_constant(Token* name)
 {
-    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+    return operand_constant(OBJ_VAL(copy_string(name->start, name->length)));
+}
+
+// Globals are resolved to their slot in vm.global_values when they are compiled, the VM never
+// looks them up by name.
+static uint16_t global_variable(Token* name)
+{
+    ObjString* string = copy_string(name->start, name->length);
+    push(OBJ_VAL(string)); // adding the slot can trigger a gc
+    int slot = global_slot(string);
+    pop();
+    if (slot == -1) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return (uint16_t)slot;
 }
 
 static void dot(bool can_assign)
 {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifier_constant(&parser.previous);
+    int name = identifier_constant(&parser.previous);
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(OP_SET_PROPERTY, name);
+        emit_with_operand(OP_SET_PROPERTY, name);
+        emit_inline_cache();
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = argument_list();
-        emit_bytes(OP_INVOKE, name);
+        emit_with_operand(OP_INVOKE, name);
         emit_byte(arg_count);
+        emit_inline_cache();
     } else {
-        emit_bytes(OP_GET_PROPERTY, name);
+        emit_with_operand(OP_GET_PROPERTY, name);
+        emit_inline_cache();
     }
 }
 
@@ -366,11 +949,14 @@ static void parse_precedence(Precedence precedence)
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
+    int start = current_chunk()->count;
     prefix_rule(can_assign);
 
     while (precedence <= get_rule(parser.current.type)->precedence) {
         advance();
         ParseFn infix_rule = get_rule(parser.previous.type)->infix;
+        // whatever has been compiled since start is the left operand of this infix operator
+        current->operand_start = start;
         infix_rule(can_assign);
     }
 
@@ -403,7 +989,7 @@ static int resolve_local(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int add_upvalue(Compiler* compiler, uint8_t index, bool is_local)
+static int add_upvalue(Compiler* compiler, uint16_t index, bool is_local)
 {
     int upvalue_count = compiler->function->upvalue_count;
 
@@ -432,12 +1018,12 @@ static int resolve_upvalue(Compiler* compiler, Token* name)
     int local = resolve_local(compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].is_captured = true;
-        return add_upvalue(compiler, (uint8_t)local, true);
+        return add_upvalue(compiler, (uint16_t)local, true);
     }
 
     int upvalue = resolve_upvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return add_upvalue(compiler, (uint8_t)upvalue, false);
+        return add_upvalue(compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
@@ -445,11 +1031,13 @@ static int resolve_upvalue(Compiler* compiler, Token* name)
 
 static void add_local(Token name)
 {
-    if (current->local_count == UINT8_COUNT) {
+    // the register backend keeps each local in a register, which are named by one byte operands
+    int max_locals = current->backend == BACKEND_REGISTER ? UINT8_COUNT : UINT16_COUNT;
+    if (current->local_count == max_locals) {
         error("Too many local variables in function.");
         return;
     }
-    Local* local = &current->locals[current->local_count++];
+    Local* local = push_local();
     local->name = name;
     local->depth = -1;
     local->is_captured = false;
@@ -476,18 +1064,18 @@ static void declare_variable()
     add_local(*name);
 }
 
-static uint8_t parse_variable(const char* error_message)
+static uint16_t parse_variable(const char* error_message)
 {
     consume(TOKEN_IDENTIFIER, error_message);
 
     declare_variable();
     if (current->scope_depth > 0) {
-        // we are in a local scope, return dummy table index
-        // (locals aren't looked up by name)
+        // we are in a local scope, return dummy global slot
+        // (locals live in the frame)
         return 0;
     }
 
-    return identifier_constant(&parser.previous);
+    return global_variable(&parser.previous);
 }
 
 static void mark_initialized()
@@ -525,21 +1113,31 @@ static void expression_statement()
 static void if_statement()
 {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int condition_start = current_chunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-    statement();
-
-    int else_jump = emit_jump(OP_JUMP);
+    Value condition;
+    if (constant_condition(condition_start, &condition)) {
+        bool taken = !is_falsey_constant(condition);
+        compile_branch(statement, taken);
+        if (match(TOKEN_ELSE)) {
+            compile_branch(statement, !taken);
+        }
+        return;
+    }
 
-    patch_jump(then_jump);
-    emit_byte(OP_POP);
+    int then_jump = emit_jump(OP_POP_JUMP_IF_FALSE);
+    statement();
 
-    if (match(TOKEN_ELSE))
+    if (match(TOKEN_ELSE)) {
+        int else_jump = emit_jump(OP_JUMP);
+        patch_jump(then_jump);
         statement();
-    patch_jump(else_jump);
+        patch_jump(else_jump);
+    } else {
+        patch_jump(then_jump);
+    }
 }
 
 static void while_statement()
@@ -549,13 +1147,22 @@ static void while_statement()
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    Value condition;
+    if (constant_condition(loop_start, &condition)) {
+        if (is_falsey_constant(condition)) {
+            compile_branch(statement, false);
+        } else {
+            statement();
+            emit_loop(loop_start);
+        }
+        return;
+    }
+
+    int exit_jump = emit_jump(OP_POP_JUMP_IF_FALSE);
     statement();
     emit_loop(loop_start);
 
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
 }
 
 static void synchronize()
@@ -582,13 +1189,13 @@ static void synchronize()
     }
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(uint16_t global)
 {
     if (current->scope_depth > 0) {
         mark_initialized();
         return;
     }
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_global(OP_DEFINE_GLOBAL, global);
 }
 
 static void and_(bool can_assign)
@@ -615,7 +1222,7 @@ static void or_(bool can_assign)
 
 static void var_declaration()
 {
-    uint8_t global = parse_variable("Expect variable name.");
+    uint16_t global = parse_variable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -643,15 +1250,21 @@ static void for_statement()
 
     int loop_start = current_chunk()->count;
     int exit_jump = -1;
+    bool live = true;
 
     if (!match(TOKEN_SEMICOLON)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        // jump out of the loop if condition is falsey
-        exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-        emit_byte(OP_POP); // condition
+        Value condition;
+        if (constant_condition(loop_start, &condition)) {
+            live = !is_falsey_constant(condition);
+        } else {
+            // jump out of the loop if condition is falsey
+            exit_jump = emit_jump(OP_POP_JUMP_IF_FALSE);
+        }
     }
+    ChunkMark mark = mark_chunk();
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         int body_jump = emit_jump(OP_JUMP);
@@ -670,7 +1283,10 @@ static void for_statement()
 
     if (exit_jump != -1) {
         patch_jump(exit_jump);
-        emit_byte(OP_POP); // condition
+    }
+    // the condition is constant false, only the initializer runs
+    if (!live) {
+        rewind_chunk(mark);
     }
 
     end_scope();
@@ -689,8 +1305,8 @@ static void function(FunctionType type)
             if (current->function->arity > 255) {
                 error_at_current("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parse_variable("Expect parameter name.");
-            define_variable(constant);
+            parse_variable("Expect parameter name.");
+            define_variable(0);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
@@ -698,11 +1314,16 @@ static void function(FunctionType type)
     block();
 
     ObjFunction* function = end_compiler();
-    emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+    emit_with_operand(OP_CLOSURE, operand_constant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalue_count; i++) {
-        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-        emit_byte(compiler.upvalues[i].index);
+        Upvalue* upvalue = &compiler.upvalues[i];
+        if (upvalue->index > UINT8_MAX) {
+            emit_byte(2);
+            emit_short(upvalue->index);
+        } else {
+            emit_bytes(upvalue->is_local ? 1 : 0, (uint8_t)upvalue->index);
+        }
     }
     /*
     The OP_CLOSURE instruction is unique in that it has a variably sized encoding.
@@ -711,6 +1332,7 @@ static void function(FunctionType type)
     If the first byte is one, it captures a local variable in the enclosing function.
     If zero, it captures one of the function’s upvalues.
     The next byte is the local slot or upvalue index to capture.
+    A first byte of two captures a local past slot 255, whose slot takes the next two bytes.
     */
 }
 
@@ -725,16 +1347,21 @@ static void named_variable(Token name, bool can_assign)
         get_op = OP_GET_UPVALUE;
         set_op = OP_SET_UPVALUE;
     } else {
-        arg = identifier_constant(&name);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
+        arg = global_variable(&name);
+        if (can_assign && match(TOKEN_EQUAL)) {
+            expression();
+            emit_global(OP_SET_GLOBAL, arg);
+        } else {
+            emit_global(OP_GET_GLOBAL, arg);
+        }
+        return;
     }
 
     if (can_assign && match(TOKEN_EQUAL)) {
         expression();
-        emit_bytes(set_op, (uint8_t)arg);
+        emit_with_operand(set_op, arg);
     } else {
-        emit_bytes(get_op, (uint8_t)arg);
+        emit_with_operand(get_op, arg);
     }
 }
 
@@ -743,18 +1370,18 @@ static void variable(bool can_assign) { named_variable(parser.previous, can_assi
 static void method()
 {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifier_constant(&parser.previous);
+    int constant = identifier_constant(&parser.previous);
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    emit_bytes(OP_METHOD, constant);
+    emit_with_operand(OP_METHOD, constant);
 }
 
 static void fun_declaration()
 {
-    uint8_t global = parse_variable("Expect function name.");
+    uint16_t global = parse_variable("Expect function name.");
     mark_initialized();
     function(TYPE_FUNCTION);
     define_variable(global);
@@ -764,11 +1391,12 @@ static void class_declaration()
 {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token class_name = parser.previous;
-    uint8_t name_constant = identifier_constant(&parser.previous);
+    int name_constant = identifier_constant(&parser.previous);
     declare_variable();
+    uint16_t global = current->scope_depth > 0 ? 0 : global_variable(&class_name);
 
-    emit_bytes(OP_CLASS, name_constant);
-    define_variable(name_constant);
+    emit_with_operand(OP_CLASS, name_constant);
+    define_variable(global);
 
     ClassCompiler class_compiler;
     class_compiler.has_superclass = false;
@@ -810,6 +1438,7 @@ static void class_declaration()
 
 static void declaration()
 {
+    emit_jump_island();
     if (match(TOKEN_CLASS)) {
         class_declaration();
     } else if (match(TOKEN_FUN)) {
@@ -837,6 +1466,11 @@ static void return_statement()
 
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // OP_RETURN still follows, for callees that don't push a frame (natives and classes
+        // without an initializer)
+        if (current->last_call == current_chunk()->count - 2) {
+            current_chunk()->code[current->last_call] = OP_TAIL_CALL;
+        }
         emit_byte(OP_RETURN);
     }
 }
@@ -877,10 +1511,19 @@ static void number(bool can_assign)
 static void unary(bool can_assign)
 {
     TokenType operator_type = parser.previous.type;
+    int operand_start = current_chunk()->count;
 
     // compile the operand
     parse_precedence(PREC_UNARY);
 
+    Value operand, folded;
+    if (emitted_constant(operand_start, current_chunk()->count, &operand)
+        && fold_unary(operator_type, operand, &folded)) {
+        drop_emitted_constant(operand_start);
+        emit_value(folded);
+        return;
+    }
+
     // emit the operator instruction
     switch (operator_type) {
     case TOKEN_MINUS:
@@ -935,68 +1578,1128 @@ static void super_(bool can_assign)
     }
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifier_constant(&parser.previous); // constant table index of method name
+    int name = identifier_constant(&parser.previous); // constant table index of method name
 
     named_variable(synthetic_token("this"), false); // push current instance on the stack
 
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t arg_count = argument_list();
         named_variable(synthetic_token("super"), false); // push superclass on the stack
-        emit_bytes(OP_SUPER_INVOKE, name);
+        emit_with_operand(OP_SUPER_INVOKE, name);
         emit_byte(arg_count);
+        emit_inline_cache();
     } else {
         named_variable(synthetic_token("super"), false); // push superclass on the stack
-        emit_bytes(OP_GET_SUPER, name);
+        emit_with_operand(OP_GET_SUPER, name);
     }
 }
 
-ObjFunction* compile(const char* source)
+// Register backend
+//
+// Expressions are compiled into an ExpDesc that says where their value is, instead of always
+// pushing it. A local is read straight from its register, and an instruction computing a fresh
+// value leaves its destination open until the consumer decides where the value should go.
+// Temporaries are allocated above the locals in stack order and reclaimed at the end of each
+// statement at the latest.
+
+typedef enum {
+    EXP_REGISTER, // the value is in register info
+    EXP_CONSTANT, // the value is constant info, nothing has been emitted yet
+    EXP_NIL,
+    EXP_TRUE,
+    EXP_FALSE,
+    EXP_RELOCATABLE // the instruction at offset info computes the value, its A is not set yet
+} ExpKind;
+
+typedef struct {
+    ExpKind kind;
+    int info;
+} ExpDesc;
+
+typedef void (*RegisterParseFn)(ExpDesc* exp, bool can_assign);
+
+typedef struct {
+    RegisterParseFn prefix;
+    RegisterParseFn infix;
+} RegisterParseRule;
+
+static void reg_expression(ExpDesc* exp);
+static void reg_statement();
+static void reg_declaration();
+static RegisterParseRule* get_register_rule(TokenType type);
+
+static int reserve_register()
 {
-    init_scanner(source);
-    Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
-    parser.had_error = false;
-    parser.panic_mode = false;
-    advance();
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    if (current->free_register == UINT8_COUNT) {
+        error("Too many registers needed in function.");
+        return 0;
     }
-    ObjFunction* function = end_compiler();
-    return parser.had_error ? NULL : function;
+    int reg = current->free_register++;
+    if (current->free_register > current->register_count) {
+        current->register_count = current->free_register;
+    }
+    return reg;
 }
 
-void mark_compiler_roots()
+// Releases reg and every temporary above it. Registers of locals live until their scope ends.
+static void free_register(int reg)
 {
-    Compiler* compiler = current;
-    while (compiler != NULL) {
-        mark_object((Obj*)compiler->function);
-        compiler = compiler->enclosing;
+    if (reg >= current->local_count && reg < current->free_register) {
+        current->free_register = reg;
     }
 }
 
-static ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN] = { grouping, call, PREC_CALL },
-    [TOKEN_RIGHT_PAREN] = { NULL, NULL, PREC_NONE },
-    [TOKEN_LEFT_BRACE] = { NULL, NULL, PREC_NONE },
-    [TOKEN_RIGHT_BRACE] = { NULL, NULL, PREC_NONE },
-    [TOKEN_COMMA] = { NULL, NULL, PREC_NONE },
-    [TOKEN_DOT] = { NULL, dot, PREC_CALL },
-    [TOKEN_MINUS] = { unary, binary, PREC_TERM },
-    [TOKEN_PLUS] = { NULL, binary, PREC_TERM },
-    [TOKEN_SEMICOLON] = { NULL, NULL, PREC_NONE },
-    [TOKEN_SLASH] = { NULL, binary, PREC_FACTOR },
-    [TOKEN_STAR] = { NULL, binary, PREC_FACTOR },
-    [TOKEN_BANG] = { unary, NULL, PREC_NONE },
-    [TOKEN_BANG_EQUAL] = { NULL, binary, PREC_EQUALITY },
-    [TOKEN_EQUAL] = { NULL, NULL, PREC_NONE },
-    [TOKEN_EQUAL_EQUAL] = { NULL, binary, PREC_EQUALITY },
-    [TOKEN_GREATER] = { NULL, binary, PREC_COMPARISON },
-    [TOKEN_GREATER_EQUAL] = { NULL, binary, PREC_COMPARISON },
-    [TOKEN_LESS] = { NULL, binary, PREC_COMPARISON },
-    [TOKEN_LESS_EQUAL] = { NULL, binary, PREC_COMPARISON },
-    [TOKEN_IDENTIFIER] = { variable, NULL, PREC_NONE },
-    [TOKEN_STRING] = { string, NULL, PREC_NONE },
-    [TOKEN_NUMBER] = { number, NULL, PREC_NONE },
+static void free_exp(ExpDesc* exp)
+{
+    if (exp->kind == EXP_REGISTER) {
+        free_register(exp->info);
+    }
+}
+
+static void relocatable(ExpDesc* exp, uint8_t instruction)
+{
+    exp->kind = EXP_RELOCATABLE;
+    exp->info = current_chunk()->count;
+    emit_bytes(instruction, 0);
+}
+
+static void exp_to_register(ExpDesc* exp, int reg)
+{
+    switch (exp->kind) {
+    case EXP_REGISTER:
+        if (exp->info != reg) {
+            emit_bytes(ROP_MOVE, reg);
+            emit_byte(exp->info);
+        }
+        break;
+    case EXP_CONSTANT:
+        if (exp->info > UINT8_MAX) {
+            emit_bytes(ROP_LOAD_CONSTANT_LONG, reg);
+            emit_long(exp->info);
+        } else {
+            emit_bytes(ROP_LOAD_CONSTANT, reg);
+            emit_byte(exp->info);
+        }
+        break;
+    case EXP_NIL:
+        emit_bytes(ROP_NIL, reg);
+        break;
+    case EXP_TRUE:
+        emit_bytes(ROP_TRUE, reg);
+        break;
+    case EXP_FALSE:
+        emit_bytes(ROP_FALSE, reg);
+        break;
+    case EXP_RELOCATABLE:
+        current_chunk()->code[exp->info + 1] = reg;
+        break;
+    }
+    exp->kind = EXP_REGISTER;
+    exp->info = reg;
+}
+
+static int exp_to_next_register(ExpDesc* exp)
+{
+    free_exp(exp);
+    int reg = reserve_register();
+    exp_to_register(exp, reg);
+    return reg;
+}
+
+static int exp_to_any_register(ExpDesc* exp)
+{
+    if (exp->kind == EXP_REGISTER) {
+        return exp->info;
+    }
+    return exp_to_next_register(exp);
+}
+
+// Like exp_to_register, for a value computed after reg was reserved: its temporary is released.
+static void exp_into_register(ExpDesc* exp, int reg)
+{
+    int from = exp->kind == EXP_REGISTER ? exp->info : -1;
+    exp_to_register(exp, reg);
+    if (from > reg) {
+        free_register(from);
+    }
+}
+
+static int register_instruction_length(Chunk* chunk, int offset)
+{
+    switch (chunk->code[offset]) {
+    case ROP_CLOSE_UPVALUES:
+    case ROP_NIL:
+    case ROP_TRUE:
+    case ROP_FALSE:
+    case ROP_RETURN:
+    case ROP_PRINT:
+        return 2;
+    case ROP_MOVE:
+    case ROP_LOAD_CONSTANT:
+    case ROP_NEGATE:
+    case ROP_NOT:
+    case ROP_JUMP:
+    case ROP_LOOP:
+    case ROP_GET_UPVALUE:
+    case ROP_SET_UPVALUE:
+    case ROP_CALL:
+    case ROP_TAIL_CALL:
+    case ROP_INHERIT:
+        return 3;
+    case ROP_CLASS:
+    case ROP_JUMP_LONG:
+    case ROP_LOOP_LONG:
+        return 4;
+    case ROP_METHOD:
+    case ROP_LOAD_CONSTANT_LONG:
+        return 5;
+    case ROP_GET_SUPER:
+        return 6;
+    case ROP_GET_PROPERTY:
+    case ROP_SET_PROPERTY:
+    case ROP_INVOKE:
+        return 7;
+    case ROP_SUPER_INVOKE:
+        return 8;
+    case ROP_CLOSURE: {
+        int constant = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        return 4 + function->upvalue_count * 2;
+    }
+    default:
+        return 4;
+    }
+}
+
+// Whether the code emitted since start may change register reg.
+static bool clobbers_register(int start, int reg)
+{
+    Chunk* chunk = current_chunk();
+    for (int offset = start; offset < chunk->count;
+         offset += register_instruction_length(chunk, offset)) {
+        switch (chunk->code[offset]) {
+        case ROP_CALL:
+        case ROP_TAIL_CALL:
+        case ROP_INVOKE:
+        case ROP_SUPER_INVOKE:
+            // the callee can assign the local through an upvalue
+            return true;
+        case ROP_JUMP:
+        case ROP_LOOP:
+        case ROP_JUMP_LONG:
+        case ROP_LOOP_LONG:
+        case ROP_JUMP_IF_FALSE:
+        case ROP_JUMP_IF_TRUE:
+        case ROP_DEFINE_GLOBAL:
+        case ROP_SET_GLOBAL:
+        case ROP_SET_UPVALUE:
+        case ROP_CLOSE_UPVALUES:
+        case ROP_RETURN:
+        case ROP_PRINT:
+        case ROP_INHERIT:
+        case ROP_METHOD:
+        case ROP_SET_PROPERTY:
+            break;
+        default:
+            if (chunk->code[offset + 1] == reg)
+                return true;
+        }
+    }
+    return false;
+}
+
+static void insert_move(int offset, int to, int from)
+{
+    Chunk* chunk = current_chunk();
+    int line = chunk->lines[offset];
+    for (int i = 0; i < 3; i++) {
+        write_chunk(chunk, 0, line);
+    }
+    memmove(chunk->code + offset + 3, chunk->code + offset, chunk->count - offset - 3);
+    memmove(chunk->lines + offset + 3, chunk->lines + offset,
+        (chunk->count - offset - 3) * sizeof(int));
+    chunk->code[offset] = ROP_MOVE;
+    chunk->code[offset + 1] = to;
+    chunk->code[offset + 2] = from;
+}
+
+// A local used as the left operand is read straight from its register, which is only safe if the
+// code for the right operand doesn't reassign it. That is known once the right operand has been
+// emitted, so a spare register is reserved up front and the local is copied into it, ahead of the
+// right operand, only when needed.
+typedef struct {
+    int reg;
+    int spare;
+    int code_start;
+} HeldOperand;
+
+static HeldOperand hold_operand(ExpDesc* exp)
+{
+    HeldOperand operand;
+    operand.spare = -1;
+    if (exp->kind == EXP_REGISTER && exp->info < current->local_count) {
+        operand.reg = exp->info;
+        operand.spare = reserve_register();
+    } else {
+        operand.reg = exp_to_any_register(exp);
+    }
+    operand.code_start = current_chunk()->count;
+    return operand;
+}
+
+static void settle_operand(HeldOperand* operand)
+{
+    if (operand->spare != -1 && clobbers_register(operand->code_start, operand->reg)) {
+        insert_move(operand->code_start, operand->spare, operand->reg);
+        operand->reg = operand->spare;
+    }
+}
+
+static void release_operand(HeldOperand* operand)
+{
+    free_register(operand->spare != -1 ? operand->spare : operand->reg);
+}
+
+static void emit_register_return()
+{
+    if (current->type == TYPE_INITIALIZER) {
+        emit_bytes(ROP_RETURN, 0);
+        return;
+    }
+    int reg = reserve_register();
+    emit_bytes(ROP_NIL, reg);
+    emit_bytes(ROP_RETURN, reg);
+    free_register(reg);
+}
+
+static int emit_register_jump(uint8_t instruction, int reg)
+{
+    emit_bytes(instruction, reg);
+    emit_byte(0xFF);
+    emit_byte(0xFF);
+    return pending_jump();
+}
+
+static void emit_register_loop(int loop_start)
+{
+    emit_loop_instruction(ROP_LOOP, ROP_LOOP_LONG, loop_start);
+}
+
+static void reg_end_scope()
+{
+    current->scope_depth--;
+
+    int first_captured = -1;
+    while (current->local_count > 0
+        && current->locals[current->local_count - 1].depth > current->scope_depth) {
+        if (current->locals[current->local_count - 1].is_captured) {
+            first_captured = current->local_count - 1;
+        }
+        current->local_count--;
+    }
+    if (first_captured != -1) {
+        emit_bytes(ROP_CLOSE_UPVALUES, first_captured);
+    }
+    current->free_register = current->local_count;
+}
+
+static void reg_parse_precedence(Precedence precedence, ExpDesc* exp)
+{
+    advance();
+    RegisterParseFn prefix_rule = get_register_rule(parser.previous.type)->prefix;
+    if (prefix_rule == NULL) {
+        error("Expect expression.");
+        exp->kind = EXP_NIL;
+        return;
+    }
+
+    bool can_assign = precedence <= PREC_ASSIGNMENT;
+    prefix_rule(exp, can_assign);
+
+    while (precedence <= get_rule(parser.current.type)->precedence) {
+        advance();
+        RegisterParseFn infix_rule = get_register_rule(parser.previous.type)->infix;
+        infix_rule(exp, can_assign);
+    }
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        error("Invalid assignment target.");
+    }
+}
+
+static void reg_expression(ExpDesc* exp) { reg_parse_precedence(PREC_ASSIGNMENT, exp); }
+
+// Whether exp is a constant, stored in value. Nothing has been emitted for it then.
+static bool exp_constant(ExpDesc* exp, Value* value)
+{
+    switch (exp->kind) {
+    case EXP_CONSTANT:
+        *value = current_chunk()->constants.values[exp->info];
+        return true;
+    case EXP_NIL:
+        *value = NIL_VAL;
+        return true;
+    case EXP_TRUE:
+    case EXP_FALSE:
+        *value = BOOL_VAL(exp->kind == EXP_TRUE);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Removes the constant of an exp that won't be used, when no other one has been added since.
+static void drop_exp_constant(ExpDesc* exp)
+{
+    ValueArray* constants = &current_chunk()->constants;
+    if (exp->kind == EXP_CONSTANT && exp->info == constants->count - 1) {
+        constants->count--;
+    }
+}
+
+static void exp_from_value(ExpDesc* exp, Value value)
+{
+    if (IS_NIL(value)) {
+        exp->kind = EXP_NIL;
+    } else if (IS_BOOL(value)) {
+        exp->kind = AS_BOOL(value) ? EXP_TRUE : EXP_FALSE;
+    } else {
+        exp->kind = EXP_CONSTANT;
+        exp->info = make_constant(value);
+    }
+}
+
+static void r_binary(ExpDesc* exp, bool can_assign)
+{
+    TokenType operator_type = parser.previous.type;
+    ParseRule* rule = get_rule(operator_type);
+
+    ExpDesc lhs_exp = *exp;
+    int lhs_code = current_chunk()->count;
+    HeldOperand lhs = hold_operand(exp);
+    ExpDesc rhs;
+    reg_parse_precedence((Precedence)(rule->precedence + 1), &rhs);
+
+    // with a constant right operand, loading the constant left one is the last code emitted
+    Value a, b, folded;
+    if (exp_constant(&lhs_exp, &a) && exp_constant(&rhs, &b)
+        && fold_binary(operator_type, a, b, &folded)) {
+        current_chunk()->count = lhs_code;
+        release_operand(&lhs);
+        drop_exp_constant(&rhs);
+        drop_exp_constant(&lhs_exp);
+        exp_from_value(exp, folded);
+        return;
+    }
+
+    // a constant right operand of + and - is encoded in the instruction
+    bool rhs_constant = rhs.kind == EXP_CONSTANT && rhs.info <= UINT8_MAX
+        && (operator_type == TOKEN_PLUS || operator_type == TOKEN_MINUS);
+    int rhs_reg = rhs_constant ? rhs.info : exp_to_any_register(&rhs);
+    settle_operand(&lhs);
+    if (!rhs_constant) {
+        free_exp(&rhs);
+    }
+    release_operand(&lhs);
+
+    uint8_t instruction;
+    switch (operator_type) {
+    case TOKEN_PLUS:
+        instruction = rhs_constant ? ROP_ADD_CONSTANT : ROP_ADD;
+        break;
+    case TOKEN_MINUS:
+        instruction = rhs_constant ? ROP_SUBTRACT_CONSTANT : ROP_SUBTRACT;
+        break;
+    case TOKEN_STAR:
+        instruction = ROP_MULTIPLY;
+        break;
+    case TOKEN_SLASH:
+        instruction = ROP_DIVIDE;
+        break;
+    case TOKEN_BANG_EQUAL:
+        instruction = ROP_NOT_EQUAL;
+        break;
+    case TOKEN_EQUAL_EQUAL:
+        instruction = ROP_EQUAL;
+        break;
+    case TOKEN_GREATER:
+        instruction = ROP_GREATER;
+        break;
+    case TOKEN_GREATER_EQUAL:
+        instruction = ROP_GREATER_EQUAL;
+        break;
+    case TOKEN_LESS:
+        instruction = ROP_LESS;
+        break;
+    case TOKEN_LESS_EQUAL:
+        instruction = ROP_LESS_EQUAL;
+        break;
+
+    default:
+        return;
+    }
+    relocatable(exp, instruction);
+    emit_bytes(lhs.reg, rhs_reg);
+}
+
+static void r_unary(ExpDesc* exp, bool can_assign)
+{
+    TokenType operator_type = parser.previous.type;
+
+    reg_parse_precedence(PREC_UNARY, exp);
+
+    Value constant, folded;
+    if (exp_constant(exp, &constant) && fold_unary(operator_type, constant, &folded)) {
+        drop_exp_constant(exp);
+        exp_from_value(exp, folded);
+        return;
+    }
+
+    int operand = exp_to_any_register(exp);
+    free_exp(exp);
+
+    relocatable(exp, operator_type == TOKEN_MINUS ? ROP_NEGATE : ROP_NOT);
+    emit_byte(operand);
+}
+
+static void r_grouping(ExpDesc* exp, bool can_assign)
+{
+    reg_expression(exp);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+static void r_number(ExpDesc* exp, bool can_assign)
+{
+    double value = strtod(parser.previous.start, NULL);
+    exp->kind = EXP_CONSTANT;
+    exp->info = make_constant(NUMBER_VAL(value));
+}
+
+static void r_string(ExpDesc* exp, bool can_assign)
+{
+    exp->kind = EXP_CONSTANT;
+    exp->info = make_constant(
+        OBJ_VAL(copy_string(parser.previous.start + 1, parser.previous.length - 2)));
+}
+
+static void r_literal(ExpDesc* exp, bool can_assign)
+{
+    switch (parser.previous.type) {
+    case TOKEN_FALSE:
+        exp->kind = EXP_FALSE;
+        break;
+    case TOKEN_TRUE:
+        exp->kind = EXP_TRUE;
+        break;
+    default:
+        exp->kind = EXP_NIL;
+        break;
+    }
+}
+
+// The result of and/or lives in the register the left operand was put in.
+static void r_logical(ExpDesc* exp, uint8_t jump, Precedence precedence)
+{
+    int reg = exp_to_next_register(exp);
+    int end_jump = emit_register_jump(jump, reg);
+
+    ExpDesc rhs;
+    reg_parse_precedence(precedence, &rhs);
+    exp_into_register(&rhs, reg);
+    current->free_register = reg + 1;
+
+    patch_jump(end_jump);
+    exp->kind = EXP_REGISTER;
+    exp->info = reg;
+}
+
+static void r_and(ExpDesc* exp, bool can_assign) { r_logical(exp, ROP_JUMP_IF_FALSE, PREC_AND); }
+
+static void r_or(ExpDesc* exp, bool can_assign) { r_logical(exp, ROP_JUMP_IF_TRUE, PREC_OR); }
+
+// Arguments go to consecutive registers right above the callee.
+static uint8_t reg_argument_list()
+{
+    uint8_t arg_count = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            ExpDesc arg;
+            reg_expression(&arg);
+            exp_to_next_register(&arg);
+            if (arg_count == 255) {
+                error("Can't have more than 255 arguments.");
+            }
+            arg_count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return arg_count;
+}
+
+static void call_result(ExpDesc* exp, int base)
+{
+    current->free_register = base + 1;
+    exp->kind = EXP_REGISTER;
+    exp->info = base;
+}
+
+static void r_call(ExpDesc* exp, bool can_assign)
+{
+    int base = exp_to_next_register(exp);
+    uint8_t arg_count = reg_argument_list();
+    current->last_call = current_chunk()->count;
+    emit_bytes(ROP_CALL, base);
+    emit_byte(arg_count);
+    call_result(exp, base);
+}
+
+static void r_dot(ExpDesc* exp, bool can_assign)
+{
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint16_t name = identifier_constant(&parser.previous);
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        HeldOperand object = hold_operand(exp);
+        ExpDesc value;
+        reg_expression(&value);
+        int value_reg = exp_to_any_register(&value);
+        settle_operand(&object);
+        emit_bytes(ROP_SET_PROPERTY, object.reg);
+        emit_short(name);
+        emit_byte(value_reg);
+        emit_inline_cache();
+        // the assignment evaluates to the value, the object's register goes with it
+        *exp = value;
+    } else if (match(TOKEN_LEFT_PAREN)) {
+        int base = exp_to_next_register(exp);
+        uint8_t arg_count = reg_argument_list();
+        emit_bytes(ROP_INVOKE, base);
+        emit_short(name);
+        emit_byte(arg_count);
+        emit_inline_cache();
+        call_result(exp, base);
+    } else {
+        int object = exp_to_any_register(exp);
+        free_exp(exp);
+        relocatable(exp, ROP_GET_PROPERTY);
+        emit_byte(object);
+        emit_short(name);
+        emit_inline_cache();
+    }
+}
+
+static void reg_named_variable(Token name, bool can_assign, ExpDesc* exp)
+{
+    int arg = resolve_local(current, &name);
+    if (arg != -1) {
+        if (can_assign && match(TOKEN_EQUAL)) {
+            ExpDesc value;
+            reg_expression(&value);
+            exp_into_register(&value, arg);
+        }
+        exp->kind = EXP_REGISTER;
+        exp->info = arg;
+        return;
+    }
+
+    uint8_t get_op, set_op;
+    if ((arg = resolve_upvalue(current, &name)) != -1) {
+        get_op = ROP_GET_UPVALUE;
+        set_op = ROP_SET_UPVALUE;
+    } else {
+        arg = global_variable(&name);
+        if (can_assign && match(TOKEN_EQUAL)) {
+            reg_expression(exp);
+            emit_bytes(ROP_SET_GLOBAL, exp_to_any_register(exp));
+            emit_bytes((arg >> 8) & 0xFF, arg & 0xFF);
+        } else {
+            relocatable(exp, ROP_GET_GLOBAL);
+            emit_bytes((arg >> 8) & 0xFF, arg & 0xFF);
+        }
+        return;
+    }
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        reg_expression(exp);
+        emit_bytes(set_op, exp_to_any_register(exp));
+        emit_byte((uint8_t)arg);
+    } else {
+        relocatable(exp, get_op);
+        emit_byte((uint8_t)arg);
+    }
+}
+
+static void r_variable(ExpDesc* exp, bool can_assign)
+{
+    reg_named_variable(parser.previous, can_assign, exp);
+}
+
+static void r_this(ExpDesc* exp, bool can_assign)
+{
+    if (current_class == NULL) {
+        error("Can't use 'this' outside of a class.");
+        exp->kind = EXP_NIL;
+        return;
+    }
+    r_variable(exp, false);
+}
+
+static void r_super(ExpDesc* exp, bool can_assign)
+{
+    if (current_class == NULL) {
+        error("Can't use 'super' outside of a class.");
+    } else if (!current_class->has_superclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+    consume(TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint16_t name = identifier_constant(&parser.previous);
+
+    ExpDesc receiver;
+    ExpDesc superclass;
+    reg_named_variable(synthetic_token("this"), false, &receiver);
+
+    if (match(TOKEN_LEFT_PAREN)) {
+        int base = exp_to_next_register(&receiver);
+        uint8_t arg_count = reg_argument_list();
+        reg_named_variable(synthetic_token("super"), false, &superclass);
+        int superclass_reg = exp_to_any_register(&superclass);
+        emit_bytes(ROP_SUPER_INVOKE, base);
+        emit_short(name);
+        emit_byte(arg_count);
+        emit_byte(superclass_reg);
+        emit_inline_cache();
+        call_result(exp, base);
+    } else {
+        int receiver_reg = exp_to_any_register(&receiver);
+        reg_named_variable(synthetic_token("super"), false, &superclass);
+        int superclass_reg = exp_to_any_register(&superclass);
+        free_exp(&superclass);
+        free_exp(&receiver);
+        relocatable(exp, ROP_GET_SUPER);
+        emit_bytes(receiver_reg, superclass_reg);
+        emit_short(name);
+    }
+}
+
+static void reg_define_variable(uint16_t global, int reg)
+{
+    if (current->scope_depth > 0) {
+        mark_initialized();
+        return;
+    }
+    emit_bytes(ROP_DEFINE_GLOBAL, reg);
+    emit_bytes((global >> 8) & 0xFF, global & 0xFF);
+}
+
+static void reg_block()
+{
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        reg_declaration();
+    }
+
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// Compiles a function and puts its closure in register dst.
+static void reg_function(FunctionType type, int dst)
+{
+    Compiler compiler;
+    init_compiler(&compiler, type);
+    begin_scope();
+
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            current->function->arity++;
+            if (current->function->arity > 255) {
+                error_at_current("Can't have more than 255 parameters.");
+            }
+            parse_variable("Expect parameter name.");
+            reg_define_variable(0, reserve_register());
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    reg_block();
+
+    ObjFunction* function = end_compiler();
+    // the constant table is what keeps the function alive, it goes there before any allocation
+    int constant = operand_constant(OBJ_VAL(function));
+    emit_bytes(ROP_CLOSURE, dst);
+    emit_short(constant);
+
+    for (int i = 0; i < function->upvalue_count; i++) {
+        emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
+        emit_byte(compiler.upvalues[i].index);
+    }
+}
+
+static void reg_var_declaration()
+{
+    uint16_t global = parse_variable("Expect variable name.");
+    // a local's register is the next free one, a global's value only passes through it
+    int reg = reserve_register();
+
+    if (match(TOKEN_EQUAL)) {
+        ExpDesc value;
+        reg_expression(&value);
+        exp_into_register(&value, reg);
+    } else {
+        emit_bytes(ROP_NIL, reg);
+    }
+
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    reg_define_variable(global, reg);
+}
+
+static void reg_fun_declaration()
+{
+    uint16_t global = parse_variable("Expect function name.");
+    int reg = reserve_register();
+    mark_initialized();
+    reg_function(TYPE_FUNCTION, reg);
+    reg_define_variable(global, reg);
+}
+
+static void reg_method(int klass)
+{
+    consume(TOKEN_IDENTIFIER, "Expect method name.");
+    uint16_t constant = identifier_constant(&parser.previous);
+    FunctionType type = TYPE_METHOD;
+    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+        type = TYPE_INITIALIZER;
+    }
+    int reg = reserve_register();
+    reg_function(type, reg);
+    emit_bytes(ROP_METHOD, klass);
+    emit_byte(reg);
+    emit_short(constant);
+    free_register(reg);
+}
+
+static void reg_class_declaration()
+{
+    consume(TOKEN_IDENTIFIER, "Expect class name.");
+    Token class_name = parser.previous;
+    uint16_t name_constant = identifier_constant(&parser.previous);
+    declare_variable();
+    uint16_t global = current->scope_depth > 0 ? 0 : global_variable(&class_name);
+
+    int reg = reserve_register();
+    emit_bytes(ROP_CLASS, reg);
+    emit_short(name_constant);
+    reg_define_variable(global, reg);
+    // the register of a global class is needed for "super", the class is read back below
+    free_register(reg);
+
+    ClassCompiler class_compiler;
+    class_compiler.has_superclass = false;
+    class_compiler.enclosing = current_class;
+    current_class = &class_compiler;
+
+    ExpDesc klass;
+    if (match(TOKEN_LESS)) {
+        consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+        ExpDesc superclass;
+        r_variable(&superclass, false);
+
+        if (identifiers_equal(&class_name, &parser.previous)) {
+            error("A class can't inherit from itself.");
+        }
+
+        begin_scope();
+        add_local(synthetic_token("super"));
+        int superclass_reg = reserve_register();
+        exp_into_register(&superclass, superclass_reg);
+        reg_define_variable(0, superclass_reg);
+
+        reg_named_variable(class_name, false, &klass);
+        emit_bytes(ROP_INHERIT, exp_to_any_register(&klass));
+        emit_byte(superclass_reg);
+        class_compiler.has_superclass = true;
+    } else {
+        reg_named_variable(class_name, false, &klass);
+    }
+
+    int klass_reg = exp_to_any_register(&klass);
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        reg_method(klass_reg);
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    free_exp(&klass);
+
+    if (class_compiler.has_superclass) {
+        reg_end_scope();
+    }
+
+    current_class = current_class->enclosing;
+}
+
+static void reg_print_statement()
+{
+    ExpDesc value;
+    reg_expression(&value);
+    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+    emit_bytes(ROP_PRINT, exp_to_any_register(&value));
+}
+
+static void reg_expression_statement()
+{
+    ExpDesc value;
+    reg_expression(&value);
+    consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+    // an instruction whose result is never read still has to run for its side effects
+    if (value.kind == EXP_RELOCATABLE) {
+        exp_to_next_register(&value);
+    }
+}
+
+// Returns the register of the condition, or -1 when it is a constant, stored in constant, for
+// which nothing has been emitted.
+static int reg_condition(Value* constant)
+{
+    ExpDesc condition;
+    reg_expression(&condition);
+    if (exp_constant(&condition, constant)) {
+        drop_exp_constant(&condition);
+        return -1;
+    }
+    int reg = exp_to_any_register(&condition);
+    free_exp(&condition);
+    return reg;
+}
+
+static void reg_if_statement()
+{
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    Value constant;
+    int condition = reg_condition(&constant);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    if (condition == -1) {
+        bool taken = !is_falsey_constant(constant);
+        compile_branch(reg_statement, taken);
+        if (match(TOKEN_ELSE)) {
+            compile_branch(reg_statement, !taken);
+        }
+        return;
+    }
+
+    int then_jump = emit_register_jump(ROP_JUMP_IF_FALSE, condition);
+    reg_statement();
+
+    if (match(TOKEN_ELSE)) {
+        int else_jump = emit_jump(ROP_JUMP);
+        patch_jump(then_jump);
+        reg_statement();
+        patch_jump(else_jump);
+    } else {
+        patch_jump(then_jump);
+    }
+}
+
+static void reg_while_statement()
+{
+    int loop_start = current_chunk()->count;
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    Value constant;
+    int condition = reg_condition(&constant);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    if (condition == -1) {
+        if (is_falsey_constant(constant)) {
+            compile_branch(reg_statement, false);
+        } else {
+            reg_statement();
+            emit_register_loop(loop_start);
+        }
+        return;
+    }
+
+    int exit_jump = emit_register_jump(ROP_JUMP_IF_FALSE, condition);
+    reg_statement();
+    emit_register_loop(loop_start);
+
+    patch_jump(exit_jump);
+}
+
+static void reg_for_statement()
+{
+    begin_scope();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+
+    if (match(TOKEN_SEMICOLON)) {
+        // no initializer
+    } else if (match(TOKEN_VAR)) {
+        reg_var_declaration();
+    } else {
+        reg_expression_statement();
+    }
+    current->free_register = current->local_count;
+
+    int loop_start = current_chunk()->count;
+    int exit_jump = -1;
+    bool live = true;
+
+    if (!match(TOKEN_SEMICOLON)) {
+        Value constant;
+        int condition = reg_condition(&constant);
+        consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        if (condition == -1) {
+            live = !is_falsey_constant(constant);
+        } else {
+            exit_jump = emit_register_jump(ROP_JUMP_IF_FALSE, condition);
+        }
+    }
+    ChunkMark mark = mark_chunk();
+
+    if (!match(TOKEN_RIGHT_PAREN)) {
+        int body_jump = emit_jump(ROP_JUMP);
+        int increment_start = current_chunk()->count;
+        ExpDesc increment;
+        reg_expression(&increment);
+        if (increment.kind == EXP_RELOCATABLE) {
+            exp_to_next_register(&increment);
+        }
+        current->free_register = current->local_count;
+        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emit_register_loop(loop_start);
+        loop_start = increment_start;
+        patch_jump(body_jump);
+    }
+
+    reg_statement();
+    emit_register_loop(loop_start);
+
+    if (exit_jump != -1) {
+        patch_jump(exit_jump);
+    }
+    // the condition is constant false, only the initializer runs
+    if (!live) {
+        rewind_chunk(mark);
+    }
+
+    reg_end_scope();
+}
+
+static void reg_return_statement()
+{
+    if (current->type == TYPE_SCRIPT) {
+        error("Can't return from top-level code.");
+    }
+    if (match(TOKEN_SEMICOLON)) {
+        emit_register_return();
+    } else {
+        if (current->type == TYPE_INITIALIZER) {
+            error("Can't return a value from an initializer.");
+        }
+
+        ExpDesc value;
+        reg_expression(&value);
+        consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        int reg = exp_to_any_register(&value);
+        // like in the stack backend, ROP_RETURN still follows for callees without a frame
+        if (current->last_call == current_chunk()->count - 3) {
+            current_chunk()->code[current->last_call] = ROP_TAIL_CALL;
+        }
+        emit_bytes(ROP_RETURN, reg);
+    }
+}
+
+static void reg_statement()
+{
+    if (match(TOKEN_PRINT)) {
+        reg_print_statement();
+    } else if (match(TOKEN_IF)) {
+        reg_if_statement();
+    } else if (match(TOKEN_WHILE)) {
+        reg_while_statement();
+    } else if (match(TOKEN_FOR)) {
+        reg_for_statement();
+    } else if (match(TOKEN_RETURN)) {
+        reg_return_statement();
+    } else if (match(TOKEN_LEFT_BRACE)) {
+        begin_scope();
+        reg_block();
+        reg_end_scope();
+    } else {
+        reg_expression_statement();
+    }
+    current->free_register = current->local_count;
+}
+
+static void reg_declaration()
+{
+    emit_jump_island();
+    if (match(TOKEN_CLASS)) {
+        reg_class_declaration();
+    } else if (match(TOKEN_FUN)) {
+        reg_fun_declaration();
+    } else if (match(TOKEN_VAR)) {
+        reg_var_declaration();
+    } else {
+        reg_statement();
+    }
+    current->free_register = current->local_count;
+    if (parser.panic_mode)
+        synchronize();
+}
+
+ObjFunction* compile(const char* source, Backend backend)
+{
+    init_scanner(source);
+    Compiler compiler;
+    init_compiler(&compiler, TYPE_SCRIPT);
+    compiler.backend = backend;
+    parser.had_error = false;
+    parser.panic_mode = false;
+    advance();
+    while (!match(TOKEN_EOF)) {
+        if (backend == BACKEND_REGISTER) {
+            reg_declaration();
+        } else {
+            declaration();
+        }
+    }
+    ObjFunction* function = end_compiler();
+    return parser.had_error ? NULL : function;
+}
+
+void mark_compiler_roots()
+{
+    Compiler* compiler = current;
+    while (compiler != NULL) {
+        mark_object((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
+}
+
+static ParseRule rules[] = {
+    [TOKEN_LEFT_PAREN] = { grouping, call, PREC_CALL },
+    [TOKEN_RIGHT_PAREN] = { NULL, NULL, PREC_NONE },
+    [TOKEN_LEFT_BRACE] = { NULL, NULL, PREC_NONE },
+    [TOKEN_RIGHT_BRACE] = { NULL, NULL, PREC_NONE },
+    [TOKEN_COMMA] = { NULL, NULL, PREC_NONE },
+    [TOKEN_DOT] = { NULL, dot, PREC_CALL },
+    [TOKEN_MINUS] = { unary, binary, PREC_TERM },
+    [TOKEN_PLUS] = { NULL, binary, PREC_TERM },
+    [TOKEN_SEMICOLON] = { NULL, NULL, PREC_NONE },
+    [TOKEN_SLASH] = { NULL, binary, PREC_FACTOR },
+    [TOKEN_STAR] = { NULL, binary, PREC_FACTOR },
+    [TOKEN_BANG] = { unary, NULL, PREC_NONE },
+    [TOKEN_BANG_EQUAL] = { NULL, binary, PREC_EQUALITY },
+    [TOKEN_EQUAL] = { NULL, NULL, PREC_NONE },
+    [TOKEN_EQUAL_EQUAL] = { NULL, binary, PREC_EQUALITY },
+    [TOKEN_GREATER] = { NULL, binary, PREC_COMPARISON },
+    [TOKEN_GREATER_EQUAL] = { NULL, binary, PREC_COMPARISON },
+    [TOKEN_LESS] = { NULL, binary, PREC_COMPARISON },
+    [TOKEN_LESS_EQUAL] = { NULL, binary, PREC_COMPARISON },
+    [TOKEN_IDENTIFIER] = { variable, NULL, PREC_NONE },
+    [TOKEN_STRING] = { string, NULL, PREC_NONE },
+    [TOKEN_NUMBER] = { number, NULL, PREC_NONE },
     [TOKEN_AND] = { NULL, and_, PREC_AND },
     [TOKEN_CLASS] = { NULL, NULL, PREC_NONE },
     [TOKEN_ELSE] = { NULL, NULL, PREC_NONE },
@@ -1018,3 +2721,33 @@ static ParseRule rules[] = {
 };
 
 static ParseRule* get_rule(TokenType type) { return &rules[type]; }
+
+static RegisterParseRule register_rules[] = {
+    [TOKEN_LEFT_PAREN] = { r_grouping, r_call },
+    [TOKEN_DOT] = { NULL, r_dot },
+    [TOKEN_MINUS] = { r_unary, r_binary },
+    [TOKEN_PLUS] = { NULL, r_binary },
+    [TOKEN_SLASH] = { NULL, r_binary },
+    [TOKEN_STAR] = { NULL, r_binary },
+    [TOKEN_BANG] = { r_unary, NULL },
+    [TOKEN_BANG_EQUAL] = { NULL, r_binary },
+    [TOKEN_EQUAL_EQUAL] = { NULL, r_binary },
+    [TOKEN_GREATER] = { NULL, r_binary },
+    [TOKEN_GREATER_EQUAL] = { NULL, r_binary },
+    [TOKEN_LESS] = { NULL, r_binary },
+    [TOKEN_LESS_EQUAL] = { NULL, r_binary },
+    [TOKEN_IDENTIFIER] = { r_variable, NULL },
+    [TOKEN_STRING] = { r_string, NULL },
+    [TOKEN_NUMBER] = { r_number, NULL },
+    [TOKEN_AND] = { NULL, r_and },
+    [TOKEN_FALSE] = { r_literal, NULL },
+    [TOKEN_NIL] = { r_literal, NULL },
+    [TOKEN_OR] = { NULL, r_or },
+    [TOKEN_SUPER] = { r_super, NULL },
+    [TOKEN_THIS] = { r_this, NULL },
+    [TOKEN_TRUE] = { r_literal, NULL },
+    [TOKEN_EOF] = { NULL, NULL },
+};
+
+// the register backend shares the precedence column of rules
+static RegisterParseRule* get_register_rule(TokenType type) { return &register_rules[type]; }
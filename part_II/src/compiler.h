@@ -28,7 +28,12 @@ primary        → NUMBER | STRING | "true" | "false" | "nil" | "this"
 #include "chunk.h"
 #include "object.h"
 
-ObjFunction* compile(const char* source);
+typedef enum {
+    BACKEND_STACK,
+    BACKEND_REGISTER // three-address code over frame registers, see RegisterOpCode
+} Backend;
+
+ObjFunction* compile(const char* source, Backend backend);
 void mark_compiler_roots();
 
 #endif
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "debug.h"
 #include "value.h"
 #include "object.h"
+#include "vm.h"
 
 void disassemble_chunk(Chunk* chunk, const char* name)
 {
@@ -13,6 +14,16 @@ void disassemble_chunk(Chunk* chunk, const char* name)
     }
 }
 
+// size of the first operand of the instruction being disassembled, 2 behind OP_WIDE
+static int operand_size = 1;
+
+static int first_operand(Chunk* chunk, int offset)
+{
+    if (operand_size == 2)
+        return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset + 1];
+}
+
 static int simple_instruction(const char* name, int offset)
 {
     printf("%s\n", name);
@@ -21,19 +32,44 @@ static int simple_instruction(const char* name, int offset)
 
 static int constant_instruction(const char* name, Chunk* chunk, int offset)
 {
-    uint8_t constant_index = chunk->code[offset + 1];
+    int constant_index = first_operand(chunk, offset);
     printf("%-16s %4d '", name, constant_index);
     print_value(chunk->constants.values[constant_index]);
     printf("'\n");
     // OP_CONSTANT is 2 bytes (opcode, operand)
-    return offset + 2;
+    return offset + 1 + operand_size;
+}
+
+static int constant_long_instruction(const char* name, Chunk* chunk, int offset)
+{
+    int constant_index
+        = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant_index);
+    print_value(chunk->constants.values[constant_index]);
+    printf("'\n");
+    return offset + 4;
 }
 
 static int byte_instruction(const char* name, Chunk* chunk, int offset)
 {
-    uint8_t slot = chunk->code[offset + 1];
+    int slot = first_operand(chunk, offset);
     printf("%-16s %4d\n", name, slot);
-    return offset + 2;
+    return offset + 1 + operand_size;
+}
+
+static int two_byte_instruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t first = chunk->code[offset + 1];
+    uint8_t second = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, first, second);
+    return offset + 3;
+}
+
+static int global_instruction(const char* name, Chunk* chunk, int offset)
+{
+    int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    printf("%-16s %4d '%s'\n", name, slot, global_name(slot)->chars);
+    return offset + 3;
 }
 
 static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset)
@@ -44,14 +80,36 @@ static int jump_instruction(const char* name, int sign, Chunk* chunk, int offset
     return offset + 3;
 }
 
+static int jump_long_instruction(const char* name, int sign, Chunk* chunk, int offset)
+{
+    int jump
+        = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+static int cache_index(Chunk* chunk, int offset)
+{
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int cached_instruction(const char* name, Chunk* chunk, int offset)
+{
+    int constant = first_operand(chunk, offset);
+    printf("%-16s %4d '", name, constant);
+    print_value(chunk->constants.values[constant]);
+    printf("' ic %d\n", cache_index(chunk, offset + 1 + operand_size));
+    return offset + 3 + operand_size;
+}
+
 static int invoke_instruction(const char* name, Chunk* chunk, int offset)
 {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t arg_count = chunk->code[offset + 2];
+    int constant = first_operand(chunk, offset);
+    uint8_t arg_count = chunk->code[offset + 1 + operand_size];
     printf("%-16s (%d args) %4d '", name, arg_count, constant);
     print_value(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;
+    printf("' ic %d\n", cache_index(chunk, offset + 2 + operand_size));
+    return offset + 4 + operand_size;
 }
 
 int disassemble_instruction(Chunk* chunk, int offset)
@@ -98,11 +156,11 @@ int disassemble_instruction(Chunk* chunk, int offset)
     case OP_POP:
         return simple_instruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        return global_instruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        return global_instruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
         return byte_instruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -115,22 +173,28 @@ int disassemble_instruction(Chunk* chunk, int offset)
         return jump_instruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
         return byte_instruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+        return byte_instruction("OP_TAIL_CALL", chunk, offset);
     case OP_GET_UPVALUE:
         return byte_instruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
         return byte_instruction("OP_SET_UPVALUE", chunk, offset);
     case OP_CLOSURE: {
-        offset++;
-        uint8_t constant = chunk->code[offset++];
+        int constant = first_operand(chunk, offset);
+        offset += 1 + operand_size;
         printf("%-16s %4d ", "OP_CLOSURE", constant);
         print_value(chunk->constants.values[constant]);
         printf("\n");
 
         ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
         for (int j = 0; j < function->upvalue_count; j++) {
+            int pair_offset = offset;
             int is_local = chunk->code[offset++];
             int index = chunk->code[offset++];
-            printf("%04d      |                     %s %d\n", offset - 2,
+            if (is_local == 2) {
+                index = (index << 8) | chunk->code[offset++];
+            }
+            printf("%04d      |                     %s %d\n", pair_offset,
                 is_local ? "local" : "upvalue", index);
         }
         return offset;
@@ -140,9 +204,9 @@ int disassemble_instruction(Chunk* chunk, int offset)
     case OP_CLASS:
         return constant_instruction("OP_CLASS", chunk, offset);
     case OP_GET_PROPERTY:
-        return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+        return cached_instruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-        return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+        return cached_instruction("OP_SET_PROPERTY", chunk, offset);
     case OP_METHOD:
         return constant_instruction("OP_METHOD", chunk, offset);
     case OP_INVOKE:
@@ -153,8 +217,248 @@ int disassemble_instruction(Chunk* chunk, int offset)
         return constant_instruction("OP_GET_SUPER", chunk, offset);
     case OP_SUPER_INVOKE:
         return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+    case OP_ADD_LOCALS:
+        return two_byte_instruction("OP_ADD_LOCALS", chunk, offset);
+    case OP_ADD_CONSTANT:
+        return constant_instruction("OP_ADD_CONSTANT", chunk, offset);
+    case OP_NOT_EQUAL:
+        return simple_instruction("OP_NOT_EQUAL", offset);
+    case OP_GREATER_EQUAL:
+        return simple_instruction("OP_GREATER_EQUAL", offset);
+    case OP_LESS_EQUAL:
+        return simple_instruction("OP_LESS_EQUAL", offset);
+    case OP_POP_JUMP_IF_FALSE:
+        return jump_instruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_ADD_NUM:
+        return simple_instruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simple_instruction("OP_ADD_STR", offset);
+    case OP_ADD_LOCALS_NUM:
+        return two_byte_instruction("OP_ADD_LOCALS_NUM", chunk, offset);
+    case OP_ADD_CONSTANT_NUM:
+        return constant_instruction("OP_ADD_CONSTANT_NUM", chunk, offset);
+    case OP_GREATER_NUM:
+        return simple_instruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+        return simple_instruction("OP_LESS_NUM", offset);
+    case OP_CONSTANT_LONG:
+        return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_JUMP_LONG:
+        return jump_long_instruction("OP_JUMP_LONG", 1, chunk, offset);
+    case OP_LOOP_LONG:
+        return jump_long_instruction("OP_LOOP_LONG", -1, chunk, offset);
+    case OP_WIDE:
+        printf("OP_WIDE\n");
+        operand_size = 2;
+        offset = disassemble_instruction(chunk, offset + 1);
+        operand_size = 1;
+        return offset;
     default:
         printf("Unknown opcode: %d\n", instruction);
         return offset + 1;
     }
-}
\ No newline at end of file
+}
+void disassemble_register_chunk(Chunk* chunk, const char* name)
+{
+    printf("== %s ==\n", name);
+
+    for (int offset = 0; offset < chunk->count;) {
+        offset = disassemble_register_instruction(chunk, offset);
+    }
+}
+
+// prints the operands, the one at position constant is a constant index of constant_size bytes
+// whose value follows. Returns the number of operand bytes.
+static int print_register_operands(const char* name, Chunk* chunk, int offset, int operand_count,
+    int constant, int constant_size)
+{
+    printf("%-20s", name);
+    int position = offset + 1;
+    int index = 0;
+    for (int i = 1; i <= operand_count; i++) {
+        int operand = chunk->code[position++];
+        if (i == constant && constant_size == 2)
+            operand = (operand << 8) | chunk->code[position++];
+        if (i == constant)
+            index = operand;
+        printf(" %4d", operand);
+    }
+    if (constant > 0) {
+        printf(" '");
+        print_value(chunk->constants.values[index]);
+        printf("'");
+    }
+    return position - offset - 1;
+}
+
+// prints the operand bytes, and the value of the constant operand at position constant if any
+static int register_instruction(
+    const char* name, Chunk* chunk, int offset, int operand_count, int constant)
+{
+    int size = print_register_operands(name, chunk, offset, operand_count, constant, 1);
+    printf("\n");
+    return offset + 1 + size;
+}
+
+// like register_instruction, the constant operand being a two byte name index
+static int register_name_instruction(
+    const char* name, Chunk* chunk, int offset, int operand_count, int constant)
+{
+    int size = print_register_operands(name, chunk, offset, operand_count, constant, 2);
+    printf("\n");
+    return offset + 1 + size;
+}
+
+// like register_name_instruction, for instructions ending with an inline cache index
+static int register_cached_instruction(
+    const char* name, Chunk* chunk, int offset, int operand_count, int constant)
+{
+    int size = print_register_operands(name, chunk, offset, operand_count, constant, 2);
+    printf(" ic %d\n", cache_index(chunk, offset + 1 + size));
+    return offset + 3 + size;
+}
+
+// A G
+static int register_global_instruction(const char* name, Chunk* chunk, int offset)
+{
+    int slot = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-20s %4d %4d '%s'\n", name, chunk->code[offset + 1], slot, global_name(slot)->chars);
+    return offset + 4;
+}
+
+static int register_jump_instruction(
+    const char* name, int sign, bool conditional, Chunk* chunk, int offset)
+{
+    int operand = offset + (conditional ? 2 : 1);
+    uint16_t jump = (uint16_t)(chunk->code[operand] << 8);
+    jump |= chunk->code[operand + 1];
+    printf("%-20s", name);
+    if (conditional) {
+        printf(" %4d", chunk->code[offset + 1]);
+    }
+    printf(" %4d -> %d\n", offset, operand + 2 + sign * jump);
+    return operand + 2;
+}
+
+int disassemble_register_instruction(Chunk* chunk, int offset)
+{
+    printf("%04d ", offset);
+    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+        printf("   | ");
+    } else {
+        printf("%4d ", chunk->lines[offset]);
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    switch (instruction) {
+    case ROP_MOVE:
+        return register_instruction("ROP_MOVE", chunk, offset, 2, 0);
+    case ROP_LOAD_CONSTANT:
+        return register_instruction("ROP_LOAD_CONSTANT", chunk, offset, 2, 2);
+    case ROP_NIL:
+        return register_instruction("ROP_NIL", chunk, offset, 1, 0);
+    case ROP_TRUE:
+        return register_instruction("ROP_TRUE", chunk, offset, 1, 0);
+    case ROP_FALSE:
+        return register_instruction("ROP_FALSE", chunk, offset, 1, 0);
+    case ROP_ADD:
+        return register_instruction("ROP_ADD", chunk, offset, 3, 0);
+    case ROP_ADD_CONSTANT:
+        return register_instruction("ROP_ADD_CONSTANT", chunk, offset, 3, 3);
+    case ROP_SUBTRACT:
+        return register_instruction("ROP_SUBTRACT", chunk, offset, 3, 0);
+    case ROP_SUBTRACT_CONSTANT:
+        return register_instruction("ROP_SUBTRACT_CONSTANT", chunk, offset, 3, 3);
+    case ROP_MULTIPLY:
+        return register_instruction("ROP_MULTIPLY", chunk, offset, 3, 0);
+    case ROP_DIVIDE:
+        return register_instruction("ROP_DIVIDE", chunk, offset, 3, 0);
+    case ROP_NEGATE:
+        return register_instruction("ROP_NEGATE", chunk, offset, 2, 0);
+    case ROP_NOT:
+        return register_instruction("ROP_NOT", chunk, offset, 2, 0);
+    case ROP_EQUAL:
+        return register_instruction("ROP_EQUAL", chunk, offset, 3, 0);
+    case ROP_NOT_EQUAL:
+        return register_instruction("ROP_NOT_EQUAL", chunk, offset, 3, 0);
+    case ROP_GREATER:
+        return register_instruction("ROP_GREATER", chunk, offset, 3, 0);
+    case ROP_GREATER_EQUAL:
+        return register_instruction("ROP_GREATER_EQUAL", chunk, offset, 3, 0);
+    case ROP_LESS:
+        return register_instruction("ROP_LESS", chunk, offset, 3, 0);
+    case ROP_LESS_EQUAL:
+        return register_instruction("ROP_LESS_EQUAL", chunk, offset, 3, 0);
+    case ROP_JUMP:
+        return register_jump_instruction("ROP_JUMP", 1, false, chunk, offset);
+    case ROP_JUMP_IF_FALSE:
+        return register_jump_instruction("ROP_JUMP_IF_FALSE", 1, true, chunk, offset);
+    case ROP_JUMP_IF_TRUE:
+        return register_jump_instruction("ROP_JUMP_IF_TRUE", 1, true, chunk, offset);
+    case ROP_LOOP:
+        return register_jump_instruction("ROP_LOOP", -1, false, chunk, offset);
+    case ROP_DEFINE_GLOBAL:
+        return register_global_instruction("ROP_DEFINE_GLOBAL", chunk, offset);
+    case ROP_GET_GLOBAL:
+        return register_global_instruction("ROP_GET_GLOBAL", chunk, offset);
+    case ROP_SET_GLOBAL:
+        return register_global_instruction("ROP_SET_GLOBAL", chunk, offset);
+    case ROP_GET_UPVALUE:
+        return register_instruction("ROP_GET_UPVALUE", chunk, offset, 2, 0);
+    case ROP_SET_UPVALUE:
+        return register_instruction("ROP_SET_UPVALUE", chunk, offset, 2, 0);
+    case ROP_CLOSE_UPVALUES:
+        return register_instruction("ROP_CLOSE_UPVALUES", chunk, offset, 1, 0);
+    case ROP_CLOSURE: {
+        int constant = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        offset = register_name_instruction("ROP_CLOSURE", chunk, offset, 2, 2);
+        for (int j = 0; j < function->upvalue_count; j++) {
+            int is_local = chunk->code[offset++];
+            int index = chunk->code[offset++];
+            printf("%04d      |                     %s %d\n", offset - 2,
+                is_local ? "local" : "upvalue", index);
+        }
+        return offset;
+    }
+    case ROP_CALL:
+        return register_instruction("ROP_CALL", chunk, offset, 2, 0);
+    case ROP_TAIL_CALL:
+        return register_instruction("ROP_TAIL_CALL", chunk, offset, 2, 0);
+    case ROP_RETURN:
+        return register_instruction("ROP_RETURN", chunk, offset, 1, 0);
+    case ROP_PRINT:
+        return register_instruction("ROP_PRINT", chunk, offset, 1, 0);
+    case ROP_CLASS:
+        return register_name_instruction("ROP_CLASS", chunk, offset, 2, 2);
+    case ROP_INHERIT:
+        return register_instruction("ROP_INHERIT", chunk, offset, 2, 0);
+    case ROP_METHOD:
+        return register_name_instruction("ROP_METHOD", chunk, offset, 3, 3);
+    case ROP_GET_PROPERTY:
+        return register_cached_instruction("ROP_GET_PROPERTY", chunk, offset, 3, 3);
+    case ROP_SET_PROPERTY:
+        return register_cached_instruction("ROP_SET_PROPERTY", chunk, offset, 3, 2);
+    case ROP_INVOKE:
+        return register_cached_instruction("ROP_INVOKE", chunk, offset, 3, 2);
+    case ROP_GET_SUPER:
+        return register_name_instruction("ROP_GET_SUPER", chunk, offset, 4, 4);
+    case ROP_SUPER_INVOKE:
+        return register_cached_instruction("ROP_SUPER_INVOKE", chunk, offset, 4, 2);
+    case ROP_LOAD_CONSTANT_LONG: {
+        int constant = (chunk->code[offset + 2] << 16) | (chunk->code[offset + 3] << 8)
+            | chunk->code[offset + 4];
+        printf("%-20s %4d %4d '", "ROP_LOAD_CONSTANT_LONG", chunk->code[offset + 1], constant);
+        print_value(chunk->constants.values[constant]);
+        printf("'\n");
+        return offset + 5;
+    }
+    case ROP_JUMP_LONG:
+        return jump_long_instruction("ROP_JUMP_LONG", 1, chunk, offset);
+    case ROP_LOOP_LONG:
+        return jump_long_instruction("ROP_LOOP_LONG", -1, chunk, offset);
+    default:
+        printf("Unknown opcode: %d\n", instruction);
+        return offset + 1;
+    }
+}
@@ -5,5 +5,7 @@
 
 void disassemble_chunk(Chunk* chunk, const char* name);
 int disassemble_instruction(Chunk* chunk, int offset);
+void disassemble_register_chunk(Chunk* chunk, const char* name);
+int disassemble_register_instruction(Chunk* chunk, int offset);
 
 #endif
\ No newline at end of file
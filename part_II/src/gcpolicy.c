@@ -0,0 +1,135 @@
+#include "gcpolicy.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "vm.h"
+
+typedef struct {
+    const char* name;
+    const char* variable;
+    size_t* size; // the field it sets, one of the two
+    double* number;
+    double min; // the range of a number, min excluded when exclusive
+    double max;
+    bool exclusive;
+} GcOption;
+
+static const GcOption options[] = {
+    { "initial-heap", "CLOX_GC_INITIAL_HEAP", &vm.gc_policy.initial_heap, NULL, 0, 0, false },
+    { "growth-factor", "CLOX_GC_GROWTH_FACTOR", NULL, &vm.gc_policy.growth_factor, 1, 100, true },
+    { "min-heap", "CLOX_GC_MIN_HEAP", &vm.gc_policy.min_heap, NULL, 0, 0, false },
+    { "max-heap", "CLOX_GC_MAX_HEAP", &vm.gc_policy.max_heap, NULL, 0, 0, false },
+    { "cpu-share", "CLOX_GC_CPU_SHARE", NULL, &vm.gc_policy.cpu_share, 0, 0.99, false },
+};
+#define OPTION_COUNT (sizeof(options) / sizeof(options[0]))
+
+// how much faster than growth_factor the heap grows to meet the cpu-share
+static double boost;
+// the collector's time and the clock when the last full collection was done
+static double last_pause;
+static double last_time;
+
+static bool parse_size(const char* text, size_t* size)
+{
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0)
+        return false;
+    switch (*end) {
+    case 'G':
+    case 'g':
+        value *= 1024;
+        // fallthrough
+    case 'M':
+    case 'm':
+        value *= 1024;
+        // fallthrough
+    case 'K':
+    case 'k':
+        value *= 1024;
+        end++;
+        break;
+    }
+    if (*end != '\0' || value >= (double)SIZE_MAX)
+        return false;
+    *size = (size_t)value;
+    return true;
+}
+
+static bool parse_number(const GcOption* option, const char* text, double* number)
+{
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || *end != '\0' || value > option->max)
+        return false;
+    if (option->exclusive ? value <= option->min : value < option->min)
+        return false;
+    *number = value;
+    return true;
+}
+
+void init_gc_policy()
+{
+    vm.gc_policy.initial_heap = 1024 * 1024;
+    vm.gc_policy.growth_factor = 2;
+    vm.gc_policy.min_heap = 0;
+    vm.gc_policy.max_heap = 0;
+    vm.gc_policy.cpu_share = 0;
+    vm.heap_exhausted = false;
+    boost = 1;
+    last_pause = 0;
+    last_time = gc_time();
+
+    for (size_t i = 0; i < OPTION_COUNT; i++) {
+        const char* value = getenv(options[i].variable);
+        if (value != NULL && !set_gc_option(options[i].name, value))
+            fprintf(stderr, "Ignoring %s=%s.\n", options[i].variable, value);
+    }
+}
+
+bool set_gc_option(const char* name, const char* value)
+{
+    for (size_t i = 0; i < OPTION_COUNT; i++) {
+        const GcOption* option = &options[i];
+        if (strcmp(name, option->name) != 0)
+            continue;
+        if (option->size != NULL ? !parse_size(value, option->size)
+                                 : !parse_number(option, value, option->number))
+            return false;
+        // the first threshold was set from it already
+        if (option->size == &vm.gc_policy.initial_heap && vm.gc_stats.cycles == 0)
+            vm.next_gc = vm.gc_policy.initial_heap;
+        return true;
+    }
+    return false;
+}
+
+size_t gc_threshold(size_t live)
+{
+    GcPolicy* policy = &vm.gc_policy;
+    double target = (double)live * policy->growth_factor * boost;
+    size_t threshold = target < (double)SIZE_MAX ? (size_t)target : SIZE_MAX;
+    if (threshold < policy->min_heap)
+        threshold = policy->min_heap;
+    if (policy->max_heap != 0 && threshold > policy->max_heap)
+        threshold = policy->max_heap;
+    return threshold;
+}
+
+void adapt_gc_policy()
+{
+    double now = gc_time();
+    double pause = vm.gc_stats.total_pause;
+    if (vm.gc_policy.cpu_share > 0 && now > last_time) {
+        double share = (pause - last_pause) / (now - last_time);
+        if (share > vm.gc_policy.cpu_share && boost < GC_MAX_BOOST) {
+            boost *= 2;
+        } else if (share < vm.gc_policy.cpu_share / 2 && boost > 1) {
+            boost /= 2;
+        }
+    }
+    last_pause = pause;
+    last_time = now;
+}
@@ -0,0 +1,28 @@
+#ifndef clox_gcpolicy_h
+#define clox_gcpolicy_h
+
+#include "common.h"
+
+// Each field of GcPolicy (in vm.h) is an option, read from the environment variable
+// CLOX_GC_<NAME> and overridden by the flag --gc-<name>:
+//   initial-heap, min-heap, max-heap   sizes in bytes, with an optional K, M or G suffix
+//   growth-factor                      above 1
+//   cpu-share                          a fraction of the run time, 0 up to below 1
+// With a cpu-share the heap grows faster than growth-factor while the collector takes more than
+// that share, up to GC_MAX_BOOST times, and back once it takes less than half of it.
+// Past max-heap, or once the system refuses an allocation, the program stops at the next safepoint
+// with the runtime error "Out of memory.". Only an allocation that the HEAP_RESERVE_SIZE bytes kept
+// aside can't make room for still ends the process.
+
+#define GC_MAX_BOOST 8
+
+// the defaults, then the environment, a bad value there is reported and ignored
+void init_gc_policy();
+// sets the option of that name (without the --gc-), false when there is none or value is bad
+bool set_gc_option(const char* name, const char* value);
+// where the next full collection starts for a heap of live bytes
+size_t gc_threshold(size_t live);
+// called when a full collection is done, to keep the collector to its cpu-share
+void adapt_gc_policy();
+
+#endif
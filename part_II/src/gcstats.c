@@ -0,0 +1,150 @@
+#include "gcstats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+static const char* type_names[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",
+    [OBJ_CLOSURE] = "closure",
+    [OBJ_UPVALUE] = "upvalue",
+    [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance",
+    [OBJ_BOUND_METHOD] = "boundMethod",
+    [OBJ_SHAPE] = "shape",
+    [OBJ_ROPE] = "rope",
+};
+
+// the fields of the gcStats() instance with the live bytes of each type
+static const char* live_fields[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "liveString",
+    [OBJ_FUNCTION] = "liveFunction",
+    [OBJ_NATIVE] = "liveNative",
+    [OBJ_CLOSURE] = "liveClosure",
+    [OBJ_UPVALUE] = "liveUpvalue",
+    [OBJ_CLASS] = "liveClass",
+    [OBJ_INSTANCE] = "liveInstance",
+    [OBJ_BOUND_METHOD] = "liveBoundMethod",
+    [OBJ_SHAPE] = "liveShape",
+    [OBJ_ROPE] = "liveRope",
+};
+
+// the oldest of the full collections still in the history
+static int history_start()
+{
+    int cycles = vm.gc_stats.cycles;
+    return cycles > GC_STATS_HISTORY ? cycles - GC_STATS_HISTORY : 0;
+}
+
+// the stats instance is on top of the stack, adding a field can allocate
+static void add_stat(const char* name, Value value)
+{
+    push(value);
+    push(OBJ_VAL(copy_string(name, (int)strlen(name))));
+    ObjInstance* stats = AS_INSTANCE(vm.stack_top[-3]);
+    ObjShape* shape = shape_transition(stats->shape, AS_STRING(vm.stack_top[-1]));
+    set_instance_shape(stats, shape);
+    stats->fields[shape->field_count - 1] = value;
+    write_barrier((Obj*)stats, value);
+    pop();
+    pop();
+}
+
+// Lox has no arrays, a history is a string of numbers separated by spaces, the oldest first
+static void add_history(const char* name, size_t* history)
+{
+    char buffer[GC_STATS_HISTORY * 21 + 1];
+    int length = 0;
+    for (int i = history_start(); i < vm.gc_stats.cycles; i++) {
+        length += sprintf(buffer + length, length == 0 ? "%zu" : " %zu",
+            history[i % GC_STATS_HISTORY]);
+    }
+    add_stat(name, OBJ_VAL(copy_string(buffer, length)));
+}
+
+Value gc_stats_native(int arg_count, Value* args)
+{
+    push(OBJ_VAL(copy_string("GcStats", 7)));
+    ObjClass* klass = new_class(AS_STRING(vm.stack_top[-1]));
+    push(OBJ_VAL(klass));
+    ObjInstance* instance = new_instance(klass);
+    pop();
+    pop();
+    push(OBJ_VAL(instance));
+
+    GcStats* stats = &vm.gc_stats;
+    add_stat("collections", NUMBER_VAL(stats->collections));
+    add_stat("youngCollections", NUMBER_VAL(stats->young_collections));
+    add_stat("pauses", NUMBER_VAL(stats->pauses));
+    add_stat("totalPauseMs", NUMBER_VAL(stats->total_pause * 1000));
+    add_stat("worstPauseMs", NUMBER_VAL(stats->worst_pause * 1000));
+    add_stat("bytesAllocated", NUMBER_VAL((double)vm.bytes_allocated));
+    add_stat("nextGc", NUMBER_VAL((double)vm.next_gc));
+    add_stat("promoted", NUMBER_VAL((double)stats->promoted));
+    add_stat("totalFreed", NUMBER_VAL((double)stats->total_freed));
+    add_stat("lastFreed",
+        NUMBER_VAL(stats->cycles > 0
+                ? (double)stats->freed_history[(stats->cycles - 1) % GC_STATS_HISTORY]
+                : 0));
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        add_stat(live_fields[type], NUMBER_VAL((double)stats->live_bytes[type]));
+    }
+    add_history("freedHistory", stats->freed_history);
+    add_history("nextGcHistory", stats->next_gc_history);
+    return pop();
+}
+
+// set by --gc-stats until the stats are written
+static const char* stats_path = NULL;
+
+void flush_gc_stats()
+{
+    if (stats_path == NULL)
+        return;
+    FILE* file = strcmp(stats_path, "-") == 0 ? stderr : fopen(stats_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Couldn't write \"%s\".\n", stats_path);
+        stats_path = NULL;
+        return;
+    }
+
+    GcStats* stats = &vm.gc_stats;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"collections\": %d,\n", stats->collections);
+    fprintf(file, "  \"youngCollections\": %d,\n", stats->young_collections);
+    fprintf(file, "  \"pauses\": %d,\n", stats->pauses);
+    fprintf(file, "  \"totalPauseMs\": %.3f,\n", stats->total_pause * 1000);
+    fprintf(file, "  \"worstPauseMs\": %.3f,\n", stats->worst_pause * 1000);
+    fprintf(file, "  \"bytesAllocated\": %zu,\n", vm.bytes_allocated);
+    fprintf(file, "  \"nextGc\": %zu,\n", vm.next_gc);
+    fprintf(file, "  \"promoted\": %zu,\n", stats->promoted);
+    fprintf(file, "  \"totalFreed\": %zu,\n", stats->total_freed);
+    fprintf(file, "  \"liveBytes\": {");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        fprintf(file, "%s\"%s\": %zu", type == 0 ? "" : ", ", type_names[type],
+            stats->live_bytes[type]);
+    }
+    fprintf(file, "},\n");
+    // the last GC_STATS_HISTORY full collections, the oldest first
+    fprintf(file, "  \"cycles\": [");
+    for (int i = history_start(); i < stats->cycles; i++) {
+        fprintf(file, "%s\n    {\"freed\": %zu, \"nextGc\": %zu}", i == history_start() ? "" : ",",
+            stats->freed_history[i % GC_STATS_HISTORY],
+            stats->next_gc_history[i % GC_STATS_HISTORY]);
+    }
+    fprintf(file, stats->cycles > 0 ? "\n  ]\n}\n" : "]\n}\n");
+    if (file != stderr)
+        fclose(file);
+    stats_path = NULL;
+}
+
+void write_gc_stats_at_exit(const char* path)
+{
+    stats_path = path;
+    // errors exit without freeing the VM
+    atexit(flush_gc_stats);
+}
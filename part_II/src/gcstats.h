@@ -0,0 +1,14 @@
+#ifndef clox_gcstats_h
+#define clox_gcstats_h
+
+#include "common.h"
+#include "value.h"
+
+// gcStats() in Lox, returns an instance with the counters of vm.gc_stats as fields
+Value gc_stats_native(int arg_count, Value* args);
+// writes vm.gc_stats as JSON to path when the VM is freed or exits, "-" writes to stderr
+void write_gc_stats_at_exit(const char* path);
+// writes them now if they were asked for and not written yet
+void flush_gc_stats();
+
+#endif
@@ -0,0 +1,63 @@
+#include "hash.h"
+
+// Long inputs go through four lanes that don't depend on each other, so their multiplies overlap
+// instead of waiting on one chain. The rest is folded in a word at a time, the last few bytes one
+// at a time.
+
+static inline uint64_t mix_lane(uint64_t lane, uint64_t word)
+{
+    lane += word * HASH_PRIME2;
+    lane = rotate_left(lane, 31);
+    return lane * HASH_PRIME1;
+}
+
+static inline uint64_t merge_lane(uint64_t hash, uint64_t lane)
+{
+    hash ^= mix_lane(0, lane);
+    return hash * HASH_PRIME1 + HASH_PRIME4;
+}
+
+uint64_t hash_long(const char* bytes, size_t length)
+{
+    const char* end = bytes + length;
+    uint64_t hash;
+    if (length >= 32) {
+        uint64_t lane1 = HASH_PRIME1 + HASH_PRIME2;
+        uint64_t lane2 = HASH_PRIME2;
+        uint64_t lane3 = 0;
+        uint64_t lane4 = -HASH_PRIME1;
+        const char* limit = end - 32;
+        do {
+            lane1 = mix_lane(lane1, read64(bytes));
+            lane2 = mix_lane(lane2, read64(bytes + 8));
+            lane3 = mix_lane(lane3, read64(bytes + 16));
+            lane4 = mix_lane(lane4, read64(bytes + 24));
+            bytes += 32;
+        } while (bytes <= limit);
+
+        hash = rotate_left(lane1, 1) + rotate_left(lane2, 7) + rotate_left(lane3, 12)
+            + rotate_left(lane4, 18);
+        hash = merge_lane(hash, lane1);
+        hash = merge_lane(hash, lane2);
+        hash = merge_lane(hash, lane3);
+        hash = merge_lane(hash, lane4);
+    } else {
+        hash = HASH_PRIME5;
+    }
+    hash += length;
+
+    for (; end - bytes >= 8; bytes += 8) {
+        hash ^= mix_lane(0, read64(bytes));
+        hash = rotate_left(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+    }
+    if (end - bytes >= 4) {
+        hash ^= read32(bytes) * HASH_PRIME1;
+        hash = rotate_left(hash, 23) * HASH_PRIME2 + HASH_PRIME3;
+        bytes += 4;
+    }
+    for (; bytes < end; bytes++) {
+        hash ^= (uint8_t)*bytes * HASH_PRIME5;
+        hash = rotate_left(hash, 11) * HASH_PRIME1;
+    }
+    return avalanche(hash);
+}
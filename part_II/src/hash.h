@@ -0,0 +1,72 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include <string.h>
+#include "common.h"
+
+// The xxHash64 algorithm for anything longer than 16 bytes, in hash.c. Up to 16 bytes, which is
+// most identifiers, are read as two words that overlap in the middle and only go through the final
+// mix, inline. Every bit of a hash depends on every byte, so the low bits that a Table masks it
+// down to are as good as the high ones.
+
+#define HASH_PRIME1 11400714785074694791u
+#define HASH_PRIME2 14029467366897019727u
+#define HASH_PRIME3 1609587929392839161u
+#define HASH_PRIME4 9650029242287828579u
+#define HASH_PRIME5 2870177450012600261u
+
+static inline uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// unaligned and in the byte order of the machine, the hashes never leave the process
+static inline uint64_t read64(const char* bytes)
+{
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static inline uint32_t read32(const char* bytes)
+{
+    uint32_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+// the last multiplies spread the high bits down to the low ones
+static inline uint64_t avalanche(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// more than 16 bytes
+uint64_t hash_long(const char* bytes, size_t length);
+
+// a 64-bit hash of length bytes
+static inline uint64_t hash_bytes(const char* bytes, size_t length)
+{
+    if (length > 16)
+        return hash_long(bytes, length);
+    const char* end = bytes + length;
+    uint64_t hash;
+    if (length > 8) {
+        hash = read64(bytes) * HASH_PRIME1 ^ rotate_left(read64(end - 8) * HASH_PRIME2, 31);
+    } else if (length >= 4) {
+        hash = read32(bytes) | (uint64_t)read32(end - 4) << 32;
+    } else if (length > 0) {
+        // the first, middle and last byte, some of them the same one
+        hash = (uint8_t)bytes[0] | (uint8_t)bytes[length / 2] << 8 | (uint8_t)end[-1] << 16;
+    } else {
+        hash = 0;
+    }
+    return avalanche(hash ^ (HASH_PRIME5 + length));
+}
+
+#endif
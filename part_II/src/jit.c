@@ -0,0 +1,741 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "chunk.h"
+#include "value.h"
+#include "memory.h"
+
+// Template JIT: every instruction is translated on its own into x86-64 code working on the same
+// value stack as run(). Native code keeps
+//   rbx: frame->slots, r12: vm.stack_top, r13: QNAN (to test for numbers), r14: the upvalues,
+// and writes vm.stack_top back when it leaves. Only instructions that can't allocate are
+// implemented, so the GC, calls and errors only ever happen in the interpreter.
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0, XMM1 };
+// condition codes
+enum { CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB };
+
+typedef struct {
+    int native; // position of the rel32 to patch
+    int target; // bytecode offset, or -1 for the epilogue
+} Fixup;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    Fixup* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    int* labels; // native position of each instruction, indexed by bytecode offset
+    int epilogue;
+} Assembler;
+
+static Assembler as;
+
+static void emit(uint8_t byte)
+{
+    if (as.count + 1 > as.capacity) {
+        as.capacity = as.capacity < 256 ? 256 : as.capacity * 2;
+        as.code = realloc(as.code, as.capacity);
+        if (as.code == NULL)
+            exit(1);
+    }
+    as.code[as.count++] = byte;
+}
+
+static void emit32(uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        emit((value >> (i * 8)) & 0xFF);
+    }
+}
+
+static void emit64(uint64_t value)
+{
+    emit32((uint32_t)value);
+    emit32((uint32_t)(value >> 32));
+}
+
+static void add_fixup(int native, int target)
+{
+    if (as.fixup_count + 1 > as.fixup_capacity) {
+        as.fixup_capacity = as.fixup_capacity < 16 ? 16 : as.fixup_capacity * 2;
+        as.fixups = realloc(as.fixups, sizeof(Fixup) * as.fixup_capacity);
+        if (as.fixups == NULL)
+            exit(1);
+    }
+    as.fixups[as.fixup_count].native = native;
+    as.fixups[as.fixup_count].target = target;
+    as.fixup_count++;
+}
+
+static void rex_w(int reg, int base) { emit(0x48 | ((reg >> 3) << 2) | (base >> 3)); }
+
+// ModRM (and SIB) for [base + disp]
+static void memory_operand(int reg, int base, int disp)
+{
+    bool byte_disp = disp >= -128 && disp <= 127;
+    emit((byte_disp ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit(0x24);
+    if (byte_disp) {
+        emit((uint8_t)disp);
+    } else {
+        emit32((uint32_t)disp);
+    }
+}
+
+static void register_operand(int reg, int rm) { emit(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+
+static void mov_imm(int reg, uint64_t value)
+{
+    rex_w(0, reg);
+    emit(0xB8 | (reg & 7));
+    emit64(value);
+}
+
+static void load(int reg, int base, int disp)
+{
+    rex_w(reg, base);
+    emit(0x8B);
+    memory_operand(reg, base, disp);
+}
+
+static void store(int base, int disp, int reg)
+{
+    rex_w(reg, base);
+    emit(0x89);
+    memory_operand(reg, base, disp);
+}
+
+// op r/m64, r64 for the two register forms of mov (0x89), and (0x21), cmp (0x39), add (0x01),
+// xor (0x31)
+static void alu(uint8_t op, int dst, int src)
+{
+    rex_w(src, dst);
+    emit(op);
+    register_operand(src, dst);
+}
+
+// add (0), sub (5) with an 8-bit immediate
+static void alu_imm8(int extension, int reg, int8_t value)
+{
+    rex_w(0, reg);
+    emit(0x83);
+    register_operand(extension, reg);
+    emit((uint8_t)value);
+}
+
+static void movq_to_xmm(int xmm, int reg)
+{
+    emit(0x66);
+    rex_w(xmm, reg);
+    emit(0x0F);
+    emit(0x6E);
+    register_operand(xmm, reg);
+}
+
+static void movq_from_xmm(int reg, int xmm)
+{
+    emit(0x66);
+    rex_w(xmm, reg);
+    emit(0x0F);
+    emit(0x7E);
+    register_operand(xmm, reg);
+}
+
+// addsd (0x58), mulsd (0x59), subsd (0x5C), divsd (0x5E)
+static void sse(uint8_t op, int dst, int src)
+{
+    emit(0xF2);
+    emit(0x0F);
+    emit(op);
+    register_operand(dst, src);
+}
+
+static void ucomisd(int a, int b)
+{
+    emit(0x66);
+    emit(0x0F);
+    emit(0x2E);
+    register_operand(a, b);
+}
+
+// the low byte of rax, rcx or rdx
+static void setcc(int cc, int reg)
+{
+    emit(0x0F);
+    emit(0x90 | cc);
+    register_operand(0, reg);
+}
+
+static int jcc8(int cc)
+{
+    emit(0x70 | cc);
+    emit(0);
+    return as.count - 1;
+}
+
+static int jmp8()
+{
+    emit(0xEB);
+    emit(0);
+    return as.count - 1;
+}
+
+static void patch8(int position) { as.code[position] = (uint8_t)(as.count - position - 1); }
+
+static void jcc_to(int cc, int target)
+{
+    emit(0x0F);
+    emit(0x80 | cc);
+    add_fixup(as.count, target);
+    emit32(0);
+}
+
+static void jmp_to(int target)
+{
+    emit(0xE9);
+    add_fixup(as.count, target);
+    emit32(0);
+}
+
+static void call_function(void* function)
+{
+    mov_imm(RAX, (uint64_t)(uintptr_t)function);
+    emit(0xFF);
+    emit(0xD0);
+}
+
+static void push_value(int reg)
+{
+    store(R12, 0, reg);
+    alu_imm8(0, R12, 8);
+}
+
+static void pop_value(int reg)
+{
+    alu_imm8(5, R12, 8);
+    load(reg, R12, 0);
+}
+
+// jumps to the exit of the instruction at offset unless reg holds a number, clobbers rdx
+static void guard_number(int reg, int offset)
+{
+    alu(0x89, RDX, reg);
+    alu(0x21, RDX, R13);
+    alu(0x39, RDX, R13);
+    jcc_to(CC_E, -2 - offset);
+}
+
+// jumps to the exit of the instruction at offset if reg holds a rope, which only the interpreter
+// can flatten, clobbers rdx and rsi
+static void guard_not_rope(int reg, int offset)
+{
+    mov_imm(RSI, SIGN_BIT | QNAN);
+    alu(0x89, RDX, reg);
+    alu(0x21, RDX, RSI);
+    alu(0x39, RDX, RSI);
+    int not_object = jcc8(CC_NE);
+    alu(0x89, RDX, reg);
+    alu(0x31, RDX, RSI); // xor clears the tag bits, leaving the pointer
+    emit(0x83); // cmp dword [rdx + type], OBJ_ROPE
+    memory_operand(7, RDX, offsetof(Obj, type));
+    emit(OBJ_ROPE);
+    jcc_to(CC_E, -2 - offset);
+    patch8(not_object);
+}
+
+// turns al (0 or 1) into a boolean Value in rax
+static void bool_from_byte()
+{
+    emit(0x0F); // movzx eax, al
+    emit(0xB6);
+    emit(0xC0);
+    mov_imm(RCX, FALSE_VAL);
+    alu(0x01, RAX, RCX);
+}
+
+// turns the flag of condition cc into a boolean Value in rax
+static void bool_from_flag(int cc)
+{
+    setcc(cc, RAX);
+    bool_from_byte();
+}
+
+// jumps to target (a bytecode offset) when reg holds nil or false, clobbers rcx
+static void jump_if_falsey(int reg, int target)
+{
+    mov_imm(RCX, FALSE_VAL);
+    alu(0x39, reg, RCX);
+    jcc_to(CC_E, target);
+    mov_imm(RCX, NIL_VAL);
+    alu(0x39, reg, RCX);
+    jcc_to(CC_E, target);
+}
+
+// the two operands on top of the stack are loaded into xmm0 and xmm1 if both are numbers
+static void number_operands(int offset)
+{
+    load(RAX, R12, -16);
+    load(RCX, R12, -8);
+    guard_number(RAX, offset);
+    guard_number(RCX, offset);
+    movq_to_xmm(XMM0, RAX);
+    movq_to_xmm(XMM1, RCX);
+}
+
+static void replace_operands(int reg)
+{
+    store(R12, -16, reg);
+    alu_imm8(5, R12, 8);
+}
+
+static void arithmetic(uint8_t op, int offset)
+{
+    number_operands(offset);
+    sse(op, XMM0, XMM1);
+    movq_from_xmm(RAX, XMM0);
+    replace_operands(RAX);
+}
+
+// compares the operands as a, b on top of the stack, with the same NaN behavior as the C operators
+// run() uses
+static void comparison(int a, int b, int cc, int offset)
+{
+    number_operands(offset);
+    ucomisd(a, b);
+    bool_from_flag(cc);
+    replace_operands(RAX);
+}
+
+// values_equal() for the values in rax and rcx, the result is left in al
+static void equality()
+{
+    alu(0x89, RDX, RAX);
+    alu(0x21, RDX, R13);
+    alu(0x39, RDX, R13);
+    int a_not_number = jcc8(CC_E);
+    alu(0x89, RDX, RCX);
+    alu(0x21, RDX, R13);
+    alu(0x39, RDX, R13);
+    int b_not_number = jcc8(CC_E);
+    movq_to_xmm(XMM0, RAX);
+    movq_to_xmm(XMM1, RCX);
+    ucomisd(XMM0, XMM1);
+    setcc(CC_E, RAX);
+    setcc(CC_NP, RCX);
+    emit(0x20); // and al, cl
+    emit(0xC8);
+    int done = jmp8();
+    patch8(a_not_number);
+    patch8(b_not_number);
+    // the same bits are equal, different ones only for strings with the same chars
+    alu(0x89, RDI, RAX);
+    alu(0x89, RSI, RCX);
+    alu(0x39, RAX, RCX);
+    setcc(CC_E, RAX);
+    int same = jcc8(CC_E);
+    call_function(values_equal);
+    patch8(same);
+    patch8(done);
+}
+
+static void print_native(Value value)
+{
+    print_value(value);
+    printf("\n");
+}
+
+static void upvalue_write_barrier(ObjUpvalue* upvalue, Value value)
+{
+    write_barrier((Obj*)upvalue, value);
+}
+
+// rax = the constant, objects are loaded from the chunk as young collections move them
+static void load_constant(Value* constants, int index)
+{
+    if (IS_OBJ(constants[index])) {
+        mov_imm(RAX, (uint64_t)(uintptr_t)&constants[index]);
+        load(RAX, RAX, 0);
+    } else {
+        mov_imm(RAX, constants[index]);
+    }
+}
+
+// The instruction at offset goes back to the interpreter, with rax holding its ip
+static void exit_to_interpreter(Chunk* chunk, int offset)
+{
+    mov_imm(RAX, (uint64_t)(uintptr_t)(chunk->code + offset));
+    jmp_to(-1);
+}
+
+// Emits the native code of the instruction at offset, returns false when it is left to the
+// interpreter.
+static bool compile_instruction(Chunk* chunk, int offset)
+{
+    uint8_t* code = chunk->code + offset;
+    int next = offset + instruction_length(chunk, offset);
+    Value* constants = chunk->constants.values;
+
+    switch (code[0]) {
+    case OP_CONSTANT:
+        load_constant(constants, code[1]);
+        push_value(RAX);
+        return true;
+    case OP_CONSTANT_LONG:
+        load_constant(constants, (code[1] << 16) | (code[2] << 8) | code[3]);
+        push_value(RAX);
+        return true;
+    case OP_NIL:
+        mov_imm(RAX, NIL_VAL);
+        push_value(RAX);
+        return true;
+    case OP_TRUE:
+        mov_imm(RAX, TRUE_VAL);
+        push_value(RAX);
+        return true;
+    case OP_FALSE:
+        mov_imm(RAX, FALSE_VAL);
+        push_value(RAX);
+        return true;
+    case OP_POP:
+        alu_imm8(5, R12, 8);
+        return true;
+    case OP_GET_LOCAL:
+        load(RAX, RBX, code[1] * (int)sizeof(Value));
+        push_value(RAX);
+        return true;
+    case OP_SET_LOCAL:
+        load(RAX, R12, -8);
+        store(RBX, code[1] * (int)sizeof(Value), RAX);
+        return true;
+    case OP_WIDE: {
+        int slot = (code[2] << 8) | code[3];
+        if (code[1] == OP_GET_LOCAL) {
+            load(RAX, RBX, slot * (int)sizeof(Value));
+            push_value(RAX);
+            return true;
+        } else if (code[1] == OP_SET_LOCAL) {
+            load(RAX, R12, -8);
+            store(RBX, slot * (int)sizeof(Value), RAX);
+            return true;
+        }
+        return false;
+    }
+    case OP_GET_GLOBAL: {
+        int slot = (code[1] << 8) | code[2];
+        // the array moves when the REPL compiles new globals, so it is looked up every time
+        mov_imm(RAX, (uint64_t)(uintptr_t)&vm.global_values.values);
+        load(RAX, RAX, 0);
+        load(RAX, RAX, slot * (int)sizeof(Value));
+        mov_imm(RCX, UNDEFINED_VAL);
+        alu(0x39, RAX, RCX);
+        jcc_to(CC_E, -2 - offset);
+        push_value(RAX);
+        return true;
+    }
+    case OP_SET_GLOBAL: {
+        int slot = (code[1] << 8) | code[2];
+        mov_imm(RDX, (uint64_t)(uintptr_t)&vm.global_values.values);
+        load(RDX, RDX, 0);
+        load(RAX, RDX, slot * (int)sizeof(Value));
+        mov_imm(RCX, UNDEFINED_VAL);
+        alu(0x39, RAX, RCX);
+        jcc_to(CC_E, -2 - offset);
+        load(RAX, R12, -8);
+        store(RDX, slot * (int)sizeof(Value), RAX);
+        return true;
+    }
+    case OP_DEFINE_GLOBAL: {
+        int slot = (code[1] << 8) | code[2];
+        pop_value(RAX);
+        mov_imm(RDX, (uint64_t)(uintptr_t)&vm.global_values.values);
+        load(RDX, RDX, 0);
+        store(RDX, slot * (int)sizeof(Value), RAX);
+        return true;
+    }
+    case OP_GET_UPVALUE:
+        load(RAX, R14, code[1] * (int)sizeof(ObjUpvalue*));
+        load(RAX, RAX, offsetof(ObjUpvalue, location));
+        load(RAX, RAX, 0);
+        push_value(RAX);
+        return true;
+    case OP_SET_UPVALUE:
+        load(RDI, R14, code[1] * (int)sizeof(ObjUpvalue*));
+        load(RAX, RDI, offsetof(ObjUpvalue, location));
+        load(RSI, R12, -8);
+        store(RAX, 0, RSI);
+        call_function(upvalue_write_barrier);
+        return true;
+    // the quickened forms guard their operands just the same, a failed guard gets the interpreter
+    // to rewrite them back
+    case OP_ADD:
+    case OP_ADD_NUM:
+        arithmetic(0x58, offset);
+        return true;
+    case OP_SUBTRACT:
+        arithmetic(0x5C, offset);
+        return true;
+    case OP_MULTIPLY:
+        arithmetic(0x59, offset);
+        return true;
+    case OP_DIVIDE:
+        arithmetic(0x5E, offset);
+        return true;
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCALS_NUM:
+        load(RAX, RBX, code[1] * (int)sizeof(Value));
+        load(RCX, RBX, code[2] * (int)sizeof(Value));
+        guard_number(RAX, offset);
+        guard_number(RCX, offset);
+        movq_to_xmm(XMM0, RAX);
+        movq_to_xmm(XMM1, RCX);
+        sse(0x58, XMM0, XMM1);
+        movq_from_xmm(RAX, XMM0);
+        push_value(RAX);
+        return true;
+    case OP_ADD_CONSTANT:
+    case OP_ADD_CONSTANT_NUM: {
+        Value constant = constants[code[1]];
+        // a string constant always needs the interpreter's concatenation
+        if (!IS_NUMBER(constant))
+            return false;
+        load(RAX, R12, -8);
+        guard_number(RAX, offset);
+        movq_to_xmm(XMM0, RAX);
+        mov_imm(RCX, constant);
+        movq_to_xmm(XMM1, RCX);
+        sse(0x58, XMM0, XMM1);
+        movq_from_xmm(RAX, XMM0);
+        store(R12, -8, RAX);
+        return true;
+    }
+    case OP_NEGATE:
+        load(RAX, R12, -8);
+        guard_number(RAX, offset);
+        emit(0x48); // btc rax, 63
+        emit(0x0F);
+        emit(0xBA);
+        emit(0xF8);
+        emit(63);
+        store(R12, -8, RAX);
+        return true;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+        comparison(XMM0, XMM1, CC_A, offset);
+        return true;
+    case OP_LESS:
+    case OP_LESS_NUM:
+        comparison(XMM1, XMM0, CC_A, offset);
+        return true;
+    case OP_GREATER_EQUAL:
+        comparison(XMM1, XMM0, CC_BE, offset);
+        return true;
+    case OP_LESS_EQUAL:
+        comparison(XMM0, XMM1, CC_BE, offset);
+        return true;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        load(RAX, R12, -16);
+        load(RCX, R12, -8);
+        guard_not_rope(RAX, offset);
+        guard_not_rope(RCX, offset);
+        equality();
+        if (code[0] == OP_NOT_EQUAL) {
+            emit(0x34); // xor al, 1
+            emit(0x01);
+        }
+        bool_from_byte();
+        replace_operands(RAX);
+        return true;
+    case OP_NOT: {
+        load(RAX, R12, -8);
+        mov_imm(RCX, TRUE_VAL);
+        mov_imm(RDX, NIL_VAL);
+        alu(0x39, RAX, RDX);
+        int falsey_nil = jcc8(CC_E);
+        mov_imm(RDX, FALSE_VAL);
+        alu(0x39, RAX, RDX);
+        int falsey_false = jcc8(CC_E);
+        mov_imm(RCX, FALSE_VAL);
+        patch8(falsey_nil);
+        patch8(falsey_false);
+        store(R12, -8, RCX);
+        return true;
+    }
+    case OP_PRINT:
+        pop_value(RDI);
+        call_function(print_native);
+        return true;
+    case OP_JUMP_IF_FALSE:
+        load(RAX, R12, -8);
+        jump_if_falsey(RAX, next + ((code[1] << 8) | code[2]));
+        return true;
+    case OP_POP_JUMP_IF_FALSE:
+        pop_value(RAX);
+        jump_if_falsey(RAX, next + ((code[1] << 8) | code[2]));
+        return true;
+    case OP_JUMP:
+        jmp_to(next + ((code[1] << 8) | code[2]));
+        return true;
+    case OP_JUMP_LONG:
+        jmp_to(next + ((code[1] << 16) | (code[2] << 8) | code[3]));
+        return true;
+    case OP_LOOP:
+        jmp_to(next - ((code[1] << 8) | code[2]));
+        return true;
+    case OP_LOOP_LONG:
+        jmp_to(next - ((code[1] << 16) | (code[2] << 8) | code[3]));
+        return true;
+    default:
+        return false;
+    }
+}
+
+// native entry point: uint8_t* (*)(Value* slots, void* target, ObjUpvalue** upvalues)
+static void emit_prologue()
+{
+    emit(0x53); // push rbx
+    emit(0x41); // push r12
+    emit(0x54);
+    emit(0x41); // push r13
+    emit(0x55);
+    emit(0x41); // push r14
+    emit(0x56);
+    alu_imm8(5, RSP, 8); // keeps the stack aligned for calls
+    alu(0x89, RBX, RDI);
+    alu(0x89, R14, RDX);
+    mov_imm(RAX, (uint64_t)(uintptr_t)&vm.stack_top);
+    load(R12, RAX, 0);
+    mov_imm(R13, QNAN);
+    emit(0xFF); // jmp rsi
+    emit(0xE6);
+}
+
+static void emit_epilogue()
+{
+    as.epilogue = as.count;
+    mov_imm(RCX, (uint64_t)(uintptr_t)&vm.stack_top);
+    store(RCX, 0, R12);
+    alu_imm8(0, RSP, 8);
+    emit(0x41); // pop r14
+    emit(0x5E);
+    emit(0x41); // pop r13
+    emit(0x5D);
+    emit(0x41); // pop r12
+    emit(0x5C);
+    emit(0x5B); // pop rbx
+    emit(0xC3); // ret
+}
+
+void jit_compile(ObjFunction* function)
+{
+    if (!vm.jit_enabled)
+        return;
+
+    Chunk* chunk = &function->chunk;
+    as.count = 0;
+    as.fixup_count = 0;
+    as.labels = malloc(sizeof(int) * (chunk->count + 1));
+    int* entries = malloc(sizeof(int) * chunk->count);
+    // guards jump to the exit of their instruction, emitted after the instruction's code
+    int* exits = malloc(sizeof(int) * chunk->count);
+    if (as.labels == NULL || entries == NULL || exits == NULL)
+        exit(1);
+    for (int i = 0; i < chunk->count; i++) {
+        as.labels[i] = -1;
+        entries[i] = -1;
+        exits[i] = -1;
+    }
+
+    emit_prologue();
+    emit_epilogue();
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        as.labels[offset] = as.count;
+        int first_fixup = as.fixup_count;
+        if (compile_instruction(chunk, offset)) {
+            entries[offset] = as.labels[offset];
+            for (int i = first_fixup; i < as.fixup_count; i++) {
+                if (as.fixups[i].target == -2 - offset) {
+                    // the fallthrough needs to skip the exit
+                    int skip = jmp8();
+                    exits[offset] = as.count;
+                    exit_to_interpreter(chunk, offset);
+                    patch8(skip);
+                    break;
+                }
+            }
+        } else {
+            exit_to_interpreter(chunk, offset);
+        }
+    }
+    // falling off the end can't happen, every chunk ends with OP_RETURN
+
+    for (int i = 0; i < as.fixup_count; i++) {
+        int target = as.fixups[i].target;
+        int native;
+        if (target == -1) {
+            native = as.epilogue;
+        } else if (target < -1) {
+            native = exits[-2 - target];
+        } else {
+            native = as.labels[target];
+        }
+        int32_t relative = native - (as.fixups[i].native + 4);
+        memcpy(as.code + as.fixups[i].native, &relative, sizeof(relative));
+    }
+    free(as.labels);
+    free(exits);
+
+    // written while writable, then made executable, never both
+    uint8_t* code = mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(entries);
+        return;
+    }
+    memcpy(code, as.code, as.count);
+    if (mprotect(code, as.count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, as.count);
+        free(entries);
+        return;
+    }
+
+    JitCode* jit = malloc(sizeof(JitCode));
+    if (jit == NULL)
+        exit(1);
+    jit->code = code;
+    jit->size = as.count;
+    jit->entries = entries;
+    function->jit = jit;
+}
+
+uint8_t* jit_run(CallFrame* frame, uint8_t* ip)
+{
+    ObjFunction* function = frame->closure->function;
+    JitCode* jit = function->jit;
+    int entry = jit->entries[ip - function->chunk.code];
+    if (entry < 0)
+        return ip;
+    typedef uint8_t* (*NativeCode)(Value * slots, void* target, ObjUpvalue** upvalues);
+    NativeCode native = (NativeCode)(void*)jit->code;
+    return native(frame->slots, jit->code + entry, frame->closure->upvalues);
+}
+
+void jit_free(JitCode* jit)
+{
+    if (jit == NULL)
+        return;
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+#endif
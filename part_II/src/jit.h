@@ -0,0 +1,29 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// resumptions (calls, returns into the function, back edges) after which a function is compiled
+#define JIT_THRESHOLD 1000
+
+// Native code of one function of the stack backend. It can be entered at any instruction it
+// implements and leaves at the first one it doesn't, or when a guard on the operand types fails,
+// handing that instruction back to the interpreter with the stack exactly as run() expects it.
+struct JitCode {
+    uint8_t* code;
+    size_t size;
+    int* entries; // native offset of each bytecode offset the code can be entered at, -1 elsewhere
+};
+
+typedef struct JitCode JitCode;
+
+// leaves function->jit NULL when the function can't be compiled
+void jit_compile(ObjFunction* function);
+// runs the native code of the frame's function from ip on, returns the ip of the instruction the
+// interpreter continues with
+uint8_t* jit_run(CallFrame* frame, uint8_t* ip);
+void jit_free(JitCode* jit);
+
+#endif
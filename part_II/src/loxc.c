@@ -0,0 +1,435 @@
+#include "loxc.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "chunk.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+// A .loxc file holds the functions of one script, laid out so that a mapped file can be used in
+// place: code and line numbers are borrowed by the chunks, only constants and strings are rebuilt.
+// All offsets are from the start of the file, numbers are in the byte order of the machine.
+//
+//   FileHeader                                     payload_hash covers everything after it
+//   FunctionRecord, code, lines, ConstantRecords   for each function, nested ones first
+//   globals: string index of each global slot
+//   StringRecords, then the characters
+
+// a file that nests functions any deeper is taken as damaged, loading one recurses in C
+#define LOXC_MAX_NESTING 1024
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t payload_hash; // the operands in the code are trusted, damage has to be caught here
+    uint32_t backend;
+    uint32_t script; // FunctionRecord of the top level code
+    uint32_t globals;
+    uint32_t global_count;
+    uint32_t strings;
+    uint32_t string_count;
+} FileHeader;
+
+typedef struct {
+    int32_t arity;
+    int32_t upvalue_count;
+    int32_t register_count;
+    int32_t max_slots;
+    int32_t name; // string index, -1 for the script
+    uint32_t code;
+    uint32_t lines;
+    uint32_t count;
+    uint32_t constants;
+    uint32_t constant_count;
+    uint32_t cache_count; // the caches themselves start out empty
+} FunctionRecord;
+
+typedef enum { CONSTANT_NUMBER, CONSTANT_STRING, CONSTANT_FUNCTION } ConstantType;
+
+typedef struct {
+    uint32_t type;
+    uint32_t index; // string index or FunctionRecord offset
+    double number;
+} ConstantRecord;
+
+typedef struct {
+    uint32_t chars;
+    uint32_t length;
+} StringRecord;
+
+// FNV-1a
+static uint64_t hash_fnv(const uint8_t* bytes, size_t length)
+{
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+uint64_t hash_source(const char* source)
+{
+    return hash_fnv((const uint8_t*)source, strlen(source));
+}
+
+char* loxc_path(const char* path)
+{
+    size_t length = strlen(path);
+    char* cache_path = malloc(length + 2);
+    if (cache_path == NULL)
+        exit(74);
+    memcpy(cache_path, path, length);
+    cache_path[length] = 'c';
+    cache_path[length + 1] = '\0';
+    return cache_path;
+}
+
+// writing
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    Table string_indexes; // ObjString -> index in strings
+    ValueArray strings;
+    bool failed;
+} Writer;
+
+static void reserve(Writer* writer, size_t size)
+{
+    if (writer->count + size <= writer->capacity)
+        return;
+    while (writer->capacity < writer->count + size) {
+        writer->capacity = writer->capacity < 1024 ? 1024 : writer->capacity * 2;
+    }
+    writer->bytes = realloc(writer->bytes, writer->capacity);
+    if (writer->bytes == NULL)
+        exit(74);
+}
+
+static uint32_t append(Writer* writer, const void* data, size_t size)
+{
+    reserve(writer, size);
+    uint32_t offset = (uint32_t)writer->count;
+    memcpy(writer->bytes + writer->count, data, size);
+    writer->count += size;
+    return offset;
+}
+
+static void align(Writer* writer, size_t alignment)
+{
+    static const uint8_t padding[8] = { 0 };
+    size_t remainder = writer->count % alignment;
+    if (remainder != 0)
+        append(writer, padding, alignment - remainder);
+}
+
+static uint32_t string_index(Writer* writer, ObjString* string)
+{
+    Value index;
+    if (table_get(&writer->string_indexes, string, &index))
+        return (uint32_t)AS_NUMBER(index);
+    uint32_t new_index = (uint32_t)writer->strings.count;
+    write_value_array(&writer->strings, OBJ_VAL(string));
+    table_set(&writer->string_indexes, string, NUMBER_VAL(new_index));
+    return new_index;
+}
+
+// returns the offset of the function's record
+static uint32_t write_function(Writer* writer, ObjFunction* function)
+{
+    Chunk* chunk = &function->chunk;
+    ConstantRecord* constants = malloc(sizeof(ConstantRecord) * (chunk->constants.count + 1));
+    if (constants == NULL)
+        exit(74);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        constants[i].index = 0;
+        constants[i].number = 0;
+        if (IS_NUMBER(value)) {
+            constants[i].type = CONSTANT_NUMBER;
+            constants[i].number = AS_NUMBER(value);
+        } else if (IS_STRING(value)) {
+            constants[i].type = CONSTANT_STRING;
+            constants[i].index = string_index(writer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            constants[i].type = CONSTANT_FUNCTION;
+            constants[i].index = write_function(writer, AS_FUNCTION(value));
+        } else {
+            // the compiler makes no other constants
+            writer->failed = true;
+        }
+    }
+
+    FunctionRecord record;
+    record.arity = function->arity;
+    record.upvalue_count = function->upvalue_count;
+    record.register_count = function->register_count;
+    record.max_slots = function->max_slots;
+    record.name = function->name == NULL ? -1 : (int32_t)string_index(writer, function->name);
+    record.count = chunk->count;
+    record.constant_count = chunk->constants.count;
+    record.cache_count = chunk->cache_count;
+
+    align(writer, 8);
+    uint32_t offset = append(writer, &record, sizeof(record));
+    record.code = append(writer, chunk->code, chunk->count);
+    align(writer, sizeof(int));
+    record.lines = append(writer, chunk->lines, sizeof(int) * chunk->count);
+    align(writer, 8);
+    record.constants
+        = append(writer, constants, sizeof(ConstantRecord) * chunk->constants.count);
+    memcpy(writer->bytes + offset, &record, sizeof(record));
+    free(constants);
+    return offset;
+}
+
+bool write_loxc(const char* path, ObjFunction* function, uint64_t source_hash)
+{
+    Writer writer;
+    writer.bytes = NULL;
+    writer.count = 0;
+    writer.capacity = 0;
+    init_table(&writer.string_indexes);
+    init_value_array(&writer.strings);
+    writer.failed = false;
+    // the function is not reachable from anywhere else while the writer allocates
+    push(OBJ_VAL(function));
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LOXC", 4);
+    header.version = LOXC_VERSION;
+    header.source_hash = source_hash;
+    header.backend = vm.backend;
+    append(&writer, &header, sizeof(header));
+
+    header.script = write_function(&writer, function);
+
+    // slots are handed out by the compiler, the loader has to get the same ones back
+    int global_count = vm.global_values.count;
+    uint32_t* globals = malloc(sizeof(uint32_t) * (global_count + 1));
+    if (globals == NULL)
+        exit(74);
+    for (int i = 0; i < vm.global_names.capacity; i++) {
+        Entry* entry = &vm.global_names.entries[i];
+        if (entry->key != NULL)
+            globals[(int)AS_NUMBER(entry->value)] = string_index(&writer, entry->key);
+    }
+    align(&writer, 8);
+    header.globals = append(&writer, globals, sizeof(uint32_t) * global_count);
+    header.global_count = global_count;
+    free(globals);
+
+    align(&writer, 8);
+    header.string_count = writer.strings.count;
+    header.strings = (uint32_t)writer.count;
+    reserve(&writer, sizeof(StringRecord) * writer.strings.count);
+    writer.count += sizeof(StringRecord) * writer.strings.count;
+    for (int i = 0; i < writer.strings.count; i++) {
+        ObjString* string = AS_STRING(writer.strings.values[i]);
+        StringRecord record;
+        record.length = string->length;
+        record.chars = append(&writer, string->chars, string->length);
+        memcpy(writer.bytes + header.strings + i * sizeof(StringRecord), &record, sizeof(record));
+    }
+    header.payload_hash = hash_fnv(writer.bytes + sizeof(header), writer.count - sizeof(header));
+    memcpy(writer.bytes, &header, sizeof(header));
+
+    pop();
+    free_table(&writer.string_indexes);
+    free_value_array(&writer.strings);
+
+    bool written = false;
+    if (!writer.failed && writer.count <= UINT32_MAX) {
+        // a reader never sees a half written file, it is renamed into place once complete
+        char* temporary = malloc(strlen(path) + 5);
+        if (temporary == NULL)
+            exit(74);
+        sprintf(temporary, "%s.tmp", path);
+        FILE* file = fopen(temporary, "wb");
+        if (file != NULL) {
+            written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+            written = fclose(file) == 0 && written;
+            written = written && rename(temporary, path) == 0;
+            if (!written)
+                remove(temporary);
+        }
+        free(temporary);
+    }
+    free(writer.bytes);
+    return written;
+}
+
+// loading
+
+typedef struct Mapping {
+    uint8_t* base;
+    size_t size;
+    struct Mapping* next;
+} Mapping;
+
+static Mapping* mappings = NULL;
+
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    FileHeader* header;
+} Loader;
+
+static bool in_file(Loader* loader, uint32_t offset, size_t size)
+{
+    return offset <= loader->size && size <= loader->size - offset;
+}
+
+static ObjString* load_string(Loader* loader, uint32_t index)
+{
+    if (index >= loader->header->string_count)
+        return NULL;
+    StringRecord* record = (StringRecord*)(loader->base + loader->header->strings) + index;
+    if (!in_file(loader, record->chars, record->length))
+        return NULL;
+    return copy_string((const char*)loader->base + record->chars, (int)record->length);
+}
+
+// Nested functions are written first, so each one has to start before the function that refers to
+// it, at most LOXC_MAX_NESTING deep. A damaged file can't lead it around in circles.
+static ObjFunction* load_function(Loader* loader, uint32_t offset, uint32_t before, int depth)
+{
+    if (offset % 8 != 0 || offset >= before || depth > LOXC_MAX_NESTING
+        || !in_file(loader, offset, sizeof(FunctionRecord)))
+        return NULL;
+    FunctionRecord* record = (FunctionRecord*)(loader->base + offset);
+    if (!in_file(loader, record->code, record->count)
+        || !in_file(loader, record->lines, sizeof(int) * (size_t)record->count)
+        || !in_file(loader, record->constants, sizeof(ConstantRecord) * (size_t)record->constant_count)
+        || record->lines % sizeof(int) != 0 || record->constants % 8 != 0)
+        return NULL;
+
+    ObjFunction* function = new_function();
+    push(OBJ_VAL(function));
+    function->arity = record->arity;
+    function->upvalue_count = record->upvalue_count;
+    function->register_count = record->register_count;
+    function->max_slots = record->max_slots;
+
+    Chunk* chunk = &function->chunk;
+    chunk->code = loader->base + record->code;
+    chunk->lines = (int*)(loader->base + record->lines);
+    chunk->count = record->count;
+    chunk->capacity = record->count;
+    chunk->borrowed = true;
+    for (uint32_t i = 0; i < record->cache_count; i++) {
+        add_inline_cache(chunk);
+    }
+
+    bool failed = false;
+    if (record->name >= 0) {
+        function->name = load_string(loader, (uint32_t)record->name);
+        failed = function->name == NULL;
+    }
+    ConstantRecord* constants = (ConstantRecord*)(loader->base + record->constants);
+    for (uint32_t i = 0; i < record->constant_count && !failed; i++) {
+        Value value = NIL_VAL;
+        switch (constants[i].type) {
+        case CONSTANT_NUMBER:
+            value = NUMBER_VAL(constants[i].number);
+            break;
+        case CONSTANT_STRING: {
+            ObjString* string = load_string(loader, constants[i].index);
+            failed = string == NULL;
+            value = OBJ_VAL(string);
+            break;
+        }
+        case CONSTANT_FUNCTION: {
+            ObjFunction* nested = load_function(loader, constants[i].index, offset, depth + 1);
+            failed = nested == NULL;
+            value = OBJ_VAL(nested);
+            break;
+        }
+        default:
+            failed = true;
+            break;
+        }
+        if (!failed)
+            add_constant(chunk, value);
+    }
+
+    pop();
+    return failed ? NULL : function;
+}
+
+ObjFunction* load_loxc(const char* path, uint64_t source_hash)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(FileHeader)) {
+        close(fd);
+        return NULL;
+    }
+    // private and writable, so that the chunks can still be patched in place like compiled ones
+    size_t size = (size_t)status.st_size;
+    uint8_t* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    Loader loader;
+    loader.base = base;
+    loader.size = size;
+    loader.header = (FileHeader*)base;
+    FileHeader* header = loader.header;
+    bool valid = memcmp(header->magic, "LOXC", 4) == 0 && header->version == LOXC_VERSION
+        && header->source_hash == source_hash && header->backend == (uint32_t)vm.backend
+        && header->payload_hash == hash_fnv(base + sizeof(FileHeader), size - sizeof(FileHeader))
+        && header->strings % 8 == 0 && header->globals % 8 == 0
+        && in_file(&loader, header->strings, sizeof(StringRecord) * (size_t)header->string_count)
+        && in_file(&loader, header->globals, sizeof(uint32_t) * (size_t)header->global_count);
+
+    uint32_t* globals = (uint32_t*)(base + header->globals);
+    for (uint32_t slot = 0; valid && slot < header->global_count; slot++) {
+        ObjString* name = load_string(&loader, globals[slot]);
+        if (name == NULL) {
+            valid = false;
+            break;
+        }
+        push(OBJ_VAL(name));
+        valid = global_slot(name) == (int)slot;
+        pop();
+    }
+
+    ObjFunction* function = valid ? load_function(&loader, header->script, UINT32_MAX, 0) : NULL;
+    if (function == NULL) {
+        // anything rebuilt so far is garbage, and its chunks don't free the borrowed code
+        munmap(base, size);
+        return NULL;
+    }
+
+    Mapping* mapping = malloc(sizeof(Mapping));
+    if (mapping == NULL)
+        exit(74);
+    mapping->base = base;
+    mapping->size = size;
+    mapping->next = mappings;
+    mappings = mapping;
+    return function;
+}
+
+void unload_loxc()
+{
+    while (mappings != NULL) {
+        Mapping* next = mappings->next;
+        munmap(mappings->base, mappings->size);
+        free(mappings);
+        mappings = next;
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef clox_loxc_h
+#define clox_loxc_h
+
+#include "common.h"
+#include "object.h"
+
+// bumped whenever the layout or the instruction set changes, older files are then ignored
+#define LOXC_VERSION 4
+
+uint64_t hash_source(const char* source);
+// the cache of script.lox is script.loxc, the caller frees the returned path
+char* loxc_path(const char* path);
+// writes the compiled script with everything it refers to, false when the file can't be written
+bool write_loxc(const char* path, ObjFunction* function, uint64_t source_hash);
+// maps a file written by write_loxc() and rebuilds its script, NULL when the file is missing,
+// stale (another source hash, version or backend) or damaged
+ObjFunction* load_loxc(const char* path, uint64_t source_hash);
+// unmaps every loaded file, the functions rebuilt from them must be gone by then
+void unload_loxc();
+
+#endif
@@ -5,6 +5,10 @@
 #include "chunk.h"
 #include "debug.h"
 #include "vm.h"
+#include "memory.h"
+#include "loxc.h"
+#include "gcstats.h"
+#include "gcpolicy.h"
 
 static void repl()
 {
@@ -48,10 +52,26 @@ static char* read_file(const char* path)
     return buffer;
 }
 
-static void run_file(const char* path)
+static void run_file(const char* path, bool compile_only)
 {
     char* source = read_file(path);
-    InterpretResult result = interpret(source);
+    uint64_t source_hash = hash_source(source);
+    char* cache_path = loxc_path(path);
+    InterpretResult result;
+
+    if (compile_only) {
+        ObjFunction* function = compile(source, vm.backend);
+        result = function == NULL ? INTERPRET_COMPILE_ERROR : INTERPRET_OK;
+        if (function != NULL && !write_loxc(cache_path, function, source_hash)) {
+            fprintf(stderr, "Couldn't write \"%s\".\n", cache_path);
+            exit(74);
+        }
+    } else {
+        // a cache compiled from this exact source skips the compiler
+        ObjFunction* function = load_loxc(cache_path, source_hash);
+        result = function != NULL ? interpret_function(function) : interpret(source);
+    }
+    free(cache_path);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR)
@@ -64,13 +84,49 @@ int main(int argc, const char* argv[])
 {
     init_VM();
 
-    if (argc == 1) {
+    const char* path = NULL;
+    bool compile_only = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--register") == 0) {
+            vm.backend = BACKEND_REGISTER;
+        } else if (strcmp(argv[i], "--compile-only") == 0) {
+            compile_only = true;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            vm.jit_enabled = false;
+        } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            set_max_depth(atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--gc-incremental") == 0) {
+            vm.incremental_gc = true;
+        } else if (strcmp(argv[i], "--gc-slice") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            vm.incremental_gc = true;
+            vm.gc_slice_budget = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc
+            && atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= GC_MAX_THREADS) {
+            vm.gc_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--gc-stats") == 0 && i + 1 < argc) {
+            write_gc_stats_at_exit(argv[++i]);
+        } else if (strcmp(argv[i], "--gc-pauses") == 0) {
+            // errors exit without returning here
+            atexit(print_gc_pauses);
+        } else if (strncmp(argv[i], "--gc-", 5) == 0 && i + 1 < argc
+            && set_gc_option(argv[i] + 5, argv[i + 1])) {
+            i++;
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr,
+                "Usage: clox [--register] [--no-jit] [--max-depth frames] [--gc-incremental] "
+                "[--gc-slice objects] [--gc-threads count] [--gc-pauses] [--gc-stats file] "
+                "[--gc-initial-heap size] [--gc-growth-factor factor] [--gc-min-heap size] "
+                "[--gc-max-heap size] [--gc-cpu-share fraction] [--compile-only] [path]\n");
+            exit(64);
+        }
+    }
+
+    if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        run_file(path, compile_only);
     }
     free_VM();
     return 0;
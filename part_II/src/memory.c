@@ -3,103 +3,409 @@
 #include "compiler.h"
 #include "vm.h"
 #include "object.h"
+#include "jit.h"
+#include "allocator.h"
+#include "gcpolicy.h"
 #include <stdlib.h>
-#ifdef DEBUG_LOG_GC
+#include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#ifdef PARALLEL_MARK
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+#ifdef DEBUG_LOG_GC
 #include "debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// an incremental cycle that falls this far behind the allocations does the rest in one go
+#define GC_INCREMENTAL_LIMIT(next_gc) ((next_gc) + (next_gc) / 2)
+
+double gc_time()
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (double)now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void record_pause(double start)
+{
+    double pause = gc_time() - start;
+    vm.gc_stats.pauses++;
+    vm.gc_stats.total_pause += pause;
+    if (pause > vm.gc_stats.worst_pause)
+        vm.gc_stats.worst_pause = pause;
+}
+
+static void emergency_collect();
+
+// Kept aside for when the system refuses an allocation. Giving it back lets that allocation and the
+// ones up to the next safepoint through, the safepoint then reports it like the heap limit.
+static void* heap_reserve = NULL;
+static bool heap_refused = false;
+
+// false when it was spent already
+static bool spend_heap_reserve()
+{
+    if (heap_reserve == NULL)
+        return false;
+    free(heap_reserve);
+    heap_reserve = NULL;
+    heap_refused = true;
+    vm.heap_exhausted = true;
+    vm.gc_requested = true;
+    return true;
+}
+
+// Past the hard limit everything is collected at once. What is still too much gets reported at the
+// next safepoint, the allocations up to there go through.
+static void check_heap_limit()
+{
+    size_t limit = vm.gc_policy.max_heap;
+    if (limit == 0 || vm.bytes_allocated <= limit || vm.heap_exhausted)
+        return;
+    emergency_collect();
+    if (vm.bytes_allocated > limit) {
+        vm.heap_exhausted = true;
+        vm.gc_requested = true;
+    }
+}
 
 void* reallocate(void* pointer, size_t old_size, size_t new_size)
 {
-    vm.bytes_allocated += new_size - old_size;
+    vm.bytes_allocated += block_size(new_size) - block_size(old_size);
     if (new_size > old_size) {
 #ifdef DEBUG_STRESS_GC
-        collect_garbage();
-#endif
-        if (vm.bytes_allocated > vm.next_gc) {
+        if (!vm.incremental_gc)
             collect_garbage();
+#endif
+        if (vm.gc_policy.max_heap != 0 && vm.bytes_allocated > vm.gc_policy.max_heap) {
+            check_heap_limit();
+        } else if (vm.bytes_allocated > vm.next_gc) {
+            if (!vm.incremental_gc) {
+                double start = gc_time();
+                collect_garbage();
+                record_pause(start);
+            } else if (vm.gc_phase == GC_IDLE
+                || vm.bytes_allocated > GC_INCREMENTAL_LIMIT(vm.next_gc)) {
+                vm.gc_requested = true;
+            }
         }
     }
 
-    if (new_size == 0) {
-        free(pointer);
-        return NULL;
+    void* result = reallocate_block(pointer, old_size, new_size);
+    if (result == NULL && new_size > 0) {
+        // what the collector gives back may be enough for the system to find room
+        emergency_collect();
+        result = reallocate_block(pointer, old_size, new_size);
+        if (result == NULL && spend_heap_reserve())
+            result = reallocate_block(pointer, old_size, new_size);
+        if (result == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
     }
-
-    void* result = realloc(pointer, new_size);
-    if (result == NULL)
-        exit(1);
     return result;
 }
 
-static void free_object(Obj* object)
+// objects are 8 byte aligned, in the nursery as well
+#define ALIGN_OBJECT(size) (((size) + 7) & ~(size_t)7)
+
+static size_t object_size(Obj* object)
 {
-#ifdef DEBUG_LOG_GC
-    printf("%p free type %d\n", (void*)object, object->type);
-#endif
+    size_t size = 0;
     switch (object->type) {
-    case OBJ_STRING: {
-        ObjString* string = (ObjString*)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+    case OBJ_STRING:
+        size = STRING_SIZE(((ObjString*)object)->length);
+        break;
+    case OBJ_FUNCTION:
+        size = sizeof(ObjFunction);
+        break;
+    case OBJ_NATIVE:
+        size = sizeof(ObjNative);
+        break;
+    case OBJ_CLOSURE:
+        size = sizeof(ObjClosure) + ((ObjClosure*)object)->upvalue_count * sizeof(ObjUpvalue*);
+        break;
+    case OBJ_UPVALUE:
+        size = sizeof(ObjUpvalue);
+        break;
+    case OBJ_CLASS:
+        size = sizeof(ObjClass);
+        break;
+    case OBJ_INSTANCE:
+        size = sizeof(ObjInstance) + ((ObjInstance*)object)->inline_capacity * sizeof(Value);
         break;
+    case OBJ_SHAPE:
+        size = sizeof(ObjShape);
+        break;
+    case OBJ_BOUND_METHOD:
+        size = sizeof(ObjBoundMethod);
+        break;
+    case OBJ_ROPE:
+        size = sizeof(ObjRope);
+        break;
+    }
+    return ALIGN_OBJECT(size);
+}
+
+void init_heap()
+{
+    init_allocator();
+    vm.nursery = malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL)
+        exit(1);
+    vm.nursery_top = vm.nursery;
+    vm.nursery_end = vm.nursery + NURSERY_SIZE;
+#ifdef SLAB_ALLOC
+    vm.nursery_marks = calloc(NURSERY_SIZE / 8 / 64, sizeof(uint64_t));
+    if (vm.nursery_marks == NULL)
+        exit(1);
+#endif
+    heap_reserve = malloc(HEAP_RESERVE_SIZE);
+    if (heap_reserve == NULL)
+        exit(1);
+    vm.young_objects = NULL;
+    vm.gc_requested = false;
+    vm.remembered = NULL;
+    vm.remembered_count = 0;
+    vm.remembered_capacity = 0;
+    vm.incremental_gc = false;
+    vm.gc_slice_budget = GC_SLICE_BUDGET;
+    vm.gc_phase = GC_IDLE;
+    vm.gc_debt = 0;
+    vm.sweep_list = NULL;
+    vm.swept = NULL;
+    vm.swept_last = NULL;
+    vm.gc_threads = 1;
+    init_gc_policy();
+    vm.next_gc = vm.gc_policy.initial_heap;
+#ifdef PARALLEL_MARK
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    vm.gc_threads = cores < 1 ? 1 : cores > GC_MAX_THREADS ? GC_MAX_THREADS : (int)cores;
+#endif
+    memset(&vm.gc_stats, 0, sizeof(vm.gc_stats));
+}
+
+static bool in_nursery(Obj* object)
+{
+    return (uint8_t*)object >= vm.nursery && (uint8_t*)object < vm.nursery_end;
+}
+
+Obj* allocate_young(size_t size)
+{
+#ifdef DEBUG_STRESS_GC
+    if (!vm.incremental_gc)
+        collect_garbage();
+    vm.gc_requested = true;
+#endif
+    size = ALIGN_OBJECT(size);
+    if (vm.gc_phase != GC_IDLE) {
+        vm.gc_debt += size;
+        if (vm.gc_debt >= GC_SLICE_BYTES)
+            vm.gc_requested = true;
+    }
+    if (size <= (size_t)(vm.nursery_end - vm.nursery_top)) {
+        Obj* object = (Obj*)vm.nursery_top;
+        vm.nursery_top += size;
+        object->next = NULL;
+        return object;
     }
+
+    vm.gc_requested = true;
+    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    object->next = vm.young_objects;
+    vm.young_objects = object;
+    return object;
+}
+
+// frees what the object owns, not the object itself
+static void release_object(Obj* object)
+{
+    switch (object->type) {
     case OBJ_FUNCTION: {
         ObjFunction* function = (ObjFunction*)object;
         free_chunk(&function->chunk);
-        FREE(ObjFunction, object);
+#ifdef JIT
+        jit_free(function->jit);
+#endif
         break;
     }
-    case OBJ_NATIVE: {
-        FREE(ObjNative, object);
+    case OBJ_CLASS: {
+        ObjClass* klass = (ObjClass*)object;
+        free_table(&klass->methods);
         break;
     }
-    case OBJ_CLOSURE: {
-        ObjClosure* closure = (ObjClosure*)object;
-        FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalue_count);
-        FREE(ObjClosure, object);
+    case OBJ_INSTANCE: {
+        ObjInstance* instance = (ObjInstance*)object;
+        if (instance->fields != instance->inline_fields)
+            FREE_ARRAY(Value, instance->fields, instance->field_capacity);
         break;
     }
-    case OBJ_UPVALUE: {
-        FREE(ObjUpvalue, object);
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)object;
+        free_table(&shape->slots);
+        free_table(&shape->transitions);
         break;
     }
-    case OBJ_CLASS: {
-        ObjClass* klass = (ObjClass*)object;
-        free_table(&klass->methods);
-        FREE(ObjClass, object);
+    case OBJ_STRING:
+    case OBJ_CLOSURE:
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
+    case OBJ_BOUND_METHOD:
+    case OBJ_ROPE:
+        break;
+    }
+}
+
+// what the arrays the object owns take, release_object() frees them
+static size_t owned_size(Obj* object)
+{
+    size_t size = 0;
+    switch (object->type) {
+    case OBJ_FUNCTION: {
+        Chunk* chunk = &((ObjFunction*)object)->chunk;
+        if (!chunk->borrowed)
+            size = block_size(chunk->capacity) + block_size(sizeof(int) * chunk->capacity);
+        size += block_size(sizeof(Value) * chunk->constants.capacity);
+        size += block_size(sizeof(InlineCache) * chunk->cache_capacity);
         break;
     }
+    case OBJ_CLASS:
+        size = block_size(sizeof(Entry) * ((ObjClass*)object)->methods.capacity);
+        break;
     case OBJ_INSTANCE: {
         ObjInstance* instance = (ObjInstance*)object;
-        free_table(&instance->fields);
-        FREE(ObjInstance, object);
+        if (instance->fields != instance->inline_fields)
+            size = block_size(sizeof(Value) * instance->field_capacity);
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)object;
+        size = block_size(sizeof(Entry) * shape->slots.capacity)
+            + block_size(sizeof(Entry) * shape->transitions.capacity);
         break;
     }
+    case OBJ_STRING:
+    case OBJ_CLOSURE:
+    case OBJ_NATIVE:
+    case OBJ_UPVALUE:
     case OBJ_BOUND_METHOD:
-        FREE(ObjBoundMethod, object);
+    case OBJ_ROPE:
         break;
     }
+    return size;
 }
 
-void mark_object(Obj* object)
+static void free_object(Obj* object)
 {
-    if (object == NULL)
-        return;
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+    release_object(object);
+    reallocate(object, object_size(object), 0);
+}
 
-    if (object->is_marked)
-        return;
+#ifdef PARALLEL_MARK
+typedef struct Marker Marker;
+// the marker of the thread, NULL outside trace_in_parallel()
+static __thread Marker* current_marker = NULL;
+static void push_shared_gray(Obj* object, Entry* entries, int count);
+#endif
 
-#ifdef DEBUG_LOG_GC
-    printf("%p mark ", (void*)object);
-    print_value(OBJ_VAL(object));
-    printf("\n");
+#ifdef SLAB_ALLOC
+// An old object's bit is in the header of its segment, a nursery object's in vm.nursery_marks. A
+// large object has no segment, NULL tells to use the mark in its own header.
+static inline uint64_t* mark_word(Obj* object, uint64_t* bit)
+{
+    if (in_nursery(object)) {
+        size_t index = (size_t)((uint8_t*)object - vm.nursery) / 8;
+        *bit = (uint64_t)1 << (index % 64);
+        return &vm.nursery_marks[index / 64];
+    }
+    if (object->is_large)
+        return NULL;
+    return block_mark_word(object, bit);
+}
+#endif
+
+static inline bool object_marked(Obj* object)
+{
+#ifdef SLAB_ALLOC
+    uint64_t bit;
+    uint64_t* word = mark_word(object, &bit);
+    if (word != NULL) {
+#ifdef PARALLEL_MARK
+        // atomic because markers on other threads may be setting other bits of the word
+        return (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0;
+#else
+        return (*word & bit) != 0;
 #endif
+    }
+#endif
+#ifdef PARALLEL_MARK
+    return __atomic_load_n(&object->is_marked, __ATOMIC_RELAXED);
+#else
+    return object->is_marked;
+#endif
+}
 
+bool is_marked(Obj* object) { return object_marked(object); }
+
+// returns whether the object was marked already, another marker may have got there first
+static inline bool set_mark(Obj* object)
+{
+#ifdef SLAB_ALLOC
+    uint64_t bit;
+    uint64_t* word = mark_word(object, &bit);
+    if (word != NULL) {
+#ifdef PARALLEL_MARK
+        if (current_marker != NULL)
+            return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) != 0;
+#endif
+        bool marked = (*word & bit) != 0;
+        *word |= bit;
+        return marked;
+    }
+#endif
+#ifdef PARALLEL_MARK
+    if (current_marker != NULL)
+        return __atomic_exchange_n(&object->is_marked, true, __ATOMIC_RELAXED);
+#endif
+    bool marked = object->is_marked;
     object->is_marked = true;
+    return marked;
+}
+
+static inline void clear_mark(Obj* object)
+{
+#ifdef SLAB_ALLOC
+    uint64_t bit;
+    uint64_t* word = mark_word(object, &bit);
+    if (word != NULL) {
+        *word &= ~bit;
+        return;
+    }
+#endif
+    object->is_marked = false;
+}
+
+static void clear_nursery_marks()
+{
+#ifdef SLAB_ALLOC
+    size_t used = (size_t)(vm.nursery_top - vm.nursery);
+    memset(vm.nursery_marks, 0, (used + 8 * 64 - 1) / (8 * 64) * sizeof(uint64_t));
+#else
+    for (uint8_t* top = vm.nursery; top < vm.nursery_top; top += object_size((Obj*)top)) {
+        ((Obj*)top)->is_marked = false;
+    }
+#endif
+}
 
+static void push_gray(Obj* object)
+{
     if (vm.gray_capacity < vm.gray_count + 1) {
         vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
         // system realloc because memory for gray stack is not managed by GC
@@ -111,12 +417,57 @@ void mark_object(Obj* object)
     vm.gray_stack[vm.gray_count++] = object;
 }
 
+void mark_object(Obj* object)
+{
+    if (object == NULL)
+        return;
+
+    if (object_marked(object))
+        return;
+    // young objects are marked (and scanned) once they are promoted, see collect_young()
+    if (object->is_young && vm.gc_phase == GC_MARK)
+        return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    if (set_mark(object))
+        return;
+#ifdef PARALLEL_MARK
+    if (current_marker != NULL) {
+        push_shared_gray(object, NULL, 0);
+        return;
+    }
+#endif
+    push_gray(object);
+}
+
 void mark_value(Value value)
 {
     if (IS_OBJ(value))
         mark_object(AS_OBJ(value));
 }
 
+void mark_entries(Entry* entries, int count)
+{
+#ifdef PARALLEL_MARK
+    if (current_marker != NULL && count > GC_MARK_CHUNK) {
+        for (int start = 0; start < count; start += GC_MARK_CHUNK) {
+            int end = start + GC_MARK_CHUNK < count ? start + GC_MARK_CHUNK : count;
+            push_shared_gray(NULL, entries + start, end - start);
+        }
+        return;
+    }
+#endif
+    for (int i = 0; i < count; i++) {
+        mark_object((Obj*)entries[i].key);
+        mark_value(entries[i].value);
+    }
+}
+
 static void mark_array(ValueArray* array)
 {
     for (int i = 0; i < array->count; i++) {
@@ -138,7 +489,8 @@ static void mark_roots()
         mark_object((Obj*)upvalue);
     }
 
-    mark_table(&vm.globals);
+    mark_table(&vm.global_names);
+    mark_array(&vm.global_values);
     mark_compiler_roots();
     mark_object((Obj*)vm.init_string);
 }
@@ -157,16 +509,33 @@ static void blacken_object(Obj* object)
         mark_value(bound->receiver);
         break;
     }
+    case OBJ_ROPE: {
+        ObjRope* rope = (ObjRope*)object;
+        mark_object(rope->left);
+        mark_object(rope->right);
+        mark_object((Obj*)rope->flat);
+        break;
+    }
     case OBJ_INSTANCE: {
         ObjInstance* instance = (ObjInstance*)object;
         mark_object((Obj*)instance->klass);
-        mark_table(&instance->fields);
+        mark_object((Obj*)instance->shape);
+        for (int i = 0; i < instance->shape->field_count; i++) {
+            mark_value(instance->fields[i]);
+        }
         break;
     }
     case OBJ_CLASS: {
         ObjClass* klass = (ObjClass*)object;
         mark_object((Obj*)klass->name);
         mark_table(&klass->methods);
+        mark_object((Obj*)klass->root_shape);
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)object;
+        mark_table(&shape->slots);
+        mark_table(&shape->transitions);
         break;
     }
     case OBJ_CLOSURE: {
@@ -181,6 +550,12 @@ static void blacken_object(Obj* object)
         ObjFunction* function = (ObjFunction*)object;
         mark_object((Obj*)function->name);
         mark_array(&function->chunk.constants);
+        // a cached shape or class must stay alive, or a new one allocated at its address would hit
+        for (int i = 0; i < function->chunk.cache_count; i++) {
+            mark_object(function->chunk.caches[i].receiver);
+            mark_object(function->chunk.caches[i].transition);
+            mark_value(function->chunk.caches[i].method);
+        }
         break;
     }
     case OBJ_UPVALUE:
@@ -192,21 +567,268 @@ static void blacken_object(Obj* object)
     }
 }
 
+#ifdef PARALLEL_MARK
+
+// Parallel marking: the gray objects of a full collection are drained by vm.gc_threads markers,
+// the VM's thread and a pool of helper threads. Each marker works off a private stack and moves
+// half of it to a shared one, which the others steal from, when it has plenty or someone is out
+// of work. Marks are set with an atomic exchange so that an object is scanned once. The mutator
+// is stopped meanwhile, so everything else the markers read is immutable.
+
+typedef struct {
+    Obj* object; // NULL for a chunk of a table
+    Entry* entries;
+    int count;
+} GrayItem;
+
+struct Marker {
+    GrayItem* items; // private
+    int count;
+    int capacity;
+    pthread_mutex_t lock; // guards shared, shared_count is also read without it to find work
+    GrayItem* shared;
+    int shared_count;
+    int shared_capacity;
+    pthread_t thread;
+};
+
+// a marker with this much private work shares half of it even if nobody is idle
+#define GC_SHARE_THRESHOLD 64
+
+static Marker markers[GC_MAX_THREADS];
+static int marker_count = 0; // markers[0] is the VM's thread
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_generation = 0; // bumped to start the helpers on a collection
+static int pool_finished = 0; // helpers done with the current one
+static bool pool_closing = false;
+static int idle_markers = 0;
+
+static void grow_items(GrayItem** items, int* capacity, int needed)
+{
+    if (*capacity >= needed)
+        return;
+    while (*capacity < needed)
+        *capacity = GROW_CAPACITY(*capacity);
+    // not managed by the GC, like the gray stack
+    *items = realloc(*items, sizeof(GrayItem) * *capacity);
+    if (*items == NULL)
+        exit(1);
+}
+
+static void share_half(Marker* marker)
+{
+    int count = marker->count / 2;
+    pthread_mutex_lock(&marker->lock);
+    grow_items(&marker->shared, &marker->shared_capacity, marker->shared_count + count);
+    memcpy(marker->shared + marker->shared_count, marker->items + marker->count - count,
+        sizeof(GrayItem) * count);
+    __atomic_store_n(&marker->shared_count, marker->shared_count + count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&marker->lock);
+    marker->count -= count;
+}
+
+static void push_shared_gray(Obj* object, Entry* entries, int count)
+{
+    Marker* marker = current_marker;
+    grow_items(&marker->items, &marker->capacity, marker->count + 1);
+    marker->items[marker->count].object = object;
+    marker->items[marker->count].entries = entries;
+    marker->items[marker->count].count = count;
+    marker->count++;
+    if (marker->count > 1 && __atomic_load_n(&marker->shared_count, __ATOMIC_RELAXED) == 0
+        && (marker->count >= GC_SHARE_THRESHOLD
+            || __atomic_load_n(&idle_markers, __ATOMIC_RELAXED) > 0))
+        share_half(marker);
+}
+
+// moves half of the victim's shared items (at least one) to the thief's private stack
+static bool take_shared(Marker* thief, Marker* victim)
+{
+    if (__atomic_load_n(&victim->shared_count, __ATOMIC_RELAXED) == 0)
+        return false;
+    pthread_mutex_lock(&victim->lock);
+    int count = (victim->shared_count + 1) / 2;
+    grow_items(&thief->items, &thief->capacity, thief->count + count);
+    memcpy(thief->items + thief->count, victim->shared + victim->shared_count - count,
+        sizeof(GrayItem) * count);
+    thief->count += count;
+    __atomic_store_n(&victim->shared_count, victim->shared_count - count, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&victim->lock);
+    return count > 0;
+}
+
+static bool steal(Marker* thief)
+{
+    int self = (int)(thief - markers);
+    for (int i = 0; i < marker_count; i++) {
+        if (take_shared(thief, &markers[(self + i) % marker_count]))
+            return true;
+    }
+    return false;
+}
+
+// false once every marker is idle, then there's no work left anywhere: a marker only goes idle
+// with nothing shared, and only its owner adds to a shared stack
+static bool wait_for_work()
+{
+    __atomic_add_fetch(&idle_markers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (__atomic_load_n(&idle_markers, __ATOMIC_SEQ_CST) == marker_count)
+            return false;
+        for (int i = 0; i < marker_count; i++) {
+            if (__atomic_load_n(&markers[i].shared_count, __ATOMIC_RELAXED) > 0) {
+                __atomic_sub_fetch(&idle_markers, 1, __ATOMIC_SEQ_CST);
+                return true;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static void drain(Marker* marker)
+{
+    for (;;) {
+        if (marker->count == 0 && !steal(marker)) {
+            if (!wait_for_work())
+                return;
+            continue;
+        }
+        GrayItem item = marker->items[--marker->count];
+        if (item.object != NULL) {
+            blacken_object(item.object);
+        } else {
+            for (int i = 0; i < item.count; i++) {
+                mark_object((Obj*)item.entries[i].key);
+                mark_value(item.entries[i].value);
+            }
+        }
+    }
+}
+
+static void* marker_thread(void* argument)
+{
+    Marker* marker = argument;
+    int generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_generation == generation && !pool_closing)
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        if (pool_closing) {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        generation = pool_generation;
+        pthread_mutex_unlock(&pool_lock);
+
+        current_marker = marker;
+        drain(marker);
+        current_marker = NULL;
+
+        pthread_mutex_lock(&pool_lock);
+        pool_finished++;
+        pthread_cond_signal(&pool_done);
+        pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+static void init_marker(Marker* marker)
+{
+    marker->items = NULL;
+    marker->count = 0;
+    marker->capacity = 0;
+    marker->shared = NULL;
+    marker->shared_count = 0;
+    marker->shared_capacity = 0;
+    pthread_mutex_init(&marker->lock, NULL);
+}
+
+static void trace_in_parallel()
+{
+    if (marker_count == 0) {
+        init_marker(&markers[0]);
+        marker_count = 1;
+        for (int i = 1; i < vm.gc_threads; i++) {
+            init_marker(&markers[i]);
+            if (pthread_create(&markers[i].thread, NULL, marker_thread, &markers[i]) != 0)
+                break;
+            marker_count++;
+        }
+    }
+
+    // the roots marked so far are up for grabs
+    Marker* marker = &markers[0];
+    grow_items(&marker->shared, &marker->shared_capacity, vm.gray_count);
+    for (int i = 0; i < vm.gray_count; i++) {
+        marker->shared[i].object = vm.gray_stack[i];
+        marker->shared[i].entries = NULL;
+        marker->shared[i].count = 0;
+    }
+    marker->shared_count = vm.gray_count;
+    vm.gray_count = 0;
+
+    idle_markers = 0;
+    pthread_mutex_lock(&pool_lock);
+    pool_finished = 0;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    current_marker = marker;
+    drain(marker);
+    current_marker = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    while (pool_finished < marker_count - 1)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void close_markers()
+{
+    pthread_mutex_lock(&pool_lock);
+    pool_closing = true;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < marker_count; i++) {
+        if (i > 0)
+            pthread_join(markers[i].thread, NULL);
+        pthread_mutex_destroy(&markers[i].lock);
+        free(markers[i].items);
+        free(markers[i].shared);
+    }
+    marker_count = 0;
+}
+
+#endif
+
 static void trace_references()
 {
+#ifdef PARALLEL_MARK
+#ifdef DEBUG_STRESS_GC
+    if (vm.gc_threads > 1) {
+#else
+    if (vm.gc_threads > 1 && vm.bytes_allocated >= GC_PARALLEL_MIN_BYTES) {
+#endif
+        trace_in_parallel();
+        return;
+    }
+#endif
     while (vm.gray_count > 0) {
         Obj* object = vm.gray_stack[--vm.gray_count];
         blacken_object(object);
     }
 }
 
-static void sweep()
+// frees the unmarked objects of a list and clears the marks of the others
+static void sweep(Obj** list)
 {
     Obj* previous = NULL;
-    Obj* object = vm.objects;
+    Obj* object = *list;
     while (object != NULL) {
-        if (object->is_marked) {
-            object->is_marked = false;
+        if (object_marked(object)) {
+            clear_mark(object);
             previous = object;
             object = object->next;
         } else {
@@ -215,13 +837,97 @@ static void sweep()
             if (previous != NULL) {
                 previous->next = object;
             } else {
-                vm.objects = object;
+                *list = object;
             }
             free_object(unreached);
         }
     }
 }
 
+// drops the old objects that are about to be swept
+static void sweep_remembered()
+{
+    int count = 0;
+    for (int i = 0; i < vm.remembered_count; i++) {
+        if (object_marked(vm.remembered[i]))
+            vm.remembered[count++] = vm.remembered[i];
+    }
+    vm.remembered_count = count;
+}
+
+// gathered by the sweep in progress, they go to vm.gc_stats when it's done
+static size_t sweep_freed;
+static size_t sweep_live[OBJ_TYPE_COUNT];
+
+// the old objects are swept in slices from now on, the ones promoted meanwhile aren't in the way
+static void start_sweep()
+{
+    vm.sweep_list = vm.objects;
+    vm.objects = NULL;
+    vm.gc_phase = GC_SWEEP;
+    sweep_freed = 0;
+    memset(sweep_live, 0, sizeof(sweep_live));
+}
+
+// Frees up to budget old objects the sweep hasn't reached yet. The marked ones stay linked as they
+// were, a survivor is only written to when the object after it is freed. They join vm.objects and
+// their marks are cleared all at once when the sweep is done.
+static void sweep_slice(int budget)
+{
+    size_t before = vm.bytes_allocated;
+    for (; vm.sweep_list != NULL && budget > 0; budget--) {
+        Obj* object = vm.sweep_list;
+        vm.sweep_list = object->next;
+        if (object_marked(object)) {
+#ifdef SLAB_ALLOC
+            // the others' marks go all at once when the sweep is done
+            if (object->is_large)
+                object->is_marked = false;
+#else
+            object->is_marked = false;
+#endif
+            if (vm.swept_last == NULL)
+                vm.swept = object;
+            else if (vm.swept_last->next != object)
+                vm.swept_last->next = object;
+            vm.swept_last = object;
+            sweep_live[object->type] += block_size(object_size(object)) + owned_size(object);
+        } else {
+            free_object(object);
+        }
+    }
+    sweep_freed += before - vm.bytes_allocated;
+#ifdef DEBUG_LOG_GC
+    printf("-- sweep collected %zu bytes\n", before - vm.bytes_allocated);
+#endif
+    if (vm.sweep_list == NULL) {
+        if (vm.swept_last != NULL) {
+            vm.swept_last->next = vm.objects;
+            vm.objects = vm.swept;
+        }
+        vm.swept = NULL;
+        vm.swept_last = NULL;
+#ifdef SLAB_ALLOC
+        // the young objects' marks are clear already
+        clear_block_marks();
+#endif
+        vm.gc_phase = GC_IDLE;
+        adapt_gc_policy();
+        vm.next_gc = gc_threshold(vm.bytes_allocated);
+
+        GcStats* stats = &vm.gc_stats;
+        stats->total_freed += sweep_freed;
+        memcpy(stats->live_bytes, sweep_live, sizeof(sweep_live));
+        stats->freed_history[stats->cycles % GC_STATS_HISTORY] = sweep_freed;
+        stats->next_gc_history[stats->cycles % GC_STATS_HISTORY] = vm.next_gc;
+        stats->cycles++;
+#ifdef DEBUG_LOG_GC
+        printf("-- sweep end\n");
+        printf("   %zu bytes, next at %zu\n", vm.bytes_allocated, vm.next_gc);
+#endif
+    }
+}
+
 void free_objects()
 {
     Obj* object = vm.objects;
@@ -230,26 +936,460 @@ void free_objects()
         free_object(object);
         object = next;
     }
+    object = vm.young_objects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        free_object(object);
+        object = next;
+    }
+    // past swept_last the survivors' next fields are stale
+    object = vm.swept;
+    while (object != NULL) {
+        Obj* next = object == vm.swept_last ? NULL : object->next;
+        free_object(object);
+        object = next;
+    }
+    object = vm.sweep_list;
+    while (object != NULL) {
+        Obj* next = object->next;
+        free_object(object);
+        object = next;
+    }
+    for (uint8_t* top = vm.nursery; top < vm.nursery_top; top += object_size((Obj*)top)) {
+        release_object((Obj*)top);
+    }
+    free(vm.nursery);
+#ifdef SLAB_ALLOC
+    free(vm.nursery_marks);
+#endif
+    free(heap_reserve);
+    heap_reserve = NULL;
+    free(vm.remembered);
     free(vm.gray_stack);
+#ifdef PARALLEL_MARK
+    close_markers();
+#endif
+    free_allocator();
 }
 
 void collect_garbage()
 {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytes_allocated;
 #endif
+    // the marks of the last collection's survivors are still there until its sweep is done
+    if (vm.gc_phase == GC_SWEEP)
+        sweep_slice(INT_MAX);
 
+    vm.gc_stats.collections++;
     mark_roots();
     trace_references();
     table_remove_white(&vm.strings);
-    sweep();
+    sweep_remembered();
+    // the dead ones outside the nursery can go as well, the nursery itself waits for collect_young()
+    sweep(&vm.young_objects);
+    clear_nursery_marks();
 
-    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    // The old generation is swept lazily, a slice at a time at safepoints (see gc_slice()). The
+    // dead objects are unreachable and out of vm.strings already, so nothing runs into them.
+    start_sweep();
+    vm.gc_debt = 0;
+    // what survived isn't known yet, the sweep sets the real threshold when it's done
+    vm.next_gc = gc_threshold(vm.bytes_allocated);
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n", before - vm.bytes_allocated,
-        before, vm.bytes_allocated, vm.next_gc);
 #endif
-}
\ No newline at end of file
+}
+
+void remember_object(Obj* object)
+{
+    if (vm.remembered_capacity < vm.remembered_count + 1) {
+        vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.remembered_capacity);
+        if (vm.remembered == NULL)
+            exit(1);
+    }
+    object->is_remembered = true;
+    vm.remembered[vm.remembered_count++] = object;
+}
+
+// Young collection: the young objects reachable from the roots or from a remembered old object
+// are promoted, which copies the ones in the nursery to the C heap and leaves the address of the
+// copy in their next field (their mark tells that they moved). The promoted objects are scanned
+// like gray ones, with their pointers to young objects updated on the way. Nothing young survives,
+// so the nursery starts over empty and the remembered set is cleared.
+
+// where the young object is now, promoting it if it wasn't yet
+static Obj* promote(Obj* object)
+{
+    if (object == NULL || !object->is_young)
+        return object;
+    bool moves = in_nursery(object);
+    if (object_marked(object))
+        return moves ? object->next : object;
+
+    // young objects outside the nursery stay where they are, collect_young() moves them to the
+    // old list once it's done
+    set_mark(object);
+    Obj* promoted = object;
+    if (moves) {
+        size_t size = object_size(object);
+        // not reallocate(), which could start a full collection in the middle of this one
+        promoted = allocate_block(size);
+        if (promoted == NULL && spend_heap_reserve())
+            promoted = allocate_block(size);
+        if (promoted == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memcpy(promoted, object, size);
+        clear_mark(promoted);
+        promoted->is_young = false;
+        promoted->next = vm.objects;
+        vm.objects = promoted;
+        vm.bytes_allocated += block_size(size);
+        vm.gc_stats.promoted += block_size(size);
+        object->next = promoted;
+
+        // the only pointers into an object are those to its own inline storage
+        if (object->type == OBJ_UPVALUE) {
+            ObjUpvalue* upvalue = (ObjUpvalue*)promoted;
+            if (upvalue->location == &((ObjUpvalue*)object)->closed)
+                upvalue->location = &upvalue->closed;
+        } else if (object->type == OBJ_INSTANCE) {
+            ObjInstance* instance = (ObjInstance*)promoted;
+            if (instance->fields == ((ObjInstance*)object)->inline_fields)
+                instance->fields = instance->inline_fields;
+        }
+    }
+    push_gray(promoted);
+    return promoted;
+}
+
+static void promote_value(Value* value)
+{
+    if (IS_OBJ(*value))
+        *value = OBJ_VAL(promote(AS_OBJ(*value)));
+}
+
+static void promote_array(ValueArray* array)
+{
+    for (int i = 0; i < array->count; i++) {
+        promote_value(&array->values[i]);
+    }
+}
+
+// the keys keep their hashes, so the entries stay where they are
+static void promote_table(Table* table)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        entry->key = (ObjString*)promote((Obj*)entry->key);
+        promote_value(&entry->value);
+    }
+}
+
+// the young collection's blacken_object()
+static void scan_object(Obj* object)
+{
+    switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = (ObjBoundMethod*)object;
+        bound->method = (ObjClosure*)promote((Obj*)bound->method);
+        promote_value(&bound->receiver);
+        break;
+    }
+    case OBJ_ROPE: {
+        ObjRope* rope = (ObjRope*)object;
+        rope->left = promote(rope->left);
+        rope->right = promote(rope->right);
+        rope->flat = (ObjString*)promote((Obj*)rope->flat);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjInstance* instance = (ObjInstance*)object;
+        instance->klass = (ObjClass*)promote((Obj*)instance->klass);
+        instance->shape = (ObjShape*)promote((Obj*)instance->shape);
+        for (int i = 0; i < instance->shape->field_count; i++) {
+            promote_value(&instance->fields[i]);
+        }
+        break;
+    }
+    case OBJ_CLASS: {
+        ObjClass* klass = (ObjClass*)object;
+        klass->name = (ObjString*)promote((Obj*)klass->name);
+        promote_table(&klass->methods);
+        klass->root_shape = (ObjShape*)promote((Obj*)klass->root_shape);
+        break;
+    }
+    case OBJ_SHAPE: {
+        ObjShape* shape = (ObjShape*)object;
+        promote_table(&shape->slots);
+        promote_table(&shape->transitions);
+        break;
+    }
+    case OBJ_CLOSURE: {
+        ObjClosure* closure = (ObjClosure*)object;
+        closure->function = (ObjFunction*)promote((Obj*)closure->function);
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            closure->upvalues[i] = (ObjUpvalue*)promote((Obj*)closure->upvalues[i]);
+        }
+        break;
+    }
+    case OBJ_FUNCTION: {
+        ObjFunction* function = (ObjFunction*)object;
+        function->name = (ObjString*)promote((Obj*)function->name);
+        promote_array(&function->chunk.constants);
+        for (int i = 0; i < function->chunk.cache_count; i++) {
+            InlineCache* cache = &function->chunk.caches[i];
+            cache->receiver = promote(cache->receiver);
+            cache->transition = promote(cache->transition);
+            promote_value(&cache->method);
+        }
+        break;
+    }
+    case OBJ_UPVALUE:
+        promote_value(&((ObjUpvalue*)object)->closed);
+        break;
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+        break;
+    }
+}
+
+static void promote_roots()
+{
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        promote_value(slot);
+    }
+
+    for (int i = 0; i < vm.frame_count; i++) {
+        vm.frames[i].closure = (ObjClosure*)promote((Obj*)vm.frames[i].closure);
+    }
+
+    // the list itself is made of pointers to young upvalues
+    for (ObjUpvalue** upvalue = &vm.open_upvalues; *upvalue != NULL;
+         upvalue = &(*upvalue)->next) {
+        *upvalue = (ObjUpvalue*)promote((Obj*)*upvalue);
+    }
+
+    promote_table(&vm.global_names);
+    promote_array(&vm.global_values);
+    vm.init_string = (ObjString*)promote((Obj*)vm.init_string);
+
+    for (int i = 0; i < vm.remembered_count; i++) {
+        vm.remembered[i]->is_remembered = false;
+        scan_object(vm.remembered[i]);
+    }
+    vm.remembered_count = 0;
+}
+
+// vm.strings doesn't keep its strings alive, the young ones either moved or are gone
+static void sweep_young_string(ObjString* string)
+{
+    if (!string->is_interned)
+        return;
+    if (!object_marked((Obj*)string)) {
+        table_delete(&vm.strings, string);
+    } else if (in_nursery((Obj*)string)) {
+        Entry* entry = table_find(&vm.strings, string);
+        if (entry != NULL)
+            entry->key = (ObjString*)string->obj.next;
+    }
+}
+
+void collect_young()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- young gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+
+    vm.gc_stats.young_collections++;
+    // the promoted objects go on top of what the incremental collector has left to mark
+    int gray_base = vm.gray_count;
+    Obj* old_objects = vm.objects;
+    promote_roots();
+    while (vm.gray_count > gray_base) {
+        scan_object(vm.gray_stack[--vm.gray_count]);
+    }
+
+    for (uint8_t* top = vm.nursery; top < vm.nursery_top;) {
+        Obj* object = (Obj*)top;
+        top += object_size(object);
+        if (object->type == OBJ_STRING)
+            sweep_young_string((ObjString*)object);
+        if (!object_marked(object))
+            release_object(object);
+    }
+
+    Obj* object = vm.young_objects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        if (object->type == OBJ_STRING)
+            sweep_young_string((ObjString*)object);
+        if (object_marked(object)) {
+            clear_mark(object);
+            vm.gc_stats.promoted += block_size(object_size(object));
+            object->is_young = false;
+            object->next = vm.objects;
+            vm.objects = object;
+        } else {
+            free_object(object);
+        }
+        object = next;
+    }
+    vm.young_objects = NULL;
+
+#ifdef SLAB_ALLOC
+    // the objects allocated there next mustn't look moved
+    clear_nursery_marks();
+#endif
+#ifdef DEBUG_STRESS_GC
+    // a fresh nursery, so that a pointer that missed its update points to freed memory
+    free(vm.nursery);
+    vm.nursery = malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL)
+        exit(1);
+    vm.nursery_end = vm.nursery + NURSERY_SIZE;
+#endif
+    vm.nursery_top = vm.nursery;
+
+    // Nothing may point to them from a marked object yet without the incremental collector knowing:
+    // they are gray, to be scanned by the cycle in progress.
+    if (vm.gc_phase == GC_MARK) {
+        for (Obj* promoted = vm.objects; promoted != old_objects; promoted = promoted->next) {
+            mark_object(promoted);
+        }
+    }
+
+#ifdef DEBUG_LOG_GC
+    printf("-- young gc end\n");
+    printf("   promoted %zu bytes\n", vm.bytes_allocated - before);
+#endif
+
+    // the promoted objects count towards the next full collection
+    if (!vm.incremental_gc && vm.bytes_allocated > vm.next_gc)
+        collect_garbage();
+}
+
+void shade_object(Obj* object)
+{
+    if (vm.gc_phase == GC_MARK)
+        mark_object(object);
+}
+
+// Incremental collection: a cycle marks the roots, then drains the gray stack and sweeps a few
+// objects at a time, one slice per GC_SLICE_BYTES allocated. Stores into marked objects go through
+// write_barrier(), but the roots don't, so they are marked once more before the sweep starts.
+// Only the old generation is marked, the young objects that survive are promoted gray.
+
+static void finish_marking()
+{
+    collect_young();
+    mark_roots();
+    trace_references();
+    table_remove_white(&vm.strings);
+    start_sweep();
+}
+
+static void gc_slice()
+{
+    if (vm.gc_phase == GC_IDLE) {
+        if (!vm.incremental_gc)
+            return;
+#ifndef DEBUG_STRESS_GC
+        if (vm.bytes_allocated <= vm.next_gc)
+            return;
+#endif
+#ifdef DEBUG_LOG_GC
+        printf("-- incremental gc begin\n");
+#endif
+        vm.gc_phase = GC_MARK;
+        vm.gc_stats.collections++;
+        mark_roots();
+    }
+    vm.gc_debt = 0;
+    int budget = vm.gc_slice_budget;
+#ifndef DEBUG_STRESS_GC
+    if (vm.bytes_allocated > GC_INCREMENTAL_LIMIT(vm.next_gc))
+        budget = INT_MAX;
+#endif
+
+    if (vm.gc_phase == GC_MARK) {
+        for (; vm.gray_count > 0 && budget > 0; budget--) {
+            blacken_object(vm.gray_stack[--vm.gray_count]);
+        }
+        if (vm.gray_count > 0)
+            return;
+        finish_marking();
+    }
+
+    sweep_slice(budget);
+}
+
+// the cycle in progress is dropped, collect_garbage() starts over with the roots
+static void abort_marking()
+{
+    vm.gray_count = 0;
+#ifdef SLAB_ALLOC
+    clear_block_marks();
+#endif
+    // all of them without SLAB_ALLOC, the large ones with it
+    for (Obj* object = vm.objects; object != NULL; object = object->next) {
+        object->is_marked = false;
+    }
+    vm.gc_phase = GC_IDLE;
+}
+
+static void emergency_collect()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- emergency gc at %zu bytes\n", vm.bytes_allocated);
+#endif
+    double start = gc_time();
+    if (vm.gc_phase == GC_MARK)
+        abort_marking();
+    collect_garbage();
+    sweep_slice(INT_MAX);
+    record_pause(start);
+}
+
+bool gc_safepoint()
+{
+    double start = gc_time();
+    vm.gc_requested = false;
+#ifdef DEBUG_STRESS_GC
+    collect_young();
+#else
+    // the nursery is full once objects had to go elsewhere
+    if (vm.young_objects != NULL)
+        collect_young();
+#endif
+    gc_slice();
+    record_pause(start);
+
+    // A refused allocation is reported whatever the limit. The promoted objects may have gone over
+    // the limit as well. Once it was reached, the heap is collected once more, what was live then
+    // may be garbage by now.
+    bool refused = heap_refused;
+    heap_refused = false;
+    vm.heap_exhausted = false;
+    check_heap_limit();
+    if (refused || vm.heap_exhausted) {
+        vm.heap_exhausted = false;
+        vm.gc_requested = false;
+        return false;
+    }
+    // taken back once the system has room again
+    if (heap_reserve == NULL)
+        heap_reserve = malloc(HEAP_RESERVE_SIZE);
+    return true;
+}
+
+void print_gc_pauses()
+{
+    fprintf(stderr, "gc: %d pauses, worst %.3f ms\n", vm.gc_stats.pauses,
+        vm.gc_stats.worst_pause * 1000);
+}
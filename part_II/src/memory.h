@@ -3,6 +3,10 @@
 
 #include "common.h"
 #include "value.h"
+#include "object.h"
+#include "table.h"
+#include "allocator.h"
+#include "vm.h"
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
 #define GROW_ARRAY(type, pointer, old_count, new_count)                                            \
@@ -12,10 +16,72 @@
 #define ALLOCATE(type, count) (type*)reallocate(NULL, 0, count * sizeof(type))
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// New objects are bump allocated in the nursery, once it is full they come from the C heap until
+// the next young collection
+#define NURSERY_SIZE (512 * 1024)
+// default work of one slice of the collector (incremental marking or sweeping), in objects
+#define GC_SLICE_BUDGET 1000
+// most threads that mark in parallel, --gc-threads defaults to one per core up to this
+#define GC_MAX_THREADS 16
+// below this the threads cost more than they save
+#define GC_PARALLEL_MIN_BYTES (4 * 1024 * 1024)
+// tables with more entries than this are marked in chunks of that many, which can be stolen
+#define GC_MARK_CHUNK 512
+// a collection in progress gets its next slice once this much more has been allocated
+#define GC_SLICE_BYTES (8 * 1024)
+// kept aside to get from an allocation the system refuses to the safepoint that reports it
+#define HEAP_RESERVE_SIZE (1024 * 1024)
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size);
+// memory for a new young object, which the caller initialises before anything else allocates
+Obj* allocate_young(size_t size);
+// During a young collection the mark of a young object means that it moved, its next field is
+// then the old copy. With SLAB_ALLOC the marks are kept in side bitmaps rather than in the object,
+// but for the objects too large for a slab.
+bool is_marked(Obj* object);
 void mark_object(Obj* object);
 void mark_value(Value value);
+void mark_entries(Entry* entries, int count);
+void init_heap();
 void free_objects();
+// full collection of both generations, doesn't move any object
 void collect_garbage();
+// Collects the young generation by moving the objects still reachable to the old one. The VM
+// only calls it at safepoints, where no C code holds a pointer to a young object.
+void collect_young();
+// Runs what vm.gc_requested asked for: a young collection, a slice of the incremental collector.
+// False when the heap is over vm.gc_policy.max_heap even after a full collection.
+bool gc_safepoint();
+void remember_object(Obj* object);
+// wall clock seconds, clock() would add up the time of the marking threads
+double gc_time();
+void shade_object(Obj* object);
+// prints the number of pauses and the longest one to stderr
+void print_gc_pauses();
+
+#ifdef SLAB_ALLOC
+// cheaper than is_marked(), the object mustn't be young
+#define OLD_MARKED(object) ((object)->is_large ? (object)->is_marked : block_marked(object))
+#else
+#define OLD_MARKED(object) ((object)->is_marked)
+#endif
+
+// Must follow every store of value into object (in a field, table or cache it owns). An old
+// object pointing to a young one is remembered, its pointers are roots of the next young
+// collection. While the incremental collector marks, an unmarked object stored into a marked one
+// gets marked too, the collector won't scan the marked one again.
+static inline void write_barrier(Obj* object, Value value)
+{
+    if (!IS_OBJ(value))
+        return;
+    Obj* target = AS_OBJ(value);
+    if (target->is_young) {
+        if (!object->is_young && !object->is_remembered)
+            remember_object(object);
+    } else if (vm.gc_phase == GC_MARK && !object->is_young && OLD_MARKED(object)
+        && !OLD_MARKED(target)) {
+        shade_object(target);
+    }
+}
 
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "object.h"
@@ -6,16 +7,20 @@
 #include "vm.h"
 #include "value.h"
 #include "table.h"
+#include "hash.h"
 
 #define ALLOCATE_OBJ(type, object_type) (type*)allocate_object(sizeof(type), object_type)
 
 static Obj* allocate_object(size_t size, ObjType type)
 {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = allocate_young(size);
     object->type = type;
     object->is_marked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+#ifdef SLAB_ALLOC
+    object->is_large = size > SLAB_MAX_SIZE;
+#endif
+    object->is_young = true;
+    object->is_remembered = false;
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -24,12 +29,26 @@ static Obj* allocate_object(size_t size, ObjType type)
     return object;
 }
 
-static ObjString* allocate_string(char* chars, int length, uint32_t hash)
+ObjString* new_string(int length)
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->chars = chars;
+    ObjString* string = (ObjString*)allocate_object(STRING_SIZE(length), OBJ_STRING);
     string->length = length;
-    string->hash = hash;
+    string->hash = 0;
+    string->is_interned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// the low half, a Table only ever masks the low bits
+static uint32_t hash_string(const char* key, int length)
+{
+    return (uint32_t)hash_bytes(key, (size_t)length);
+}
+
+// the string has its hash, there is no string of the same chars in vm.strings yet
+static ObjString* add_string(ObjString* string)
+{
+    string->is_interned = true;
     push(OBJ_VAL(string));
     // hash set -> we only care about the keys
     table_set(&vm.strings, string, NIL_VAL);
@@ -37,14 +56,14 @@ static ObjString* allocate_string(char* chars, int length, uint32_t hash)
     return string;
 }
 
-static uint32_t hash_string(const char* key, int length)
+ObjString* intern_string(ObjString* string)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
-    }
-    return hash;
+    if (string->is_interned)
+        return string;
+    string->hash = hash_string(string->chars, string->length);
+    ObjString* interned
+        = table_find_string(&vm.strings, string->chars, string->length, string->hash);
+    return interned != NULL ? interned : add_string(string);
 }
 
 ObjString* copy_string(const char* chars, int length)
@@ -53,22 +72,124 @@ ObjString* copy_string(const char* chars, int length)
     ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
     if (interned != NULL)
         return interned;
-    char* heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
-    return allocate_string(heap_chars, length, hash);
+    ObjString* string = new_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    return add_string(string);
 }
 
-ObjString* take_string(char* chars, int length)
+bool strings_equal(ObjString* a, ObjString* b)
 {
+    if (a == b)
+        return true;
+    if (a->is_interned && b->is_interned)
+        return false;
+    return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
 
-    uint32_t hash = hash_string(chars, length);
-    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+static int text_length(Obj* text)
+{
+    return text->type == OBJ_STRING ? ((ObjString*)text)->length : ((ObjRope*)text)->length;
+}
+
+// a flattened rope is replaced by its string, so that the pieces can be collected
+static Obj* rope_piece(Obj* text)
+{
+    if (text->type == OBJ_ROPE && ((ObjRope*)text)->flat != NULL)
+        return (Obj*)((ObjRope*)text)->flat;
+    return text;
+}
+
+Obj* concatenate_strings(Obj* a, Obj* b)
+{
+    a = rope_piece(a);
+    b = rope_piece(b);
+    if (text_length(a) == 0)
+        return b;
+    if (text_length(b) == 0)
+        return a;
+
+    int length = text_length(a) + text_length(b);
+    if (length < ROPE_MIN_LENGTH) {
+        // ropes are longer, so these are strings
+        ObjString* left = (ObjString*)a;
+        ObjString* right = (ObjString*)b;
+        ObjString* string = new_string(length);
+        memcpy(string->chars, left->chars, left->length);
+        memcpy(string->chars + left->length, right->chars, right->length);
+        return (Obj*)string;
     }
-    return allocate_string(chars, length, hash);
+
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return (Obj*)rope;
+}
+
+// Copies the chars of the rope's strings into chars, the last one first. The ropes it goes through
+// wait on a stack of their own, the tree can be as deep as it has pieces. Nothing is allocated on
+// the GC heap, printing (from native code too) relies on that.
+static void copy_rope(ObjRope* rope, char* chars)
+{
+    Obj* initial[64];
+    Obj** stack = initial;
+    int capacity = 64;
+    int count = 0;
+    char* end = chars + rope->length;
+
+    stack[count++] = (Obj*)rope;
+    while (count > 0) {
+        Obj* text = rope_piece(stack[--count]);
+        if (text->type == OBJ_STRING) {
+            ObjString* string = (ObjString*)text;
+            end -= string->length;
+            memcpy(end, string->chars, string->length);
+            continue;
+        }
+        if (count + 2 > capacity) {
+            Obj** grown = malloc(sizeof(Obj*) * capacity * 2);
+            if (grown == NULL)
+                exit(1);
+            memcpy(grown, stack, sizeof(Obj*) * count);
+            if (stack != initial)
+                free(stack);
+            stack = grown;
+            capacity *= 2;
+        }
+        stack[count++] = ((ObjRope*)text)->left;
+        stack[count++] = ((ObjRope*)text)->right;
+    }
+    if (stack != initial)
+        free(stack);
+}
+
+ObjString* flatten_rope(ObjRope* rope)
+{
+    if (rope->flat != NULL)
+        return rope->flat;
+    ObjString* string = new_string(rope->length);
+    copy_rope(rope, string->chars);
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    write_barrier((Obj*)rope, OBJ_VAL(string));
+    return string;
+}
+
+static void print_rope(ObjRope* rope)
+{
+    if (rope->flat != NULL) {
+        printf("%s", rope->flat->chars);
+        return;
+    }
+    char* chars = malloc(rope->length);
+    if (chars == NULL)
+        exit(1);
+    copy_rope(rope, chars);
+    fwrite(chars, 1, rope->length, stdout);
+    free(chars);
 }
 
 static void print_function(ObjFunction* function)
@@ -107,6 +228,12 @@ void print_object(Value value)
     case OBJ_BOUND_METHOD:
         print_function(AS_BOUND_METHOD(value)->method->function);
         break;
+    case OBJ_SHAPE:
+        printf("shape");
+        break;
+    case OBJ_ROPE:
+        print_rope(AS_ROPE(value));
+        break;
     default:
         break;
     }
@@ -117,6 +244,10 @@ ObjFunction* new_function()
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalue_count = 0;
+    function->register_count = 0;
+    function->max_slots = 0;
+    function->hotness = 0;
+    function->jit = NULL;
     function->name = NULL;
     init_chunk(&function->chunk);
     return function;
@@ -131,16 +262,13 @@ ObjNative* new_native(NativeFn function)
 
 ObjClosure* new_closure(ObjFunction* function)
 {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalue_count);
-
-    for (int i = 0; i < function->upvalue_count; i++) {
-        upvalues[i] = NULL;
-    }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = (ObjClosure*)allocate_object(
+        sizeof(ObjClosure) + function->upvalue_count * sizeof(ObjUpvalue*), OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalue_count = function->upvalue_count;
+    for (int i = 0; i < function->upvalue_count; i++) {
+        closure->upvalues[i] = NULL;
+    }
     return closure;
 }
 
@@ -153,22 +281,88 @@ ObjUpvalue* new_upvalue(Value* slot)
     return upvalue;
 }
 
+static ObjShape* new_shape()
+{
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    init_table(&shape->slots);
+    init_table(&shape->transitions);
+    shape->field_count = 0;
+    return shape;
+}
+
 ObjClass* new_class(ObjString* name)
 {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     init_table(&klass->methods);
+    klass->root_shape = NULL;
+    klass->field_count_hint = 0;
+    push(OBJ_VAL(klass));
+    klass->root_shape = new_shape();
+    pop();
     return klass;
 }
 
 ObjInstance* new_instance(ObjClass* klass)
 {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int inline_capacity = klass->field_count_hint;
+    if (inline_capacity > INSTANCE_MAX_INLINE_FIELDS)
+        inline_capacity = INSTANCE_MAX_INLINE_FIELDS;
+    ObjInstance* instance = (ObjInstance*)allocate_object(
+        sizeof(ObjInstance) + inline_capacity * sizeof(Value), OBJ_INSTANCE);
     instance->klass = klass;
-    init_table(&instance->fields);
+    instance->shape = klass->root_shape;
+    instance->fields = instance->inline_fields;
+    instance->field_capacity = inline_capacity;
+    instance->inline_capacity = inline_capacity;
     return instance;
 }
 
+int shape_slot(ObjShape* shape, ObjString* name)
+{
+    Value slot;
+    if (!table_get(&shape->slots, name, &slot))
+        return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+ObjShape* shape_transition(ObjShape* shape, ObjString* name)
+{
+    Value next;
+    if (table_get(&shape->transitions, name, &next))
+        return (ObjShape*)AS_OBJ(next);
+
+    ObjShape* child = new_shape();
+    push(OBJ_VAL(child));
+    table_add_all(&shape->slots, &child->slots);
+    table_set(&child->slots, name, NUMBER_VAL(shape->field_count));
+    child->field_count = shape->field_count + 1;
+    table_set(&shape->transitions, name, OBJ_VAL(child));
+    write_barrier((Obj*)shape, OBJ_VAL(name));
+    write_barrier((Obj*)shape, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+void set_instance_shape(ObjInstance* instance, ObjShape* shape)
+{
+    if (shape->field_count > instance->field_capacity) {
+        int capacity = GROW_CAPACITY(instance->field_capacity);
+        Value* fields = ALLOCATE(Value, capacity);
+        memcpy(fields, instance->fields, instance->shape->field_count * sizeof(Value));
+        if (instance->fields != instance->inline_fields)
+            FREE_ARRAY(Value, instance->fields, instance->field_capacity);
+        instance->fields = fields;
+        instance->field_capacity = capacity;
+    }
+    instance->shape = shape;
+    write_barrier((Obj*)instance, OBJ_VAL(shape));
+
+    ObjClass* klass = instance->klass;
+    if (shape->field_count > klass->field_count_hint)
+        klass->field_count_hint = shape->field_count;
+}
+
 ObjBoundMethod* new_bound_method(Value receiver, ObjClosure* method)
 {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
@@ -14,6 +14,10 @@
 #define IS_CLASS(value) is_obj_type(value, OBJ_CLASS)
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
+#define IS_ROPE(value) is_obj_type(value, OBJ_ROPE)
+// what + concatenates
+#define IS_STRING_OR_ROPE(value)                                                                   \
+    (IS_OBJ(value) && (OBJ_TYPE(value) == OBJ_STRING || OBJ_TYPE(value) == OBJ_ROPE))
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
@@ -23,6 +27,7 @@
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 
 typedef enum {
     OBJ_STRING,
@@ -32,26 +37,43 @@ typedef enum {
     OBJ_UPVALUE,
     OBJ_CLASS,
     OBJ_INSTANCE,
-    OBJ_BOUND_METHOD
+    OBJ_BOUND_METHOD,
+    OBJ_SHAPE,
+    OBJ_ROPE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
 struct Obj {
     ObjType type;
-    bool is_marked;
-    struct Obj* next;
+    bool is_marked; // see is_marked(), with SLAB_ALLOC only large objects outside the nursery use it
+#ifdef SLAB_ALLOC
+    bool is_large; // bigger than SLAB_MAX_SIZE, so not in a segment that could hold its mark
+#endif
+    bool is_young;
+    bool is_remembered; // old object in vm.remembered
+    struct Obj* next; // old and young objects are in separate lists, nursery objects in none
 };
 
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
-    uint32_t hash;
+    uint32_t hash; // only set once interned
+    bool is_interned; // in vm.strings, table keys have to be
+    char chars[]; // length of them and a '\0'
 };
 
+// what a string of length takes, the chars start right after is_interned
+#define STRING_SIZE(length) (offsetof(ObjString, chars) + (length) + 1)
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalue_count;
+    int register_count; // frame size of functions compiled by the register backend, 0 otherwise
+    int max_slots; // most stack slots a frame uses at once, callee and temporaries included
+    int hotness; // counts up to JIT_THRESHOLD
+    struct JitCode* jit; // native code, NULL until the function gets hot
     Chunk chunk;
     ObjString* name;
 } ObjFunction;
@@ -65,23 +87,54 @@ struct ObjUpvalue {
 
 typedef struct ObjUpvalue ObjUpvalue;
 
+// concatenations shorter than this are copied into a string right away
+#define ROPE_MIN_LENGTH 256
+
+// A concatenation of two strings or ropes that isn't copied into a string until it is compared.
+// Building a string piece by piece then takes time and memory linear in its length.
+typedef struct {
+    Obj obj;
+    int length;
+    Obj* left;
+    Obj* right;
+    ObjString* flat; // the string once flattened, left and right are NULL then
+} ObjRope;
+
 typedef struct {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalue_count;
+    ObjUpvalue* upvalues[];
 } ObjClosure;
 
+// Layout of the fields of an instance. Instances of one class that got the same fields in the
+// same order share a shape, adding a field moves an instance to the shape having that field too.
+typedef struct ObjShape {
+    Obj obj;
+    Table slots; // field name -> index in the instance's field array
+    Table transitions; // field name -> shape with that field added
+    int field_count;
+} ObjShape;
+
+// instances are never allocated with more inline fields than this
+#define INSTANCE_MAX_INLINE_FIELDS 16
+
 typedef struct {
     Obj obj;
     ObjString* name;
     Table methods;
+    ObjShape* root_shape; // shape of instances without fields, each shape belongs to one class
+    int field_count_hint; // most fields an instance got, new instances get room for as many
 } ObjClass;
 
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;
+    Value* fields; // shape->field_count values, inline_fields until they don't fit there
+    int field_capacity;
+    int inline_capacity;
+    Value inline_fields[];
 } ObjInstance;
 
 typedef struct {
@@ -105,13 +158,29 @@ static inline bool is_obj_type(Value value, ObjType obj_type)
 }
 
 ObjString* copy_string(const char* chars, int length);
-ObjString* take_string(char* chars, int length);
+// A string of length whose chars the caller writes before anything else allocates. Strings made at
+// runtime stay uninterned and unhashed until they are needed as a table key, intern_string() then
+// returns the string of the same chars interned before if there is one.
+ObjString* new_string(int length);
+ObjString* intern_string(ObjString* string);
+// interned strings are equal only if they are the same string, the others compare their chars
+bool strings_equal(ObjString* a, ObjString* b);
+// a rope, or a string if the result is short, of two strings or ropes reachable from the roots
+Obj* concatenate_strings(Obj* a, Obj* b);
+// the string of the rope's chars, not interned, the rope must be reachable from the roots
+ObjString* flatten_rope(ObjRope* rope);
 ObjFunction* new_function();
 ObjNative* new_native(NativeFn function);
 ObjClosure* new_closure(ObjFunction* function);
 ObjUpvalue* new_upvalue(Value* slot);
 ObjClass* new_class(ObjString* name);
 ObjInstance* new_instance(ObjClass* klass);
+// index of field name in instances with shape, -1 if they don't have it
+int shape_slot(ObjShape* shape, ObjString* name);
+// the shape instances with shape get when field name is added to them
+ObjShape* shape_transition(ObjShape* shape, ObjString* name);
+// moves instance to a shape with one more field, the caller stores the field's value
+void set_instance_shape(ObjInstance* instance, ObjShape* shape);
 void print_object(Value value);
 
 #endif
\ No newline at end of file
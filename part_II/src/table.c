@@ -110,6 +110,15 @@ bool table_get(Table* table, ObjString* key, Value* value)
     return true;
 }
 
+// returns the entry holding key, NULL if there is none
+Entry* table_find(Table* table, ObjString* key)
+{
+    if (table->count == 0)
+        return NULL;
+    Entry* entry = find_entry(table->entries, table->capacity, key);
+    return entry->key == NULL ? NULL : entry;
+}
+
 bool table_delete(Table* table, ObjString* key)
 {
     if (table->count == 0)
@@ -148,20 +157,13 @@ ObjString* table_find_string(Table* table, const char* chars, int length, uint32
     }
 }
 
-void mark_table(Table* table)
-{
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        mark_object((Obj*)entry->key);
-        mark_value(entry->value);
-    }
-}
+void mark_table(Table* table) { mark_entries(table->entries, table->capacity); }
 
 void table_remove_white(Table* table)
 {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.is_marked) {
+        if (entry->key != NULL && !is_marked((Obj*)entry->key)) {
             table_delete(table, entry->key);
         }
     }
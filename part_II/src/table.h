@@ -4,6 +4,7 @@
 #include "common.h"
 #include "value.h"
 
+// keys are interned strings, found by their hash and compared by pointer
 typedef struct {
     ObjString* key;
     Value value;
@@ -19,6 +20,7 @@ void init_table(Table* table);
 void free_table(Table* table);
 bool table_set(Table* table, ObjString* key, Value value);
 bool table_get(Table* table, ObjString* key, Value* value);
+Entry* table_find(Table* table, ObjString* key);
 bool table_delete(Table* table, ObjString* key);
 void table_add_all(Table* from, Table* to);
 ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
@@ -54,6 +54,8 @@ void print_value(Value value)
     case VAL_OBJ:
         print_object(value);
         break;
+    case VAL_UNDEFINED:
+        break;
     }
 #endif
 }
@@ -65,7 +67,10 @@ bool values_equal(Value a, Value b)
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b)
+        return true;
+    // strings made at runtime aren't interned, their chars decide
+    return IS_STRING(a) && IS_STRING(b) && strings_equal(AS_STRING(a), AS_STRING(b));
 #else
     if (a.type != b.type)
         return false;
@@ -77,6 +82,8 @@ bool values_equal(Value a, Value b)
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
+        if (IS_STRING(a) && IS_STRING(b))
+            return strings_equal(AS_STRING(a), AS_STRING(b));
         return AS_OBJ(a) == AS_OBJ(b);
     default:
         return false;
@@ -14,6 +14,7 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE 3 // 11
+#define TAG_UNDEFINED 4 // 100
 
 typedef uint64_t Value;
 
@@ -21,11 +22,13 @@ typedef uint64_t Value;
 #define IS_NIL(value) ((value) == NIL_VAL)
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 
 #define NUMBER_VAL(num) num_to_value(num)
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -49,7 +52,8 @@ static inline double value_to_num(Value value)
 
 #else
 
-typedef enum { VAL_NIL, VAL_NUMBER, VAL_BOOL, VAL_OBJ } ValueType;
+// VAL_UNDEFINED marks a global slot that has no value yet, it is never seen by Lox code
+typedef enum { VAL_NIL, VAL_NUMBER, VAL_BOOL, VAL_OBJ, VAL_UNDEFINED } ValueType;
 
 typedef struct {
     ValueType type;
@@ -64,6 +68,7 @@ typedef struct {
 #define NUMBER_VAL(value) ((Value) { VAL_NUMBER, { .number = value } })
 #define BOOL_VAL(value) ((Value) { VAL_BOOL, { .boolean = value } })
 #define OBJ_VAL(object) ((Value) { VAL_OBJ, { .obj = (Obj*)object } })
+#define UNDEFINED_VAL ((Value) { VAL_UNDEFINED, { .number = 0 } })
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -73,6 +78,7 @@ typedef struct {
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #endif
 
@@ -86,6 +92,7 @@ void init_value_array(ValueArray* array);
 void write_value_array(ValueArray* array, Value value);
 void free_value_array(ValueArray* array);
 void print_value(Value value);
+// objects are equal when they are the same one or strings of the same chars, ropes must be flattened
 bool values_equal(Value a, Value b);
 
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
@@ -8,6 +9,9 @@
 #include "compiler.h"
 #include "debug.h"
 #include "object.h"
+#include "jit.h"
+#include "loxc.h"
+#include "gcstats.h"
 
 VM vm;
 
@@ -32,9 +36,16 @@ static void runtime_error(const char* format, ...)
     fputs("\n", stderr);
 
     for (int i = vm.frame_count - 1; i >= 0; i--) {
+        // a stack overflow would print every one of the frames
+        if (i == vm.frame_count - 1 - TRACE_FRAMES_SHOWN && i >= TRACE_FRAMES_SHOWN) {
+            fprintf(stderr, "... %d more frames\n", i - TRACE_FRAMES_SHOWN + 1);
+            i = TRACE_FRAMES_SHOWN - 1;
+        }
         CallFrame* frame = &vm.frames[i];
         ObjFunction* function = frame->closure->function;
-        size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
+        // a safepoint reports from the first instruction of a function it just entered
+        size_t instruction = frame->ip - frame->closure->function->chunk.code;
+        instruction -= instruction > 0;
         fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
@@ -50,11 +61,37 @@ static void define_native(const char* name, NativeFn function)
 {
     push(OBJ_VAL(copy_string(name, (int)strlen(name))));
     push(OBJ_VAL(new_native(function)));
-    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = global_slot(AS_STRING(vm.stack[0]));
+    vm.global_values.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
+int global_slot(ObjString* name)
+{
+    Value slot;
+    if (table_get(&vm.global_names, name, &slot))
+        return (int)AS_NUMBER(slot);
+    if (vm.global_values.count > UINT16_MAX)
+        return -1;
+
+    int index = vm.global_values.count;
+    write_value_array(&vm.global_values, UNDEFINED_VAL);
+    table_set(&vm.global_names, name, NUMBER_VAL(index));
+    return index;
+}
+
+// only needed to report an undefined global, so a linear search is fine
+ObjString* global_name(int slot)
+{
+    for (int i = 0; i < vm.global_names.capacity; i++) {
+        Entry* entry = &vm.global_names.entries[i];
+        if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot)
+            return entry->key;
+    }
+    return NULL;
+}
+
 // returns a value from the stack but doesn't pop it
 static Value peek(int distance) { return vm.stack_top[-1 - distance]; }
 
@@ -62,43 +99,107 @@ static bool is_falsey(Value value) { return IS_NIL(value) || (IS_BOOL(value) &&
 
 static void concatenate()
 {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-    ObjString* result = take_string(chars, length);
+    Obj* result = concatenate_strings(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+// Ropes are flattened before they are compared, equal strings are the same object then. The value
+// stays where it is, reachable from the roots.
+static inline Value flat_value(Value value)
+{
+    return IS_ROPE(value) ? OBJ_VAL(flatten_rope(AS_ROPE(value))) : value;
+}
+
 void init_VM()
 {
+    vm.frames = malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.frame_capacity = FRAMES_INITIAL;
+    vm.max_frames = FRAMES_MAX;
+    vm.stack = malloc(sizeof(Value) * STACK_INITIAL);
+    vm.stack_capacity = STACK_INITIAL;
+    if (vm.frames == NULL || vm.stack == NULL)
+        exit(1);
     reset_stack();
+    vm.backend = BACKEND_STACK;
+    vm.jit_enabled = true;
     vm.objects = NULL;
     vm.bytes_allocated = 0;
-    vm.next_gc = 1024 * 1024;
     vm.gray_count = 0;
     vm.gray_capacity = 0;
     vm.gray_stack = NULL;
+    init_heap();
     init_table(&vm.strings);
+    init_table(&vm.global_names);
+    init_value_array(&vm.global_values);
     vm.init_string = NULL; // copying a string allocates memory, which can trigger a gc
     vm.init_string = copy_string("init", 4);
-    init_table(&vm.globals);
 
     define_native("clock", clock_native);
+    define_native("gcStats", gc_stats_native);
 }
 
 void free_VM()
 {
-    free_table(&vm.globals);
+    // while the heap is still there
+    flush_gc_stats();
+    free_table(&vm.global_names);
+    free_value_array(&vm.global_values);
     free_table(&vm.strings);
     vm.init_string = NULL;
     free_objects();
+    unload_loxc();
+    free(vm.frames);
+    free(vm.stack);
+}
+
+void set_max_depth(int frames)
+{
+    vm.max_frames = frames;
+    // the fast path in call() only compares against the capacity
+    if (vm.frame_capacity > frames)
+        vm.frame_capacity = frames;
+}
+
+// Makes room for a frame that may use up to slot_count stack slots above vm.stack_top. Growing the
+// stack moves it, so the frames, open upvalues and vm.stack_top are rebased onto the new block.
+static bool grow_stack(int slot_count)
+{
+    if (vm.frame_count >= vm.max_frames)
+        return false;
+
+    if (vm.frame_count == vm.frame_capacity) {
+        int capacity = vm.frame_capacity * 2;
+        if (capacity > vm.max_frames)
+            capacity = vm.max_frames;
+        CallFrame* frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+        if (frames == NULL)
+            return false;
+        vm.frames = frames;
+        vm.frame_capacity = capacity;
+    }
+
+    int needed = (int)(vm.stack_top - vm.stack) + slot_count;
+    if (needed > vm.stack_capacity) {
+        int capacity = vm.stack_capacity;
+        while (capacity < needed)
+            capacity *= 2;
+        Value* stack = realloc(vm.stack, sizeof(Value) * capacity);
+        if (stack == NULL)
+            return false;
+
+        for (int i = 0; i < vm.frame_count; i++) {
+            vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+        }
+        for (ObjUpvalue* upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+            upvalue->location = stack + (upvalue->location - vm.stack);
+        }
+        vm.stack_top = stack + (vm.stack_top - vm.stack);
+        vm.stack = stack;
+        vm.stack_capacity = capacity;
+    }
+    return true;
 }
 
 static bool call(ObjClosure* closure, int arg_count)
@@ -107,9 +208,15 @@ static bool call(ObjClosure* closure, int arg_count)
         runtime_error("Expected %d arguments but got %d.", closure->function->arity, arg_count);
         return false;
     }
-    if (vm.frame_count == FRAMES_MAX) {
-        runtime_error("Stack overflow.");
-        return false;
+    // what the compiler found the function needs, and room for the values the VM and natives push
+    // on top to keep them from the GC
+    int slot_count = closure->function->max_slots + FRAME_EXTRA_SLOTS;
+    if (vm.frame_count == vm.frame_capacity
+        || vm.stack_top + slot_count > vm.stack + vm.stack_capacity) {
+        if (!grow_stack(slot_count)) {
+            runtime_error("Stack overflow.");
+            return false;
+        }
     }
     CallFrame* frame = &vm.frames[vm.frame_count++];
     frame->closure = closure;
@@ -200,53 +307,225 @@ static void close_upvalues(Value* last)
         ObjUpvalue* upvalue = vm.open_upvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        write_barrier((Obj*)upvalue, upvalue->closed);
         vm.open_upvalues = upvalue->next;
     }
 }
 
+// A tail call has pushed the callee's frame right above the caller's, which has nothing left to do
+// but return the callee's result. The callee takes the caller's place on the stack and in the frame
+// array instead, so a chain of tail calls runs in constant space.
+static void replace_caller_frame()
+{
+    CallFrame* callee = &vm.frames[vm.frame_count - 1];
+    CallFrame* caller = &vm.frames[vm.frame_count - 2];
+    close_upvalues(caller->slots);
+    int slot_count = (int)(vm.stack_top - callee->slots);
+    memmove(caller->slots, callee->slots, slot_count * sizeof(Value));
+    vm.stack_top = caller->slots + slot_count;
+    callee->slots = caller->slots;
+    *caller = *callee;
+    vm.frame_count--;
+}
+
 static void define_method(ObjString* name)
 {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     table_set(&klass->methods, name, method);
+    write_barrier((Obj*)klass, OBJ_VAL(name));
+    write_barrier((Obj*)klass, method);
     pop();
 }
 
-static bool invoke_from_class(ObjClass* klass, ObjString* name, int arg_count)
+static void inherit(ObjClass* superclass, ObjClass* subclass)
+{
+    table_add_all(&superclass->methods, &subclass->methods);
+    for (int i = 0; i < superclass->methods.capacity; i++) {
+        Entry* entry = &superclass->methods.entries[i];
+        if (entry->key != NULL) {
+            write_barrier((Obj*)subclass, OBJ_VAL(entry->key));
+            write_barrier((Obj*)subclass, entry->value);
+        }
+    }
+}
+
+// Young collections move objects, so they (and the slices of the incremental collector) only run
+// after instructions that leave no pointer to an object anywhere but in the VM's roots: calls,
+// returns, back edges and a few more in run(). False when the heap limit was reached or the system
+// refused an allocation, which the callers report as a runtime error.
+static inline bool safepoint()
+{
+    return !vm.gc_requested || gc_safepoint();
+}
+
+// Inline caches: an instruction that looks a property up remembers the shape of the receiver and
+// where the property was found. Each shape belongs to one class and has its fields at fixed slots,
+// so a receiver of the same shape has the field at the same slot or the same method. A set that
+// adds a field also remembers the shape the receiver moves to.
+
+static void refill_cache(InlineCache* cache, Obj* receiver, int field, Obj* transition, Value method)
+{
+    if (cache->misses == INLINE_CACHE_MAX_MISSES)
+        return;
+    if (++cache->misses == INLINE_CACHE_MAX_MISSES) {
+        // megamorphic, stays empty
+        cache->receiver = NULL;
+        cache->transition = NULL;
+        cache->method = NIL_VAL;
+        return;
+    }
+    cache->receiver = receiver;
+    cache->field = field;
+    cache->transition = transition;
+    cache->method = method;
+    // the cache is in the chunk of the function running the instruction
+    Obj* function = (Obj*)vm.frames[vm.frame_count - 1].closure->function;
+    write_barrier(function, OBJ_VAL(receiver));
+    if (transition != NULL)
+        write_barrier(function, OBJ_VAL(transition));
+    write_barrier(function, method);
+}
+
+typedef enum { PROPERTY_UNDEFINED, PROPERTY_FIELD, PROPERTY_METHOD } PropertyKind;
+
+static PropertyKind find_property(
+    InlineCache* cache, ObjInstance* instance, ObjString* name, Value* value)
+{
+    ObjShape* shape = instance->shape;
+    if (cache->receiver == (Obj*)shape) {
+        if (cache->field < 0) {
+            *value = cache->method;
+            return PROPERTY_METHOD;
+        }
+        *value = instance->fields[cache->field];
+        return PROPERTY_FIELD;
+    }
+
+    int slot = shape_slot(shape, name);
+    if (slot >= 0) {
+        *value = instance->fields[slot];
+        refill_cache(cache, (Obj*)shape, slot, NULL, NIL_VAL);
+        return PROPERTY_FIELD;
+    }
+    if (table_get(&instance->klass->methods, name, value)) {
+        refill_cache(cache, (Obj*)shape, -1, NULL, *value);
+        return PROPERTY_METHOD;
+    }
+    return PROPERTY_UNDEFINED;
+}
+
+// the instance and value must be reachable, adding a field can allocate
+static void set_field(InlineCache* cache, ObjInstance* instance, ObjString* name, Value value)
+{
+    write_barrier((Obj*)instance, value);
+    ObjShape* shape = instance->shape;
+    if (cache->receiver == (Obj*)shape) {
+        if (cache->transition != NULL)
+            set_instance_shape(instance, (ObjShape*)cache->transition);
+        instance->fields[cache->field] = value;
+        return;
+    }
+
+    int slot = shape_slot(shape, name);
+    if (slot >= 0) {
+        instance->fields[slot] = value;
+        refill_cache(cache, (Obj*)shape, slot, NULL, NIL_VAL);
+        return;
+    }
+    ObjShape* next = shape_transition(shape, name);
+    set_instance_shape(instance, next);
+    instance->fields[shape->field_count] = value;
+    refill_cache(cache, (Obj*)shape, shape->field_count, (Obj*)next, NIL_VAL);
+}
+
+static bool invoke_from_class(
+    ObjClass* klass, ObjString* name, int arg_count, InlineCache* cache)
 {
     Value method;
-    if (!table_get(&klass->methods, name, &method)) {
-        runtime_error("Undefined property '%s'.", name->chars);
-        return false;
+    if (cache->receiver == (Obj*)klass) {
+        method = cache->method;
+    } else {
+        if (!table_get(&klass->methods, name, &method)) {
+            runtime_error("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        refill_cache(cache, (Obj*)klass, -1, NULL, method);
     }
     return call(AS_CLOSURE(method), arg_count);
 }
 
-static bool invoke(ObjString* name, int arg_count)
+static bool invoke(ObjString* name, int arg_count, InlineCache* cache)
 {
     Value receiver = peek(arg_count);
     if (!IS_INSTANCE(receiver)) {
         runtime_error("Only instances have methods.");
         return false;
     }
-    ObjInstance* instance = AS_INSTANCE(receiver);
     Value value;
-    if (table_get(&instance->fields, name, &value)) {
+    switch (find_property(cache, AS_INSTANCE(receiver), name, &value)) {
+    case PROPERTY_FIELD:
         vm.stack_top[-arg_count - 1] = value;
         return call_value(value, arg_count);
+    case PROPERTY_METHOD:
+        return call(AS_CLOSURE(value), arg_count);
+    default:
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
     }
-    return invoke_from_class(instance->klass, name, arg_count);
 }
 
+// replaces the receiver on top of the stack with property name of it
+static bool get_property(ObjInstance* instance, ObjString* name, InlineCache* cache)
+{
+    Value value;
+    switch (find_property(cache, instance, name, &value)) {
+    case PROPERTY_FIELD:
+        vm.stack_top[-1] = value;
+        return true;
+    case PROPERTY_METHOD:
+        vm.stack_top[-1] = OBJ_VAL(new_bound_method(peek(0), AS_CLOSURE(value)));
+        return true;
+    default:
+        runtime_error("Undefined property '%s'.", name->chars);
+        return false;
+    }
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_execution(CallFrame* frame, uint8_t* ip)
+{
+    printf("          ");
+    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(
+        &frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+}
+#endif
+
 static InterpretResult run()
 {
     CallFrame* frame = &vm.frames[vm.frame_count - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    // the instruction pointer lives in a local so the compiler can keep it in a register, it is
+    // written back to the frame before anything that may look at it (errors, calls, frame switches)
+    uint8_t* ip = frame->ip;
+    // first operand of the instructions that can follow OP_WIDE, read before jumping to the
+    // WIDE_CODE label of their handler
+    int operand;
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define OPERAND_CONSTANT() (frame->closure->function->chunk.constants.values[operand])
+#define OPERAND_STRING() AS_STRING(OPERAND_CONSTANT())
 #define BINARY_OP(value_type, op)                                                                  \
     do {                                                                                           \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                                          \
+            STORE_FRAME();                                                                         \
             runtime_error("Operands must be numbers.");                                            \
             return INTERPRET_RUNTIME_ERROR;                                                        \
         }                                                                                          \
@@ -254,300 +533,1131 @@ static InterpretResult run()
         double a = AS_NUMBER(pop());                                                               \
         push(value_type(a op b));                                                                  \
     } while (false)
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-
-    for (;;) {
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+// shared by OP_ADD and the superinstructions that end with an addition
+#define ADD_VALUES(a, b)                                                                           \
+    do {                                                                                           \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {                                                        \
+            push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));                                         \
+        } else if (IS_STRING_OR_ROPE(a) && IS_STRING_OR_ROPE(b)) {                                 \
+            push(a);                                                                               \
+            push(b);                                                                               \
+            concatenate();                                                                         \
+        } else {                                                                                   \
+            STORE_FRAME();                                                                         \
+            runtime_error("Operands must be two numbers or two strings.");                         \
+            return INTERPRET_RUNTIME_ERROR;                                                        \
+        }                                                                                          \
+    } while (false)
+// Quickening: a generic arithmetic or comparison instruction rewrites itself in the chunk into the
+// form specialised for the operand types it sees, which only checks for those types. When the
+// check fails, the specialised form writes the generic one back over itself and runs it instead.
+// length is the number of bytes of the instruction read so far.
+#define DEOPTIMIZE(generic, length)                                                                \
+    do {                                                                                           \
+        ip -= (length);                                                                            \
+        *ip = (generic);                                                                           \
+        DISPATCH();                                                                                \
+    } while (false)
+// operation of a specialised instruction, whose two operands are known to be numbers
+#define NUMBER_OP(value_type, op)                                                                  \
+    do {                                                                                           \
+        vm.stack_top[-2]                                                                           \
+            = value_type(AS_NUMBER(vm.stack_top[-2]) op AS_NUMBER(vm.stack_top[-1]));              \
+        vm.stack_top--;                                                                            \
+    } while (false)
+#define BOTH_NUMBERS(a, b) (IS_NUMBER(a) && IS_NUMBER(b))
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() (frame = &vm.frames[vm.frame_count - 1], ip = frame->ip)
+#define OUT_OF_MEMORY()                                                                            \
+    do {                                                                                           \
+        STORE_FRAME();                                                                             \
+        runtime_error("Out of memory.");                                                           \
+        return INTERPRET_RUNTIME_ERROR;                                                            \
+    } while (false)
+#ifdef JIT
+// Native code takes over from ip if the function has any. Places where it may resume (entering or
+// returning into a function, back edges and the instructions a loop body most often leaves it
+// for) also count how hot the function is. They are the safepoints as well, native code doesn't
+// allocate so it never needs one.
+#define SAFEPOINT()                                                                                \
+    do {                                                                                           \
+        if (!safepoint())                                                                          \
+            OUT_OF_MEMORY();                                                                       \
+        ObjFunction* function = frame->closure->function;                                          \
+        if (function->jit == NULL && function->hotness < JIT_THRESHOLD                            \
+            && ++function->hotness == JIT_THRESHOLD)                                               \
+            jit_compile(function);                                                                 \
+        if (function->jit != NULL)                                                                 \
+            ip = jit_run(frame, ip);                                                               \
+    } while (false)
+#else
+#define SAFEPOINT()                                                                                \
+    do {                                                                                           \
+        if (!safepoint())                                                                          \
+            OUT_OF_MEMORY();                                                                       \
+    } while (false)
+#endif
 
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(&frame->closure->function->chunk,
-            (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_EXECUTION() trace_execution(frame, ip)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
 
+#ifdef COMPUTED_GOTO
+    // one label per opcode, indexed by the opcode itself, so that every handler ends with its own
+    // indirect jump instead of sharing the single (hard to predict) jump of the switch, bytes that
+    // are no opcode go where the switch falls out
+    static void* dispatch_table[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&code_UNKNOWN,
+        [OP_RETURN] = &&code_RETURN,
+        [OP_CONSTANT] = &&code_CONSTANT,
+        [OP_NIL] = &&code_NIL,
+        [OP_TRUE] = &&code_TRUE,
+        [OP_FALSE] = &&code_FALSE,
+        [OP_ADD] = &&code_ADD,
+        [OP_SUBTRACT] = &&code_SUBTRACT,
+        [OP_MULTIPLY] = &&code_MULTIPLY,
+        [OP_DIVIDE] = &&code_DIVIDE,
+        [OP_NEGATE] = &&code_NEGATE,
+        [OP_NOT] = &&code_NOT,
+        [OP_EQUAL] = &&code_EQUAL,
+        [OP_GREATER] = &&code_GREATER,
+        [OP_LESS] = &&code_LESS,
+        [OP_PRINT] = &&code_PRINT,
+        [OP_POP] = &&code_POP,
+        [OP_DEFINE_GLOBAL] = &&code_DEFINE_GLOBAL,
+        [OP_GET_GLOBAL] = &&code_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&code_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&code_GET_LOCAL,
+        [OP_SET_LOCAL] = &&code_SET_LOCAL,
+        [OP_JUMP_IF_FALSE] = &&code_JUMP_IF_FALSE,
+        [OP_JUMP] = &&code_JUMP,
+        [OP_LOOP] = &&code_LOOP,
+        [OP_CALL] = &&code_CALL,
+        [OP_TAIL_CALL] = &&code_TAIL_CALL,
+        [OP_CLOSURE] = &&code_CLOSURE,
+        [OP_GET_UPVALUE] = &&code_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&code_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&code_CLOSE_UPVALUE,
+        [OP_CLASS] = &&code_CLASS,
+        [OP_SET_PROPERTY] = &&code_SET_PROPERTY,
+        [OP_GET_PROPERTY] = &&code_GET_PROPERTY,
+        [OP_METHOD] = &&code_METHOD,
+        [OP_INVOKE] = &&code_INVOKE,
+        [OP_INHERIT] = &&code_INHERIT,
+        [OP_GET_SUPER] = &&code_GET_SUPER,
+        [OP_SUPER_INVOKE] = &&code_SUPER_INVOKE,
+        [OP_ADD_LOCALS] = &&code_ADD_LOCALS,
+        [OP_ADD_CONSTANT] = &&code_ADD_CONSTANT,
+        [OP_NOT_EQUAL] = &&code_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&code_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&code_LESS_EQUAL,
+        [OP_POP_JUMP_IF_FALSE] = &&code_POP_JUMP_IF_FALSE,
+        [OP_CONSTANT_LONG] = &&code_CONSTANT_LONG,
+        [OP_JUMP_LONG] = &&code_JUMP_LONG,
+        [OP_LOOP_LONG] = &&code_LOOP_LONG,
+        [OP_WIDE] = &&code_WIDE,
+        [OP_ADD_NUM] = &&code_ADD_NUM,
+        [OP_ADD_STR] = &&code_ADD_STR,
+        [OP_ADD_LOCALS_NUM] = &&code_ADD_LOCALS_NUM,
+        [OP_ADD_CONSTANT_NUM] = &&code_ADD_CONSTANT_NUM,
+        [OP_GREATER_NUM] = &&code_GREATER_NUM,
+        [OP_LESS_NUM] = &&code_LESS_NUM,
+    };
+#define INTERPRET_LOOP DISPATCH();
+#define CASE_CODE(name) code_##name
+#define DISPATCH()                                                                                 \
+    do {                                                                                           \
+        TRACE_EXECUTION();                                                                         \
+        goto* dispatch_table[READ_BYTE()];                                                         \
+    } while (false)
+#else
+#define INTERPRET_LOOP                                                                             \
+    loop:                                                                                          \
+    TRACE_EXECUTION();                                                                             \
+    switch (READ_BYTE())
+#define CASE_CODE(name) case OP_##name
+#define DISPATCH() goto loop
 #endif
-        uint8_t instruction = READ_BYTE();
-        switch (instruction) {
-        case OP_CONSTANT: {
-            Value constant = READ_CONSTANT();
-            push(constant);
-            break;
-        }
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0))) {
-                runtime_error("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_ADD: {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                concatenate();
-            } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
-            } else {
-                runtime_error("Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_RETURN: {
-            Value result = pop();
-            close_upvalues(frame->slots);
-            vm.frame_count--;
-            if (vm.frame_count == 0) {
-                pop();
-                return INTERPRET_OK;
-            }
+#define WIDE_CODE(name) wide_##name
 
-            vm.stack_top = frame->slots;
-            push(result);
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
-        }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(is_falsey(pop())));
-            break;
-        case OP_EQUAL: {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(values_equal(a, b)));
-            break;
+    INTERPRET_LOOP
+    {
+    CASE_CODE(CONSTANT): {
+        Value constant = READ_CONSTANT();
+        push(constant);
+        DISPATCH();
+    }
+    CASE_CODE(NEGATE):
+        if (!IS_NUMBER(peek(0))) {
+            STORE_FRAME();
+            runtime_error("Operand must be a number.");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_PRINT: {
-            print_value(pop());
-            printf("\n");
-            break;
+        push(NUMBER_VAL(-AS_NUMBER(pop())));
+        DISPATCH();
+    CASE_CODE(ADD): {
+        Value b = pop();
+        Value a = pop();
+        if (BOTH_NUMBERS(a, b)) {
+            ip[-1] = OP_ADD_NUM;
+        } else if (IS_STRING_OR_ROPE(a) && IS_STRING_OR_ROPE(b)) {
+            ip[-1] = OP_ADD_STR;
         }
-        case OP_POP:
-            pop();
-            break;
-        case OP_DEFINE_GLOBAL: {
-            ObjString* name = READ_STRING();
-            table_set(&vm.globals, name, peek(0));
+        ADD_VALUES(a, b);
+        DISPATCH();
+    }
+    CASE_CODE(SUBTRACT):
+        BINARY_OP(NUMBER_VAL, -);
+        DISPATCH();
+    CASE_CODE(MULTIPLY):
+        BINARY_OP(NUMBER_VAL, *);
+        DISPATCH();
+    CASE_CODE(DIVIDE):
+        BINARY_OP(NUMBER_VAL, /);
+        DISPATCH();
+    CASE_CODE(RETURN): {
+        Value result = pop();
+        close_upvalues(frame->slots);
+        vm.frame_count--;
+        if (vm.frame_count == 0) {
             pop();
-            break;
+            return INTERPRET_OK;
         }
-        case OP_GET_GLOBAL: {
-            ObjString* name = READ_STRING();
-            Value value;
-            if (!table_get(&vm.globals, name, &value)) {
-                runtime_error("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(value);
-            break;
+
+        vm.stack_top = frame->slots;
+        push(result);
+        LOAD_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(NIL):
+        push(NIL_VAL);
+        DISPATCH();
+    CASE_CODE(FALSE):
+        push(BOOL_VAL(false));
+        DISPATCH();
+    CASE_CODE(TRUE):
+        push(BOOL_VAL(true));
+        DISPATCH();
+    CASE_CODE(NOT):
+        push(BOOL_VAL(is_falsey(pop())));
+        DISPATCH();
+    CASE_CODE(EQUAL): {
+        Value b = flat_value(peek(0));
+        Value a = flat_value(peek(1));
+        vm.stack_top -= 2;
+        push(BOOL_VAL(values_equal(a, b)));
+        DISPATCH();
+    }
+    CASE_CODE(GREATER):
+        if (BOTH_NUMBERS(peek(0), peek(1))) {
+            ip[-1] = OP_GREATER_NUM;
         }
-        case OP_SET_GLOBAL: {
-            ObjString* name = READ_STRING();
-            Value value;
-            if (table_set(&vm.globals, name, peek(0))) {
-                table_delete(&vm.globals, name);
-                runtime_error("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            // setting a variable doesn't pop the value off the stack because
-            // assignment is an expression
-            break;
+        BINARY_OP(BOOL_VAL, >);
+        DISPATCH();
+    CASE_CODE(LESS):
+        if (BOTH_NUMBERS(peek(0), peek(1))) {
+            ip[-1] = OP_LESS_NUM;
         }
-        case OP_GET_LOCAL: {
-            uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
+        BINARY_OP(BOOL_VAL, <);
+        DISPATCH();
+    CASE_CODE(PRINT): {
+        print_value(pop());
+        printf("\n");
+        DISPATCH();
+    }
+    CASE_CODE(POP):
+        pop();
+        DISPATCH();
+    CASE_CODE(DEFINE_GLOBAL): {
+        vm.global_values.values[READ_SHORT()] = pop();
+        DISPATCH();
+    }
+    CASE_CODE(GET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        Value value = vm.global_values.values[slot];
+        if (IS_UNDEFINED(value)) {
+            STORE_FRAME();
+            runtime_error("Undefined variable '%s'.", global_name(slot)->chars);
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_LOCAL: {
-            uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
+        push(value);
+        DISPATCH();
+    }
+    CASE_CODE(SET_GLOBAL): {
+        uint16_t slot = READ_SHORT();
+        Value* global = &vm.global_values.values[slot];
+        if (IS_UNDEFINED(*global)) {
+            STORE_FRAME();
+            runtime_error("Undefined variable '%s'.", global_name(slot)->chars);
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_JUMP_IF_FALSE: {
-            uint16_t offset = READ_SHORT();
-            if (is_falsey(peek(0)))
-                frame->ip += offset;
-            break;
+        // setting a variable doesn't pop the value off the stack because
+        // assignment is an expression
+        *global = peek(0);
+        DISPATCH();
+    }
+    CASE_CODE(GET_LOCAL):
+        operand = READ_BYTE();
+    WIDE_CODE(GET_LOCAL):
+        push(frame->slots[operand]);
+        DISPATCH();
+    CASE_CODE(SET_LOCAL):
+        operand = READ_BYTE();
+    WIDE_CODE(SET_LOCAL):
+        frame->slots[operand] = peek(0);
+        DISPATCH();
+    CASE_CODE(JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(peek(0)))
+            ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(JUMP): {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(LOOP): {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(CALL): {
+        uint8_t arg_count = READ_BYTE();
+        STORE_FRAME();
+        if (!call_value(peek(arg_count), arg_count)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_JUMP: {
-            uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+        LOAD_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(TAIL_CALL): {
+        uint8_t arg_count = READ_BYTE();
+        STORE_FRAME();
+        int frame_count = vm.frame_count;
+        if (!call_value(peek(arg_count), arg_count)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_LOOP: {
-            uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+        // without a frame of its own the result is already there, for the OP_RETURN that follows
+        if (vm.frame_count > frame_count) {
+            replace_caller_frame();
         }
-        case OP_CALL: {
-            uint8_t arg_count = READ_BYTE();
-            if (!call_value(peek(arg_count), arg_count)) {
-                return INTERPRET_RUNTIME_ERROR;
+        LOAD_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(CLOSURE):
+        operand = READ_BYTE();
+    WIDE_CODE(CLOSURE): {
+        ObjFunction* function = AS_FUNCTION(OPERAND_CONSTANT());
+        ObjClosure* closure = new_closure(function);
+        push(OBJ_VAL(closure));
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            uint8_t is_local = READ_BYTE();
+            // 2 is a local past slot 255
+            int index = is_local == 2 ? READ_SHORT() : READ_BYTE();
+            if (is_local) {
+                closure->upvalues[i] = capture_upvalue(frame->slots + index);
+            } else {
+                closure->upvalues[i] = frame->closure->upvalues[index];
             }
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
         }
-        case OP_CLOSURE: {
-            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-            ObjClosure* closure = new_closure(function);
-            push(OBJ_VAL(closure));
-            for (int i = 0; i < closure->upvalue_count; i++) {
-                uint8_t is_local = READ_BYTE();
-                uint8_t index = READ_BYTE();
-                if (is_local) {
-                    closure->upvalues[i] = capture_upvalue(frame->slots + index);
-                } else {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
-            break;
+        DISPATCH();
+    }
+    CASE_CODE(GET_UPVALUE): {
+        uint8_t slot = READ_BYTE();
+        push(*frame->closure->upvalues[slot]->location);
+        DISPATCH();
+    }
+    CASE_CODE(SET_UPVALUE): {
+        ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+        *upvalue->location = peek(0);
+        write_barrier((Obj*)upvalue, peek(0));
+        DISPATCH();
+    }
+    CASE_CODE(CLOSE_UPVALUE): {
+        close_upvalues(vm.stack_top - 1);
+        pop();
+        DISPATCH();
+    }
+    CASE_CODE(CLASS):
+        operand = READ_BYTE();
+    WIDE_CODE(CLASS):
+        push(OBJ_VAL(new_class(OPERAND_STRING())));
+        DISPATCH();
+    CASE_CODE(GET_PROPERTY):
+        operand = READ_BYTE();
+    WIDE_CODE(GET_PROPERTY): {
+        ObjString* name = OPERAND_STRING();
+        InlineCache* cache = READ_CACHE();
+        if (!IS_INSTANCE(peek(0))) {
+            STORE_FRAME();
+            runtime_error("Only instances have properties.");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_GET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+        ObjInstance* instance = AS_INSTANCE(peek(0));
+
+        STORE_FRAME();
+        if (!get_property(instance, name, cache)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_UPVALUE: {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(SET_PROPERTY):
+        operand = READ_BYTE();
+    WIDE_CODE(SET_PROPERTY): {
+        ObjString* name = OPERAND_STRING();
+        InlineCache* cache = READ_CACHE();
+        if (!IS_INSTANCE(peek(1))) {
+            STORE_FRAME();
+            runtime_error("Only instances have fields.");
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_CLOSE_UPVALUE: {
-            close_upvalues(vm.stack_top - 1);
-            pop();
-            break;
+        ObjInstance* instance = AS_INSTANCE(peek(1));
+        set_field(cache, instance, name, peek(0));
+        Value value = pop();
+        pop();
+        push(value);
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(METHOD):
+        operand = READ_BYTE();
+    WIDE_CODE(METHOD):
+        define_method(OPERAND_STRING());
+        DISPATCH();
+    CASE_CODE(INVOKE):
+        operand = READ_BYTE();
+    WIDE_CODE(INVOKE): {
+        ObjString* method = OPERAND_STRING();
+        int arg_count = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
+        STORE_FRAME();
+        if (!invoke(method, arg_count, cache)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_CLASS:
-            push(OBJ_VAL(new_class(READ_STRING())));
-            break;
-        case OP_GET_PROPERTY: {
-            if (!IS_INSTANCE(peek(0))) {
-                runtime_error("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjInstance* instance = AS_INSTANCE(peek(0));
-            ObjString* name = READ_STRING();
-
-            Value value;
-            if (table_get(&instance->fields, name, &value)) {
-                pop(); // instance
-                push(value);
-                break;
-            }
+        LOAD_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(INHERIT): {
+        Value superclass = peek(1);
+        if (!IS_CLASS(superclass)) {
+            STORE_FRAME();
+            runtime_error("Superclass must be a class.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        ObjClass* subclass = AS_CLASS(peek(0));
+        inherit(AS_CLASS(superclass), subclass);
+        pop();
+        DISPATCH();
+    }
+    CASE_CODE(GET_SUPER):
+        operand = READ_BYTE();
+    WIDE_CODE(GET_SUPER): {
+        ObjString* name = OPERAND_STRING();
+        ObjClass* superclass = AS_CLASS(pop());
 
-            if (!bind_method(instance->klass, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+        STORE_FRAME();
+        if (!bind_method(superclass, name)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_SET_PROPERTY: {
-            if (!IS_INSTANCE(peek(1))) {
-                runtime_error("Only instances have fields.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjInstance* instance = AS_INSTANCE(peek(1));
-            table_set(&instance->fields, READ_STRING(), peek(0));
-            Value value = pop();
-            pop();
-            push(value);
-            break;
+
+        DISPATCH();
+    }
+    CASE_CODE(SUPER_INVOKE):
+        operand = READ_BYTE();
+    WIDE_CODE(SUPER_INVOKE): {
+        ObjString* method = OPERAND_STRING();
+        int arg_count = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
+        ObjClass* superclass = AS_CLASS(pop());
+        STORE_FRAME();
+        if (!invoke_from_class(superclass, method, arg_count, cache)) {
+            return INTERPRET_RUNTIME_ERROR;
         }
-        case OP_METHOD: {
-            define_method(READ_STRING());
-            break;
+        LOAD_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(ADD_LOCALS): {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = frame->slots[READ_BYTE()];
+        if (BOTH_NUMBERS(a, b)) {
+            ip[-3] = OP_ADD_LOCALS_NUM;
         }
-        case OP_INVOKE: {
-            ObjString* method = READ_STRING();
-            int arg_count = READ_BYTE();
-            if (!invoke(method, arg_count)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
+        ADD_VALUES(a, b);
+        DISPATCH();
+    }
+    CASE_CODE(ADD_CONSTANT): {
+        Value b = READ_CONSTANT();
+        Value a = pop();
+        if (BOTH_NUMBERS(a, b)) {
+            ip[-2] = OP_ADD_CONSTANT_NUM;
         }
-        case OP_INHERIT: {
-            Value superclass = peek(1);
-            if (!IS_CLASS(superclass)) {
-                runtime_error("Superclass must be a class.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjClass* subclass = AS_CLASS(peek(0));
-            table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-            pop();
-            break;
+        ADD_VALUES(a, b);
+        DISPATCH();
+    }
+    CASE_CODE(NOT_EQUAL): {
+        Value b = flat_value(peek(0));
+        Value a = flat_value(peek(1));
+        vm.stack_top -= 2;
+        push(BOOL_VAL(!values_equal(a, b)));
+        DISPATCH();
+    }
+    CASE_CODE(GREATER_EQUAL):
+        // stays the negation of OP_LESS, so comparisons with NaN give the same result as before
+        BINARY_OP(NOT_BOOL_VAL, <);
+        DISPATCH();
+    CASE_CODE(LESS_EQUAL):
+        BINARY_OP(NOT_BOOL_VAL, >);
+        DISPATCH();
+    CASE_CODE(POP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(pop()))
+            ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(ADD_NUM):
+        if (!BOTH_NUMBERS(peek(0), peek(1)))
+            DEOPTIMIZE(OP_ADD, 1);
+        NUMBER_OP(NUMBER_VAL, +);
+        DISPATCH();
+    CASE_CODE(ADD_STR):
+        if (!IS_STRING_OR_ROPE(peek(0)) || !IS_STRING_OR_ROPE(peek(1)))
+            DEOPTIMIZE(OP_ADD, 1);
+        concatenate();
+        DISPATCH();
+    CASE_CODE(ADD_LOCALS_NUM): {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = frame->slots[READ_BYTE()];
+        if (!BOTH_NUMBERS(a, b))
+            DEOPTIMIZE(OP_ADD_LOCALS, 3);
+        push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+    }
+    CASE_CODE(ADD_CONSTANT_NUM): {
+        // constants don't change, only the other operand needs checking
+        if (!IS_NUMBER(peek(0)))
+            DEOPTIMIZE(OP_ADD_CONSTANT, 1);
+        Value b = READ_CONSTANT();
+        vm.stack_top[-1] = NUMBER_VAL(AS_NUMBER(vm.stack_top[-1]) + AS_NUMBER(b));
+        DISPATCH();
+    }
+    CASE_CODE(GREATER_NUM):
+        if (!BOTH_NUMBERS(peek(0), peek(1)))
+            DEOPTIMIZE(OP_GREATER, 1);
+        NUMBER_OP(BOOL_VAL, >);
+        DISPATCH();
+    CASE_CODE(LESS_NUM):
+        if (!BOTH_NUMBERS(peek(0), peek(1)))
+            DEOPTIMIZE(OP_LESS, 1);
+        NUMBER_OP(BOOL_VAL, <);
+        DISPATCH();
+    CASE_CODE(CONSTANT_LONG): {
+        Value constant = frame->closure->function->chunk.constants.values[READ_LONG()];
+        push(constant);
+        DISPATCH();
+    }
+    CASE_CODE(JUMP_LONG): {
+        uint32_t offset = READ_LONG();
+        ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(LOOP_LONG): {
+        uint32_t offset = READ_LONG();
+        ip -= offset;
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(WIDE): {
+        uint8_t instruction = READ_BYTE();
+        operand = READ_SHORT();
+        switch (instruction) {
+        case OP_GET_LOCAL:
+            goto WIDE_CODE(GET_LOCAL);
+        case OP_SET_LOCAL:
+            goto WIDE_CODE(SET_LOCAL);
+        case OP_CLOSURE:
+            goto WIDE_CODE(CLOSURE);
+        case OP_CLASS:
+            goto WIDE_CODE(CLASS);
+        case OP_GET_PROPERTY:
+            goto WIDE_CODE(GET_PROPERTY);
+        case OP_SET_PROPERTY:
+            goto WIDE_CODE(SET_PROPERTY);
+        case OP_METHOD:
+            goto WIDE_CODE(METHOD);
+        case OP_INVOKE:
+            goto WIDE_CODE(INVOKE);
+        case OP_GET_SUPER:
+            goto WIDE_CODE(GET_SUPER);
+        case OP_SUPER_INVOKE:
+            goto WIDE_CODE(SUPER_INVOKE);
         }
-        case OP_GET_SUPER: {
-            ObjString* name = READ_STRING();
-            ObjClass* superclass = AS_CLASS(pop());
+        // the compiler doesn't put the prefix in front of anything else
+        DISPATCH();
+    }
+    }
+    // the switch falls out for a byte it has no case for, only a damaged chunk has one
+#ifdef COMPUTED_GOTO
+code_UNKNOWN:
+#endif
+    STORE_FRAME();
+    runtime_error("Unknown opcode %d.", ip[-1]);
+    return INTERPRET_RUNTIME_ERROR;
 
-            if (!bind_method(superclass, name)) {
-                return INTERPRET_RUNTIME_ERROR;
-            }
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_CONSTANT
+#undef OPERAND_CONSTANT
+#undef OPERAND_STRING
+#undef BINARY_OP
+#undef READ_CACHE
+#undef NOT_BOOL_VAL
+#undef ADD_VALUES
+#undef DEOPTIMIZE
+#undef NUMBER_OP
+#undef BOTH_NUMBERS
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef OUT_OF_MEMORY
+#undef SAFEPOINT
+#undef TRACE_EXECUTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef WIDE_CODE
+#undef DISPATCH
+}
 
-            break;
-        }
-        case OP_SUPER_INVOKE: {
-            ObjString* method = READ_STRING();
-            int arg_count = READ_BYTE();
-            ObjClass* superclass = AS_CLASS(pop());
-            if (!invoke_from_class(superclass, method, arg_count)) {
-                return INTERPRET_RUNTIME_ERROR;
+#ifdef DEBUG_TRACE_EXECUTION
+static void trace_registers(CallFrame* frame, uint8_t* ip)
+{
+    printf("          ");
+    for (Value* slot = frame->slots; slot < vm.stack_top; slot++) {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_register_instruction(
+        &frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+}
+#endif
+
+// Interpreter loop for code compiled by the register backend. A frame's registers are its window
+// of the value stack, vm.stack_top is kept right above them so that calls, natives and the GC see
+// the same layout as in the stack VM.
+static InterpretResult run_registers()
+{
+    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    uint8_t* ip = frame->ip;
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+// names and functions are two byte constant indexes
+#define READ_NAME_CONSTANT() (frame->closure->function->chunk.constants.values[READ_SHORT()])
+#define READ_STRING() AS_STRING(READ_NAME_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define R(index) (frame->slots[index])
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                                               \
+    (frame = &vm.frames[vm.frame_count - 1], ip = frame->ip,                                       \
+        vm.stack_top = frame->slots + frame->closure->function->register_count)
+// Registers above vm.stack_top are not GC roots. When a call moves vm.stack_top up, the registers
+// above the arguments may still hold values of an earlier frame the GC has since swept, so they are
+// cleared before they become visible.
+#define ENTER_FRAME()                                                                              \
+    do {                                                                                           \
+        Value* arguments_end = vm.stack_top;                                                       \
+        LOAD_FRAME();                                                                              \
+        for (Value* slot = arguments_end; slot < vm.stack_top; slot++) {                          \
+            *slot = NIL_VAL;                                                                       \
+        }                                                                                          \
+    } while (false)
+#define RUNTIME_ERROR(...)                                                                         \
+    do {                                                                                           \
+        STORE_FRAME();                                                                             \
+        runtime_error(__VA_ARGS__);                                                                \
+        return INTERPRET_RUNTIME_ERROR;                                                            \
+    } while (false)
+#define SAFEPOINT()                                                                                \
+    do {                                                                                           \
+        if (!safepoint())                                                                          \
+            RUNTIME_ERROR("Out of memory.");                                                       \
+    } while (false)
+#define BINARY_OP(value_type, op, right)                                                           \
+    do {                                                                                           \
+        uint8_t dst = READ_BYTE();                                                                 \
+        Value a = R(READ_BYTE());                                                                  \
+        Value b = right;                                                                           \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                                                        \
+            RUNTIME_ERROR("Operands must be numbers.");                                            \
+        R(dst) = value_type(AS_NUMBER(a) op AS_NUMBER(b));                                         \
+    } while (false)
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+#define ADD_VALUES(dst, a, b)                                                                      \
+    do {                                                                                           \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {                                                        \
+            R(dst) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));                                      \
+        } else if (IS_STRING_OR_ROPE(a) && IS_STRING_OR_ROPE(b)) {                                 \
+            push(a);                                                                               \
+            push(b);                                                                               \
+            concatenate();                                                                         \
+            R(dst) = pop();                                                                        \
+        } else {                                                                                   \
+            RUNTIME_ERROR("Operands must be two numbers or two strings.");                         \
+        }                                                                                          \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() trace_registers(frame, ip)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
+
+    ENTER_FRAME();
+
+#ifdef COMPUTED_GOTO
+    // bytes that are no opcode go where the switch falls out
+    static void* dispatch_table[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&code_UNKNOWN,
+        [ROP_MOVE] = &&code_MOVE,
+        [ROP_LOAD_CONSTANT] = &&code_LOAD_CONSTANT,
+        [ROP_NIL] = &&code_NIL,
+        [ROP_TRUE] = &&code_TRUE,
+        [ROP_FALSE] = &&code_FALSE,
+        [ROP_ADD] = &&code_ADD,
+        [ROP_ADD_CONSTANT] = &&code_ADD_CONSTANT,
+        [ROP_SUBTRACT] = &&code_SUBTRACT,
+        [ROP_SUBTRACT_CONSTANT] = &&code_SUBTRACT_CONSTANT,
+        [ROP_MULTIPLY] = &&code_MULTIPLY,
+        [ROP_DIVIDE] = &&code_DIVIDE,
+        [ROP_NEGATE] = &&code_NEGATE,
+        [ROP_NOT] = &&code_NOT,
+        [ROP_EQUAL] = &&code_EQUAL,
+        [ROP_NOT_EQUAL] = &&code_NOT_EQUAL,
+        [ROP_GREATER] = &&code_GREATER,
+        [ROP_GREATER_EQUAL] = &&code_GREATER_EQUAL,
+        [ROP_LESS] = &&code_LESS,
+        [ROP_LESS_EQUAL] = &&code_LESS_EQUAL,
+        [ROP_JUMP] = &&code_JUMP,
+        [ROP_JUMP_IF_FALSE] = &&code_JUMP_IF_FALSE,
+        [ROP_JUMP_IF_TRUE] = &&code_JUMP_IF_TRUE,
+        [ROP_LOOP] = &&code_LOOP,
+        [ROP_DEFINE_GLOBAL] = &&code_DEFINE_GLOBAL,
+        [ROP_GET_GLOBAL] = &&code_GET_GLOBAL,
+        [ROP_SET_GLOBAL] = &&code_SET_GLOBAL,
+        [ROP_GET_UPVALUE] = &&code_GET_UPVALUE,
+        [ROP_SET_UPVALUE] = &&code_SET_UPVALUE,
+        [ROP_CLOSE_UPVALUES] = &&code_CLOSE_UPVALUES,
+        [ROP_CLOSURE] = &&code_CLOSURE,
+        [ROP_CALL] = &&code_CALL,
+        [ROP_TAIL_CALL] = &&code_TAIL_CALL,
+        [ROP_RETURN] = &&code_RETURN,
+        [ROP_PRINT] = &&code_PRINT,
+        [ROP_CLASS] = &&code_CLASS,
+        [ROP_INHERIT] = &&code_INHERIT,
+        [ROP_METHOD] = &&code_METHOD,
+        [ROP_GET_PROPERTY] = &&code_GET_PROPERTY,
+        [ROP_SET_PROPERTY] = &&code_SET_PROPERTY,
+        [ROP_INVOKE] = &&code_INVOKE,
+        [ROP_GET_SUPER] = &&code_GET_SUPER,
+        [ROP_SUPER_INVOKE] = &&code_SUPER_INVOKE,
+        [ROP_LOAD_CONSTANT_LONG] = &&code_LOAD_CONSTANT_LONG,
+        [ROP_JUMP_LONG] = &&code_JUMP_LONG,
+        [ROP_LOOP_LONG] = &&code_LOOP_LONG,
+    };
+#define INTERPRET_LOOP DISPATCH();
+#define CASE_CODE(name) code_##name
+#define DISPATCH()                                                                                 \
+    do {                                                                                           \
+        TRACE_EXECUTION();                                                                         \
+        goto* dispatch_table[READ_BYTE()];                                                         \
+    } while (false)
+#else
+#define INTERPRET_LOOP                                                                             \
+    loop:                                                                                          \
+    TRACE_EXECUTION();                                                                             \
+    switch (READ_BYTE())
+#define CASE_CODE(name) case ROP_##name
+#define DISPATCH() goto loop
+#endif
+
+    INTERPRET_LOOP
+    {
+    CASE_CODE(MOVE): {
+        uint8_t dst = READ_BYTE();
+        R(dst) = R(READ_BYTE());
+        DISPATCH();
+    }
+    CASE_CODE(LOAD_CONSTANT): {
+        uint8_t dst = READ_BYTE();
+        R(dst) = READ_CONSTANT();
+        DISPATCH();
+    }
+    CASE_CODE(NIL):
+        R(READ_BYTE()) = NIL_VAL;
+        DISPATCH();
+    CASE_CODE(TRUE):
+        R(READ_BYTE()) = BOOL_VAL(true);
+        DISPATCH();
+    CASE_CODE(FALSE):
+        R(READ_BYTE()) = BOOL_VAL(false);
+        DISPATCH();
+    CASE_CODE(ADD): {
+        uint8_t dst = READ_BYTE();
+        Value a = R(READ_BYTE());
+        Value b = R(READ_BYTE());
+        ADD_VALUES(dst, a, b);
+        DISPATCH();
+    }
+    CASE_CODE(ADD_CONSTANT): {
+        uint8_t dst = READ_BYTE();
+        Value a = R(READ_BYTE());
+        Value b = READ_CONSTANT();
+        ADD_VALUES(dst, a, b);
+        DISPATCH();
+    }
+    CASE_CODE(SUBTRACT):
+        BINARY_OP(NUMBER_VAL, -, R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(SUBTRACT_CONSTANT):
+        BINARY_OP(NUMBER_VAL, -, READ_CONSTANT());
+        DISPATCH();
+    CASE_CODE(MULTIPLY):
+        BINARY_OP(NUMBER_VAL, *, R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(DIVIDE):
+        BINARY_OP(NUMBER_VAL, /, R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(NEGATE): {
+        uint8_t dst = READ_BYTE();
+        Value value = R(READ_BYTE());
+        if (!IS_NUMBER(value))
+            RUNTIME_ERROR("Operand must be a number.");
+        R(dst) = NUMBER_VAL(-AS_NUMBER(value));
+        DISPATCH();
+    }
+    CASE_CODE(NOT): {
+        uint8_t dst = READ_BYTE();
+        R(dst) = BOOL_VAL(is_falsey(R(READ_BYTE())));
+        DISPATCH();
+    }
+    CASE_CODE(EQUAL): {
+        uint8_t dst = READ_BYTE();
+        Value a = flat_value(R(READ_BYTE()));
+        Value b = flat_value(R(READ_BYTE()));
+        R(dst) = BOOL_VAL(values_equal(a, b));
+        DISPATCH();
+    }
+    CASE_CODE(NOT_EQUAL): {
+        uint8_t dst = READ_BYTE();
+        Value a = flat_value(R(READ_BYTE()));
+        Value b = flat_value(R(READ_BYTE()));
+        R(dst) = BOOL_VAL(!values_equal(a, b));
+        DISPATCH();
+    }
+    CASE_CODE(GREATER):
+        BINARY_OP(BOOL_VAL, >, R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(GREATER_EQUAL):
+        BINARY_OP(NOT_BOOL_VAL, <, R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(LESS):
+        BINARY_OP(BOOL_VAL, <, R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(LESS_EQUAL):
+        BINARY_OP(NOT_BOOL_VAL, >, R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(JUMP): {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(JUMP_IF_FALSE): {
+        Value condition = R(READ_BYTE());
+        uint16_t offset = READ_SHORT();
+        if (is_falsey(condition))
+            ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(JUMP_IF_TRUE): {
+        Value condition = R(READ_BYTE());
+        uint16_t offset = READ_SHORT();
+        if (!is_falsey(condition))
+            ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(LOOP): {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(DEFINE_GLOBAL): {
+        Value value = R(READ_BYTE());
+        vm.global_values.values[READ_SHORT()] = value;
+        DISPATCH();
+    }
+    CASE_CODE(GET_GLOBAL): {
+        uint8_t dst = READ_BYTE();
+        uint16_t slot = READ_SHORT();
+        Value value = vm.global_values.values[slot];
+        if (IS_UNDEFINED(value))
+            RUNTIME_ERROR("Undefined variable '%s'.", global_name(slot)->chars);
+        R(dst) = value;
+        DISPATCH();
+    }
+    CASE_CODE(SET_GLOBAL): {
+        Value value = R(READ_BYTE());
+        uint16_t slot = READ_SHORT();
+        Value* global = &vm.global_values.values[slot];
+        if (IS_UNDEFINED(*global))
+            RUNTIME_ERROR("Undefined variable '%s'.", global_name(slot)->chars);
+        *global = value;
+        DISPATCH();
+    }
+    CASE_CODE(GET_UPVALUE): {
+        uint8_t dst = READ_BYTE();
+        R(dst) = *frame->closure->upvalues[READ_BYTE()]->location;
+        DISPATCH();
+    }
+    CASE_CODE(SET_UPVALUE): {
+        Value value = R(READ_BYTE());
+        ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+        *upvalue->location = value;
+        write_barrier((Obj*)upvalue, value);
+        DISPATCH();
+    }
+    CASE_CODE(CLOSE_UPVALUES):
+        close_upvalues(&R(READ_BYTE()));
+        DISPATCH();
+    CASE_CODE(CLOSURE): {
+        uint8_t dst = READ_BYTE();
+        ObjFunction* function = AS_FUNCTION(READ_NAME_CONSTANT());
+        ObjClosure* closure = new_closure(function);
+        R(dst) = OBJ_VAL(closure);
+        for (int i = 0; i < closure->upvalue_count; i++) {
+            uint8_t is_local = READ_BYTE();
+            uint8_t index = READ_BYTE();
+            if (is_local) {
+                closure->upvalues[i] = capture_upvalue(frame->slots + index);
+            } else {
+                closure->upvalues[i] = frame->closure->upvalues[index];
             }
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
         }
-        default:
-            break;
+        DISPATCH();
+    }
+    CASE_CODE(CALL): {
+        Value* callee = &R(READ_BYTE());
+        int arg_count = READ_BYTE();
+        vm.stack_top = callee + arg_count + 1;
+        STORE_FRAME();
+        if (!call_value(*callee, arg_count))
+            return INTERPRET_RUNTIME_ERROR;
+        ENTER_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(TAIL_CALL): {
+        Value* callee = &R(READ_BYTE());
+        int arg_count = READ_BYTE();
+        vm.stack_top = callee + arg_count + 1;
+        STORE_FRAME();
+        int frame_count = vm.frame_count;
+        if (!call_value(*callee, arg_count))
+            return INTERPRET_RUNTIME_ERROR;
+        if (vm.frame_count > frame_count) {
+            replace_caller_frame();
+        }
+        ENTER_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(RETURN): {
+        Value result = R(READ_BYTE());
+        close_upvalues(frame->slots);
+        vm.frame_count--;
+        if (vm.frame_count == 0) {
+            vm.stack_top = vm.stack;
+            return INTERPRET_OK;
         }
+
+        // the callee's first register is the one the caller reserved for the result, the
+        // caller's registers above it were not kept alive during the call
+        frame->slots[0] = result;
+        Value* result_end = frame->slots + 1;
+        LOAD_FRAME();
+        for (Value* slot = result_end; slot < vm.stack_top; slot++) {
+            *slot = NIL_VAL;
+        }
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(PRINT):
+        print_value(R(READ_BYTE()));
+        printf("\n");
+        DISPATCH();
+    CASE_CODE(CLASS): {
+        uint8_t dst = READ_BYTE();
+        R(dst) = OBJ_VAL(new_class(READ_STRING()));
+        DISPATCH();
     }
+    CASE_CODE(INHERIT): {
+        ObjClass* subclass = AS_CLASS(R(READ_BYTE()));
+        Value superclass = R(READ_BYTE());
+        if (!IS_CLASS(superclass))
+            RUNTIME_ERROR("Superclass must be a class.");
+        inherit(AS_CLASS(superclass), subclass);
+        DISPATCH();
+    }
+    CASE_CODE(METHOD): {
+        ObjClass* klass = AS_CLASS(R(READ_BYTE()));
+        Value method = R(READ_BYTE());
+        ObjString* name = READ_STRING();
+        table_set(&klass->methods, name, method);
+        write_barrier((Obj*)klass, OBJ_VAL(name));
+        write_barrier((Obj*)klass, method);
+        DISPATCH();
+    }
+    CASE_CODE(GET_PROPERTY): {
+        uint8_t dst = READ_BYTE();
+        Value object = R(READ_BYTE());
+        if (!IS_INSTANCE(object))
+            RUNTIME_ERROR("Only instances have properties.");
+
+        ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
+        push(object);
+        STORE_FRAME();
+        if (!get_property(AS_INSTANCE(object), name, cache))
+            return INTERPRET_RUNTIME_ERROR;
+        R(dst) = pop();
+        DISPATCH();
+    }
+    CASE_CODE(SET_PROPERTY): {
+        Value object = R(READ_BYTE());
+        ObjString* name = READ_STRING();
+        Value value = R(READ_BYTE());
+        InlineCache* cache = READ_CACHE();
+        if (!IS_INSTANCE(object))
+            RUNTIME_ERROR("Only instances have fields.");
+        set_field(cache, AS_INSTANCE(object), name, value);
+        DISPATCH();
+    }
+    CASE_CODE(INVOKE): {
+        Value* receiver = &R(READ_BYTE());
+        ObjString* method = READ_STRING();
+        int arg_count = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
+        vm.stack_top = receiver + arg_count + 1;
+        STORE_FRAME();
+        if (!invoke(method, arg_count, cache))
+            return INTERPRET_RUNTIME_ERROR;
+        ENTER_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(GET_SUPER): {
+        uint8_t dst = READ_BYTE();
+        Value receiver = R(READ_BYTE());
+        ObjClass* superclass = AS_CLASS(R(READ_BYTE()));
+        ObjString* name = READ_STRING();
+
+        push(receiver);
+        STORE_FRAME();
+        if (!bind_method(superclass, name))
+            return INTERPRET_RUNTIME_ERROR;
+        R(dst) = pop();
+        DISPATCH();
+    }
+    CASE_CODE(SUPER_INVOKE): {
+        Value* receiver = &R(READ_BYTE());
+        ObjString* method = READ_STRING();
+        int arg_count = READ_BYTE();
+        ObjClass* superclass = AS_CLASS(R(READ_BYTE()));
+        InlineCache* cache = READ_CACHE();
+        vm.stack_top = receiver + arg_count + 1;
+        STORE_FRAME();
+        if (!invoke_from_class(superclass, method, arg_count, cache))
+            return INTERPRET_RUNTIME_ERROR;
+        ENTER_FRAME();
+        SAFEPOINT();
+        DISPATCH();
+    }
+    CASE_CODE(LOAD_CONSTANT_LONG): {
+        uint8_t dst = READ_BYTE();
+        R(dst) = frame->closure->function->chunk.constants.values[READ_LONG()];
+        DISPATCH();
+    }
+    CASE_CODE(JUMP_LONG): {
+        uint32_t offset = READ_LONG();
+        ip += offset;
+        DISPATCH();
+    }
+    CASE_CODE(LOOP_LONG): {
+        uint32_t offset = READ_LONG();
+        ip -= offset;
+        SAFEPOINT();
+        DISPATCH();
+    }
+    }
+    // the switch falls out for a byte it has no case for, only a damaged chunk has one
+#ifdef COMPUTED_GOTO
+code_UNKNOWN:
+#endif
+    RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
-#undef BINARY_OP
+#undef READ_NAME_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef R
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef ENTER_FRAME
+#undef RUNTIME_ERROR
+#undef SAFEPOINT
+#undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef ADD_VALUES
+#undef TRACE_EXECUTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char* source)
 {
-    ObjFunction* function = compile(source);
+    ObjFunction* function = compile(source, vm.backend);
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
+    return interpret_function(function);
+}
 
+InterpretResult interpret_function(ObjFunction* function)
+{
     push(OBJ_VAL(function));
     ObjClosure* closure = new_closure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    return vm.backend == BACKEND_REGISTER ? run_registers() : run();
 }
 
 void push(Value value)
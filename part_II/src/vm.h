@@ -5,9 +5,49 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "compiler.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The frames and the value stack start out this big and double whenever a call needs more room
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+// default limit on the call depth, overridden with --max-depth
+#define FRAMES_MAX 100000
+// slots a frame gets above its max_slots, for values the VM and natives push while they run
+#define FRAME_EXTRA_SLOTS 8
+// a runtime error's trace shows this many of the innermost and of the outermost frames
+#define TRACE_FRAMES_SHOWN 10
+// refills after which an inline cache gives up and its instruction always does the full lookup
+#define INLINE_CACHE_MAX_MISSES 8
+
+typedef enum { GC_IDLE, GC_MARK, GC_SWEEP } GcPhase;
+
+// full collections GcStats keeps the history of
+#define GC_STATS_HISTORY 32
+
+// what the collector did so far, read by the gcStats() native and by --gc-stats
+typedef struct {
+    int collections; // full ones, counted when they start
+    int young_collections;
+    int pauses;
+    double total_pause; // in seconds
+    double worst_pause;
+    size_t promoted; // bytes moved to the old generation
+    size_t total_freed;
+    size_t live_bytes[OBJ_TYPE_COUNT]; // by ObjType, as the last full collection left them
+    int cycles; // full collections that finished, their history is in rings indexed modulo
+    size_t freed_history[GC_STATS_HISTORY]; // bytes each one freed
+    size_t next_gc_history[GC_STATS_HISTORY]; // the threshold each one set
+} GcStats;
+
+// The heuristics of the collector, set from CLOX_GC_* environment variables and --gc-* flags (see
+// gcpolicy.h). Sizes are in bytes of vm.bytes_allocated, the nursery comes on top of them.
+typedef struct {
+    size_t initial_heap; // the first full collection starts past this
+    double growth_factor; // the next one starts once the heap has grown this much past the live data
+    size_t min_heap; // the threshold never goes below this
+    size_t max_heap; // the hard limit, 0 for none
+    double cpu_share; // the share of the time the collector should take at most, 0 to not adapt
+} GcPolicy;
 
 typedef struct {
     ObjClosure* closure;
@@ -16,20 +56,48 @@ typedef struct {
 } CallFrame;
 
 typedef struct {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frame_count;
+    int frame_capacity;
+    int max_frames;
     Value* stack_top;
-    Value stack[STACK_MAX];
+    Value* stack; // moves when it grows, pointers into it must not be held across a call
+    int stack_capacity;
     Table strings;
     ObjString* init_string;
     ObjUpvalue* open_upvalues;
-    Table globals;
-    size_t bytes_allocated;
+    Table global_names; // global name -> index in global_values, filled in by the compiler
+    ValueArray global_values; // UNDEFINED_VAL until the global is defined
+    size_t bytes_allocated; // of the old generation and of young objects outside the nursery
     size_t next_gc;
     Obj* objects;
+    uint8_t* nursery;
+    uint8_t* nursery_top;
+    uint8_t* nursery_end;
+#ifdef SLAB_ALLOC
+    uint64_t* nursery_marks; // mark bits of the nursery objects, one for every 8 bytes
+#endif
+    Obj* young_objects; // the ones that didn't fit in the nursery
+    bool gc_requested; // a young collection or an incremental slice is due at the next safepoint
+    Obj** remembered; // old objects that may point to young ones
+    int remembered_count;
+    int remembered_capacity;
+    bool incremental_gc; // full collections run in slices at safepoints, see gc_safepoint()
+    int gc_slice_budget; // objects one slice marks or sweeps
+    GcPhase gc_phase;
+    size_t gc_debt; // bytes allocated since the last slice
+    Obj* sweep_list; // old objects the sweep hasn't reached yet, it runs in slices after marking
+    Obj* swept; // the survivors so far, still linked as they were up to swept_last
+    Obj* swept_last;
+    int gc_threads; // threads marking in a full collection, 1 marks on the VM's own thread
+    GcStats gc_stats;
+    GcPolicy gc_policy;
+    bool heap_exhausted; // still over gc_policy.max_heap after a full collection, or out of memory
     int gray_count;
     int gray_capacity;
     Obj** gray_stack;
+    Backend backend;
+    bool jit_enabled; // hot functions of the stack backend get compiled to native code
 } VM;
 
 typedef enum { INTERPRET_OK, INTERPRET_COMPILE_ERROR, INTERPRET_RUNTIME_ERROR } InterpretResult;
@@ -39,6 +107,13 @@ extern VM vm;
 void init_VM();
 void free_VM();
 InterpretResult interpret(const char* source);
+// runs a script that was compiled (or loaded) before
+InterpretResult interpret_function(ObjFunction* function);
+void set_max_depth(int frames);
+// returns the index of global name in vm.global_values, adding an undefined global when there is
+// none yet, or -1 when there is no index left
+int global_slot(ObjString* name);
+ObjString* global_name(int slot);
 void push(Value value);
 Value pop();
 